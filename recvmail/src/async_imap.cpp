@@ -0,0 +1,158 @@
+#include "async_imap.h"
+
+asyncImap::asyncImap(mailImap * imap, threadPool& pool)
+    : m_strand(make_shared<strand>())
+{
+    m_strand->imap = imap;
+    m_strand->pool = &pool;
+}
+
+asyncImap::~asyncImap()
+{
+    unique_lock<mutex> lock(m_strand->lock);
+    m_strand->finished.wait(lock, [this]() { return !m_strand->running && m_strand->tasks.empty(); });
+}
+
+/*
+a session has at most one task posted to the pool at a time: it runs
+the first queued operation and posts itself again for the next one, so
+that a session with a long queue does not hold a thread while other
+sessions are waiting.
+*/
+
+void asyncImap::post(const shared_ptr<strand>& s, function<void()> task)
+{
+    bool start = false;
+
+    {
+        lock_guard<mutex> lock(s->lock);
+        s->tasks.push(move(task));
+        s->pending++;
+        if (!s->running) {
+            s->running = true;
+            start = true;
+        }
+    }
+
+    if (start)
+        s->pool->post([s]() { runNext(s); });
+}
+
+void asyncImap::runNext(shared_ptr<strand> s)
+{
+    function<void()> task;
+
+    {
+        lock_guard<mutex> lock(s->lock);
+        task = move(s->tasks.front());
+        s->tasks.pop();
+    }
+
+    // a completion callback that throws must not stop the session, nobody could catch it on the pool thread
+    try {
+        task();
+    }
+    catch (...) {
+    }
+
+    {
+        lock_guard<mutex> lock(s->lock);
+        s->pending--;
+        if (s->tasks.empty()) {
+            s->running = false;
+            s->finished.notify_all();
+            return;
+        }
+    }
+
+    s->pool->post([s]() { runNext(s); });
+}
+
+future<int> asyncImap::connect()
+{
+    return run([](mailImap& imap) { return imap.connect(); });
+}
+
+future<int> asyncImap::login()
+{
+    return run([](mailImap& imap) { return imap.login(); });
+}
+
+future<imapResult<string> > asyncImap::getMessageByUid(const string& folder, uint32_t uid)
+{
+    return run([folder, uid](mailImap& imap) {
+        imapResult<string> result;
+        result.error = imap.getMessageByUid(folder, uid, result.value);
+        return result;
+    });
+}
+
+future<imapResult<folderStatus> > asyncImap::getfolderStatus(const string& folder)
+{
+    return run([folder](mailImap& imap) {
+        imapResult<folderStatus> result;
+        result.error = imap.getfolderStatus(folder, &result.value);
+        return result;
+    });
+}
+
+future<imapResult<vector<folderStatus> > > asyncImap::getFoldersStatus(const vector<string>& folders)
+{
+    return run([folders](mailImap& imap) {
+        imapResult<vector<folderStatus> > result;
+        result.error = imap.getFoldersStatus(folders, result.value);
+        return result;
+    });
+}
+
+future<imapResult<vector<imapFolder> > > asyncImap::fetchAllFolders()
+{
+    return run([](mailImap& imap) {
+        imapResult<vector<imapFolder> > result;
+        result.error = imap.fetchAllFolders(result.value);
+        return result;
+    });
+}
+
+void asyncImap::connect(function<void(int error)> callback)
+{
+    mailImap * imap = m_strand->imap;
+    post(m_strand, [imap, callback]() { callback(imap->connect()); });
+}
+
+void asyncImap::login(function<void(int error)> callback)
+{
+    mailImap * imap = m_strand->imap;
+    post(m_strand, [imap, callback]() { callback(imap->login()); });
+}
+
+void asyncImap::getMessageByUid(const string& folder, uint32_t uid, function<void(int error, string& data)> callback)
+{
+    mailImap * imap = m_strand->imap;
+    post(m_strand, [imap, folder, uid, callback]() {
+        string data;
+        int r = imap->getMessageByUid(folder, uid, data);
+        callback(r, data);
+    });
+}
+
+void asyncImap::getfolderStatus(const string& folder, function<void(int error, folderStatus& status)> callback)
+{
+    mailImap * imap = m_strand->imap;
+    post(m_strand, [imap, folder, callback]() {
+        folderStatus status;
+        int r = imap->getfolderStatus(folder, &status);
+        callback(r, status);
+    });
+}
+
+size_t asyncImap::pending() const
+{
+    lock_guard<mutex> lock(m_strand->lock);
+    return m_strand->pending;
+}
+
+mailImap * asyncImap::imap() const
+{
+    return m_strand->imap;
+}
@@ -0,0 +1,97 @@
+#ifndef __ASYNC_IMAP_H__
+#define __ASYNC_IMAP_H__
+
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <future>
+#include <string>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "imap.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// error is what the synchronous method returned, value is meaningful when it is ErrorNone
+template <class T>
+class imapResult
+{
+public:
+    int error = ErrorNone;
+    T value;
+};
+
+/*
+the methods of a mailImap session, returning at once.
+
+the operations of a session run one after the other in the order they
+were called, on the threads of a pool shared by every session: a
+session only holds a thread while one of its operations is on the
+network, so a few threads serve many sessions that are mostly waiting.
+the pool is what bounds the number of round trips in flight.
+
+the session must not be used directly while operations are queued.
+*/
+class asyncImap
+{
+public:
+    asyncImap(mailImap * imap, threadPool& pool);
+    // waits for the queued operations
+    ~asyncImap();
+    asyncImap(const asyncImap&) = delete;
+    asyncImap& operator=(const asyncImap&) = delete;
+
+    // task(mailImap&) runs after the operations already queued on this session
+    template <class Task>
+    auto run(Task task) -> future<decltype(task(declval<mailImap&>()))>
+    {
+        typedef decltype(task(declval<mailImap&>())) result;
+        mailImap * imap = m_strand->imap;
+        shared_ptr<packaged_task<result()> > packaged =
+            make_shared<packaged_task<result()> >([task, imap]() mutable { return task(*imap); });
+        future<result> f = packaged->get_future();
+
+        post(m_strand, [packaged]() { (*packaged)(); });
+        return f;
+    }
+
+    future<int> connect();
+    future<int> login();
+    future<imapResult<string> > getMessageByUid(const string& folder, uint32_t uid);
+    future<imapResult<folderStatus> > getfolderStatus(const string& folder);
+    future<imapResult<vector<folderStatus> > > getFoldersStatus(const vector<string>& folders);
+    future<imapResult<vector<imapFolder> > > fetchAllFolders();
+
+    // the same with a completion callback, called on a thread of the pool. an exception
+    // thrown by the callback is dropped, the next operations run anyway
+    void connect(function<void(int error)> callback);
+    void login(function<void(int error)> callback);
+    void getMessageByUid(const string& folder, uint32_t uid, function<void(int error, string& data)> callback);
+    void getfolderStatus(const string& folder, function<void(int error, folderStatus& status)> callback);
+
+    // operations queued and not finished yet
+    size_t pending() const;
+    mailImap * imap() const;
+
+private:
+    struct strand {
+        mailImap *  imap;
+        threadPool * pool;
+        mutable mutex lock;
+        condition_variable finished;
+        queue<function<void()> > tasks;
+        size_t      pending = 0;
+        bool        running = false;
+    };
+
+    static void post(const shared_ptr<strand>& s, function<void()> task);
+    static void runNext(shared_ptr<strand> s);
+
+    shared_ptr<strand> m_strand;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include "attachment_downloader.h"
+#include "decoder.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#define BACKOFF_MAX 30
+// bytes read at once when decoding the downloaded part
+#define DECODE_BLOCK_SIZE (64 * 1024)
+
+attachmentDownloader::attachmentDownloader(connectionPool& pool, const string& server, uint16_t port,
+    const string& user, const string& password)
+    : m_pool(pool)
+    , m_server(server)
+    , m_port(port)
+    , m_user(user)
+    , m_password(password)
+{
+}
+
+void attachmentDownloader::setConnections(size_t connections)
+{
+    m_connections = connections > 0 ? connections : 1;
+}
+
+size_t attachmentDownloader::getConnections() const
+{
+    return m_connections;
+}
+
+void attachmentDownloader::setChunkSize(uint32_t chunkSize)
+{
+    m_chunkSize = chunkSize > 0 ? chunkSize : 1;
+}
+
+uint32_t attachmentDownloader::getChunkSize() const
+{
+    return m_chunkSize;
+}
+
+void attachmentDownloader::setMaxRetries(unsigned int maxRetries)
+{
+    m_maxRetries = maxRetries;
+}
+
+size_t attachmentDownloader::getResumedChunks() const
+{
+    return m_resumedChunks;
+}
+
+size_t attachmentDownloader::getFetchedChunks() const
+{
+    return m_fetchedChunks;
+}
+
+int attachmentDownloader::download(const string& folder, uint32_t uid, const imapPart& part, const string& path)
+{
+    return download(folder, uid, part.partId(), part.encoding(), part.size(), path);
+}
+
+int attachmentDownloader::download(const string& folder, uint32_t uid, const string& partId, Encoding encoding,
+    uint32_t encodedSize, const string& path)
+{
+    downloadState d;
+    int r;
+
+    d.folder = folder;
+    d.uid = uid;
+    d.partId = partId;
+    d.encoding = encoding;
+    d.partPath = path + ".part";
+    d.journalPath = path + ".journal";
+    m_resumedChunks = 0;
+    m_fetchedChunks = 0;
+
+    r = openJournal(d, encodedSize);
+    if (r != ErrorNone)
+        return r;
+
+    size_t missing = count(d.done.begin(), d.done.end(), false);
+    vector<thread> threads;
+    for (size_t i = 0; i < min(m_connections, missing); i++)
+        threads.push_back(thread(&attachmentDownloader::work, this, ref(d)));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // what was written stays for the next attempt
+    if (d.error != ErrorNone)
+        return d.error;
+
+    return decode(d, path);
+}
+
+static uint64_t file_size(const string& path)
+{
+    ifstream in(path.c_str(), ios::in | ios::binary | ios::ate);
+    if (!in.is_open())
+        return (uint64_t) -1;
+    return (uint64_t) in.tellg();
+}
+
+/*
+the journal starts with "encodedSize chunkSize" and has one
+"index length" line per chunk written. a journal that does not match
+the part asked for, or without its .part file, is started again.
+*/
+
+int attachmentDownloader::openJournal(downloadState& d, uint32_t encodedSize)
+{
+    size_t chunks = ((uint64_t) encodedSize + m_chunkSize - 1) / m_chunkSize;
+    ifstream in(d.journalPath.c_str(), ios::in | ios::binary);
+    string line;
+
+    d.done.assign(chunks, false);
+    d.lengths.assign(chunks, 0);
+
+    if (in.is_open() && getline(in, line) && file_size(d.partPath) == encodedSize) {
+        istringstream header(line);
+        uint64_t size = 0;
+        uint64_t chunkSize = 0;
+
+        if ((header >> size >> chunkSize) && size == encodedSize && chunkSize == m_chunkSize) {
+            while (getline(in, line)) {
+                istringstream record(line);
+                size_t index;
+                uint32_t length;
+
+                // a line cut by a crash is ignored, the chunk is fetched again
+                if (!(record >> index >> length) || index >= chunks || length > m_chunkSize)
+                    continue;
+                if (!d.done[index])
+                    m_resumedChunks++;
+                d.done[index] = true;
+                d.lengths[index] = length;
+            }
+            return ErrorNone;
+        }
+    }
+    in.close();
+
+    ofstream part(d.partPath.c_str(), ios::out | ios::binary | ios::trunc);
+    if (encodedSize > 0) {
+        part.seekp(encodedSize - 1);
+        part.put('\0');
+    }
+    part.close();
+    if (part.fail())
+        return ErrorFile;
+
+    ofstream journal(d.journalPath.c_str(), ios::out | ios::binary | ios::trunc);
+    journal << encodedSize << ' ' << m_chunkSize << '\n';
+    journal.close();
+    if (journal.fail())
+        return ErrorFile;
+
+    return ErrorNone;
+}
+
+int attachmentDownloader::recordChunk(downloadState& d, size_t index, uint32_t length)
+{
+    lock_guard<mutex> lock(d.lock);
+    ofstream journal(d.journalPath.c_str(), ios::out | ios::binary | ios::app);
+
+    journal << index << ' ' << length << '\n';
+    journal.close();
+    if (journal.fail())
+        return ErrorFile;
+
+    d.done[index] = true;
+    d.lengths[index] = length;
+    m_fetchedChunks++;
+    return ErrorNone;
+}
+
+int attachmentDownloader::fetchChunk(downloadState& d, mailImap *& imap, size_t index)
+{
+    uint64_t offset = (uint64_t) index * m_chunkSize;
+    string partId = d.partId;
+    imapBuffer data;
+    int r;
+
+    if (imap == NULL) {
+        r = m_pool.acquire(m_server, m_port, m_user, m_password, d.folder, imap);
+        if (r != ErrorNone) {
+            imap = NULL;
+            return r;
+        }
+    }
+
+    // chunks come from the encoded size, none starts past the end: a failed fetch is an error
+    r = imap->getMessageAttachmentRangeByUid(d.folder, d.uid, partId, d.encoding, (uint32_t) offset, m_chunkSize, data);
+    if (r != ErrorNone) {
+        m_pool.release(imap, r);
+        imap = NULL;
+        return r;
+    }
+
+    // every thread writes its own chunks through its own stream, they never overlap
+    fstream part(d.partPath.c_str(), ios::in | ios::out | ios::binary);
+    part.seekp(offset);
+    part.write(data.data(), data.size());
+    part.close();
+    if (part.fail())
+        return ErrorFile;
+
+    return recordChunk(d, index, (uint32_t) data.size());
+}
+
+static bool is_transient(int error)
+{
+    return error == ErrorConnection || error == ErrorParse ||
+        error == ErrorGmailTooManySimultaneousConnections || error == ErrorGmailExceededBandwidthLimit;
+}
+
+void attachmentDownloader::work(downloadState& d)
+{
+    mailImap * imap = NULL;
+
+    for (;;) {
+        size_t index;
+
+        {
+            lock_guard<mutex> lock(d.lock);
+            while (d.next < d.done.size() && d.done[d.next])
+                d.next++;
+            if (d.error != ErrorNone || d.next == d.done.size())
+                break;
+            index = d.next++;
+        }
+
+        unsigned int attempts = 0;
+        int r;
+
+        while ((r = fetchChunk(d, imap, index)) != ErrorNone) {
+            attempts++;
+            if (!is_transient(r) || attempts > m_maxRetries)
+                break;
+            this_thread::sleep_for(chrono::seconds(min<unsigned int>(1u << (attempts - 1), BACKOFF_MAX)));
+        }
+
+        if (r != ErrorNone) {
+            lock_guard<mutex> lock(d.lock);
+            if (d.error == ErrorNone)
+                d.error = r;
+            break;
+        }
+    }
+
+    if (imap != NULL)
+        m_pool.release(imap);
+}
+
+static size_t decodable_prefix(const char * data, size_t length, Encoding encoding)
+{
+    switch (encoding) {
+    case EncodingBase64:
+        return base64_decodable_length(data, length);
+    case EncodingQuotedPrintable:
+        return quoted_printable_decodable_length(data, length);
+    case EncodingUUEncode:
+        return uuencode_decodable_length(data, length);
+    default:
+        return length;
+    }
+}
+
+static size_t decode_in_place(char * data, size_t length, Encoding encoding)
+{
+    switch (encoding) {
+    case EncodingBase64:
+        return decode_base64(data, length, data);
+    case EncodingQuotedPrintable:
+        return decode_quoted_printable(data, length, data);
+    case EncodingUUEncode:
+        return decode_uuencode(data, length, data);
+    default:
+        return length;
+    }
+}
+
+int attachmentDownloader::decode(downloadState& d, const string& path)
+{
+    uint64_t end = 0;
+    string tmpPath = path + ".tmp";
+
+    // the part ends with the first chunk that came back short
+    for (size_t i = 0; i < d.lengths.size(); i++) {
+        end += d.lengths[i];
+        if (d.lengths[i] < m_chunkSize)
+            break;
+    }
+
+    {
+        ifstream in(d.partPath.c_str(), ios::in | ios::binary);
+        ofstream out(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+        string pending;
+        vector<char> block(DECODE_BLOCK_SIZE);
+
+        if (!in.is_open() || !out.is_open())
+            return ErrorFile;
+
+        while (end > 0) {
+            size_t length = (size_t) min<uint64_t>(end, block.size());
+
+            if (!in.read(&block[0], length))
+                return ErrorFile;
+            end -= length;
+
+            pending.append(&block[0], length);
+            length = decodable_prefix(pending.data(), pending.size(), d.encoding);
+            out.write(pending.data(), decode_in_place(&pending[0], length, d.encoding));
+            pending.erase(0, length);
+        }
+        if (!pending.empty())
+            out.write(pending.data(), decode_in_place(&pending[0], pending.size(), d.encoding));
+
+        out.close();
+        if (out.fail())
+            return ErrorFile;
+    }
+
+    if (!replace_file(tmpPath, path))
+        return ErrorFile;
+
+    remove(d.partPath.c_str());
+    remove(d.journalPath.c_str());
+    return ErrorNone;
+}
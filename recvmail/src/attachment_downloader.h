@@ -0,0 +1,78 @@
+#ifndef __ATTACHMENT_DOWNLOADER_H__
+#define __ATTACHMENT_DOWNLOADER_H__
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "imap.h"
+#include "connection_pool.h"
+
+using namespace std;
+
+/*
+one large part downloaded by ranges, over several connections.
+
+the encoded part is fetched in chunks of chunkSize bytes written in
+place in path.part, allocated to the size of the part first. every
+chunk written is recorded in path.journal, so that a download that
+failed (a dropped connection, the program stopped) starts again from
+the chunks still missing. when every chunk is there the part is decoded
+to path and the two work files are removed.
+*/
+class attachmentDownloader
+{
+public:
+    attachmentDownloader(connectionPool& pool, const string& server, uint16_t port,
+        const string& user, const string& password);
+
+    // part comes from getBodyStructure(), its size is the encoded size
+    int download(const string& folder, uint32_t uid, const imapPart& part, const string& path);
+    int download(const string& folder, uint32_t uid, const string& partId, Encoding encoding,
+        uint32_t encodedSize, const string& path);
+
+    void setConnections(size_t connections);
+    size_t getConnections() const;
+    void setChunkSize(uint32_t chunkSize);
+    uint32_t getChunkSize() const;
+    // attempts of a chunk before the download stops, what was downloaded is kept
+    void setMaxRetries(unsigned int maxRetries);
+
+    // chunks found in the journal and chunks fetched by the last download
+    size_t getResumedChunks() const;
+    size_t getFetchedChunks() const;
+
+private:
+    struct downloadState {
+        string      folder;
+        uint32_t    uid = 0;
+        string      partId;
+        Encoding    encoding = Encoding7Bit;
+        string      partPath;
+        string      journalPath;
+        vector<bool> done;
+        vector<uint32_t> lengths;   // bytes written of each chunk done, less than chunkSize at the end
+        size_t      next = 0;
+        int         error = ErrorNone;
+        mutex       lock;
+    };
+
+    int openJournal(downloadState& d, uint32_t encodedSize);
+    int recordChunk(downloadState& d, size_t index, uint32_t length);
+    void work(downloadState& d);
+    int fetchChunk(downloadState& d, mailImap *& imap, size_t index);
+    int decode(downloadState& d, const string& path);
+
+    connectionPool& m_pool;
+    string      m_server;
+    uint16_t    m_port;
+    string      m_user;
+    string      m_password;
+    size_t      m_connections = 4;
+    uint32_t    m_chunkSize = 1024 * 1024;
+    unsigned int m_maxRetries = 5;
+    size_t      m_resumedChunks = 0;
+    size_t      m_fetchedChunks = 0;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include "capability_cache.h"
+#include <stdio.h>
+#include <algorithm>
+
+string capabilityCache::serverKey(const string& server, uint16_t port)
+{
+    string key = server;
+    char portString[8];
+
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+    sprintf_s(portString, sizeof(portString), "%u", (unsigned) port);
+    return key + ":" + portString;
+}
+
+bool capabilityCache::getBeforeLogin(const string& server, uint16_t port, vector<string>& capabilities) const
+{
+    lock_guard<mutex> lock(m_mutex);
+    map<string, serverCapabilities>::const_iterator it = m_servers.find(serverKey(server, port));
+
+    if (it == m_servers.end() || it->second.beforeLogin.empty())
+        return false;
+    capabilities = it->second.beforeLogin;
+    return true;
+}
+
+bool capabilityCache::getAfterLogin(const string& server, uint16_t port, vector<string>& capabilities) const
+{
+    lock_guard<mutex> lock(m_mutex);
+    map<string, serverCapabilities>::const_iterator it = m_servers.find(serverKey(server, port));
+
+    if (it == m_servers.end() || it->second.afterLogin.empty())
+        return false;
+    capabilities = it->second.afterLogin;
+    return true;
+}
+
+void capabilityCache::setBeforeLogin(const string& server, uint16_t port, const vector<string>& capabilities)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_servers[serverKey(server, port)].beforeLogin = capabilities;
+}
+
+void capabilityCache::setAfterLogin(const string& server, uint16_t port, const vector<string>& capabilities)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_servers[serverKey(server, port)].afterLogin = capabilities;
+}
+
+void capabilityCache::remove(const string& server, uint16_t port)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_servers.erase(serverKey(server, port));
+}
+
+void capabilityCache::clear()
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_servers.clear();
+}
+
+bool capabilityCache::hasCapability(const vector<string>& capabilities, const string& name)
+{
+    string upperName = name;
+
+    transform(upperName.begin(), upperName.end(), upperName.begin(), ::toupper);
+    for (size_t i = 0; i < capabilities.size(); i++) {
+        string capability = capabilities[i];
+
+        transform(capability.begin(), capability.end(), capability.begin(), ::toupper);
+        if (capability == upperName)
+            return true;
+    }
+    return false;
+}
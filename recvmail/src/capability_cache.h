@@ -0,0 +1,47 @@
+#ifndef __CAPABILITY_CACHE_H__
+#define __CAPABILITY_CACHE_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+CAPABILITY of each server, shared by the sessions connecting to it.
+
+a session that knows what the server announces after login before
+logging in can send LOGIN (or AUTHENTICATE with SASL-IR), ENABLE and
+SELECT at once, see mailImap::setPipelinedLoginEnabled(). the first
+session of a server fills the cache, the next ones use it.
+
+capabilities are kept as announced, "IMAP4rev1", "AUTH=PLAIN", "SASL-IR".
+*/
+class capabilityCache
+{
+public:
+    // false when the server is unknown, or the list asked for was never stored
+    bool getBeforeLogin(const string& server, uint16_t port, vector<string>& capabilities) const;
+    bool getAfterLogin(const string& server, uint16_t port, vector<string>& capabilities) const;
+    void setBeforeLogin(const string& server, uint16_t port, const vector<string>& capabilities);
+    void setAfterLogin(const string& server, uint16_t port, const vector<string>& capabilities);
+    // the server changed (an upgrade, another backend), ask it again
+    void remove(const string& server, uint16_t port);
+    void clear();
+
+    static bool hasCapability(const vector<string>& capabilities, const string& name);
+
+private:
+    struct serverCapabilities {
+        vector<string> beforeLogin;
+        vector<string> afterLogin;
+    };
+
+    static string serverKey(const string& server, uint16_t port);
+
+    mutable mutex m_mutex;
+    map<string, serverCapabilities> m_servers;
+};
+
+#endif
@@ -0,0 +1,295 @@
+#include "connection_pool.h"
+#include <algorithm>
+
+connectionPool::connectionPool(size_t maxPerAccount, time_t checkDelay, time_t maxIdle)
+    : m_maxPerAccount(maxPerAccount > 0 ? maxPerAccount : 1)
+    , m_checkDelay(checkDelay)
+    , m_maxIdle(maxIdle)
+{
+}
+
+connectionPool::~connectionPool()
+{
+    clear();
+}
+
+string connectionPool::accountKey(const string& server, uint16_t port, const string& user)
+{
+    string key = server;
+    char portString[8];
+
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+    sprintf_s(portString, sizeof(portString), "%u", (unsigned) port);
+    return user + "@" + key + ":" + portString;
+}
+
+/* the most recently used session with folder selected, or the most recently used one */
+
+bool connectionPool::takeIdle(account& a, const string& folder, idleSession& session)
+{
+    if (a.idle.empty())
+        return false;
+
+    size_t index = a.idle.size() - 1;
+    bool found = false;
+
+    if (!folder.empty()) {
+        for (size_t i = a.idle.size(); i > 0 && !found; i--) {
+            if (a.idle[i - 1].imap->currentFolder() == folder) {
+                index = i - 1;
+                found = true;
+            }
+        }
+    }
+
+    if (found)
+        m_folderHits++;
+    else
+        m_reuses++;
+
+    session = a.idle[index];
+    a.idle.erase(a.idle.begin() + index);
+    return true;
+}
+
+int connectionPool::acquire(const string& server, uint16_t port, const string& user, const string& password,
+    const string& folder, mailImap *& imap)
+{
+    string key = accountKey(server, port, user);
+    unique_lock<mutex> lock(m_mutex);
+
+    for (;;) {
+        account& a = m_accounts[key];
+        idleSession session;
+
+        if (takeIdle(a, folder, session)) {
+            int r = ErrorNone;
+
+            a.active++;
+            if (time(NULL) - session.lastChecked > m_checkDelay) {
+                lock.unlock();
+                r = session.imap->noop();
+                if (r != ErrorNone)
+                    delete session.imap;
+                lock.lock();
+            }
+
+            if (r != ErrorNone) {
+                // the server closed it meanwhile, try the next one
+                a.active--;
+                continue;
+            }
+
+            m_owners[session.imap] = key;
+            imap = session.imap;
+            return ErrorNone;
+        }
+
+        if (a.active < m_maxPerAccount) {
+            mailImap * session = new mailImap(server, port, user, password);
+            int r;
+
+            session->setConnectionType(m_connectionType);
+            session->setAuthType(m_authType);
+            session->setOAuthTokenCache(m_tokenCache);
+
+            a.active++;
+            lock.unlock();
+            r = session->connect();
+            if (r != ErrorNone)
+                r = ErrorConnection;
+            else
+                r = session->login();
+            if (r != ErrorNone)
+                delete session;
+            lock.lock();
+
+            if (r != ErrorNone) {
+                a.active--;
+                m_released.notify_one();
+                return r;
+            }
+
+            m_connects++;
+            m_owners[session] = key;
+            imap = session;
+            return ErrorNone;
+        }
+
+        m_released.wait(lock);
+    }
+}
+
+void connectionPool::release(mailImap * imap, int error)
+{
+    bool broken = (error == ErrorConnection || error == ErrorParse);
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<mailImap *, string>::iterator it = m_owners.find(imap);
+        if (it == m_owners.end())
+            return;
+
+        account& a = m_accounts[it->second];
+        m_owners.erase(it);
+        a.active--;
+        if (!broken) {
+            idleSession session;
+            session.imap = imap;
+            session.lastUsed = time(NULL);
+            session.lastChecked = session.lastUsed;
+            a.idle.push_back(session);
+        }
+    }
+    m_released.notify_one();
+
+    if (broken)
+        delete imap;
+}
+
+void connectionPool::setConnectionType(ConnectionType connectionType)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_connectionType = connectionType;
+}
+
+ConnectionType connectionPool::getConnectionType() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_connectionType;
+}
+
+void connectionPool::setAuthType(AuthType authType)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_authType = authType;
+}
+
+AuthType connectionPool::getAuthType() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_authType;
+}
+
+void connectionPool::setOAuthTokenCache(oauthTokenCache * cache)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_tokenCache = cache;
+}
+
+/*
+the idle sessions are counted as active while they are checked, so
+that acquire() does not connect new ones in the meantime.
+*/
+
+void connectionPool::checkIdleSessions()
+{
+    vector<pair<string, idleSession> > checked;
+    time_t now = time(NULL);
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (map<string, account>::iterator it = m_accounts.begin(); it != m_accounts.end(); ++it) {
+            for (size_t i = 0; i < it->second.idle.size(); i++)
+                checked.push_back(make_pair(it->first, it->second.idle[i]));
+            it->second.active += it->second.idle.size();
+            it->second.idle.clear();
+        }
+    }
+
+    vector<bool> alive(checked.size(), false);
+    for (size_t i = 0; i < checked.size(); i++) {
+        idleSession& session = checked[i].second;
+
+        if (now - session.lastUsed > m_maxIdle || session.imap->noop() != ErrorNone) {
+            delete session.imap;
+            continue;
+        }
+        // lastUsed stays, a session nobody uses is closed after maxIdle even if it answers
+        session.lastChecked = time(NULL);
+        alive[i] = true;
+    }
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (size_t i = 0; i < checked.size(); i++) {
+            account& a = m_accounts[checked[i].first];
+
+            a.active--;
+            if (alive[i])
+                a.idle.push_back(checked[i].second);
+        }
+    }
+    m_released.notify_all();
+}
+
+void connectionPool::closeIdleSessions(const string& server, uint16_t port, const string& user)
+{
+    vector<idleSession> sessions;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, account>::iterator it = m_accounts.find(accountKey(server, port, user));
+        if (it == m_accounts.end())
+            return;
+
+        sessions.swap(it->second.idle);
+        // acquire() only keeps a reference on an account while it counts as active
+        if (it->second.active == 0)
+            m_accounts.erase(it);
+    }
+
+    for (size_t i = 0; i < sessions.size(); i++)
+        delete sessions[i].imap;
+}
+
+void connectionPool::clear()
+{
+    vector<mailImap *> sessions;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (map<string, account>::iterator it = m_accounts.begin(); it != m_accounts.end(); ++it) {
+            for (size_t i = 0; i < it->second.idle.size(); i++)
+                sessions.push_back(it->second.idle[i].imap);
+            it->second.idle.clear();
+        }
+    }
+
+    for (size_t i = 0; i < sessions.size(); i++)
+        delete sessions[i];
+}
+
+size_t connectionPool::getIdleCount() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    size_t count = 0;
+
+    for (map<string, account>::const_iterator it = m_accounts.begin(); it != m_accounts.end(); ++it)
+        count += it->second.idle.size();
+    return count;
+}
+
+size_t connectionPool::getActiveCount() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_owners.size();
+}
+
+uint64_t connectionPool::getFolderHits() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_folderHits;
+}
+
+uint64_t connectionPool::getReuses() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_reuses;
+}
+
+uint64_t connectionPool::getConnects() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_connects;
+}
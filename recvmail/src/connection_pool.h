@@ -0,0 +1,93 @@
+#ifndef __CONNECTION_POOL_H__
+#define __CONNECTION_POOL_H__
+
+#include <time.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include "imap.h"
+
+using namespace std;
+
+/*
+logged in sessions kept per (server, port, user) between requests.
+
+acquire() prefers an idle session that already has the wanted folder
+selected, then the one used most recently, and only connects a new one
+when the account has less than maxPerAccount sessions; otherwise it
+waits for a session to be released.
+
+a session idle for more than checkDelay seconds is checked with NOOP
+before it is handed out, and checkIdleSessions() checks them all and
+closes the ones idle for more than maxIdle seconds.
+*/
+class connectionPool
+{
+public:
+    connectionPool(size_t maxPerAccount = 4, time_t checkDelay = 60, time_t maxIdle = 15 * 60);
+    // the sessions still acquired must have been released
+    ~connectionPool();
+    connectionPool(const connectionPool&) = delete;
+    connectionPool& operator=(const connectionPool&) = delete;
+
+    // a logged in session, folder is the folder it is going to be used on (empty for none)
+    int acquire(const string& server, uint16_t port, const string& user, const string& password,
+        const string& folder, mailImap *& imap);
+    // error is the result of the last command, the session is closed after a connection error
+    void release(mailImap * imap, int error = ErrorNone);
+
+    // used by the sessions connected from now on
+    void setConnectionType(ConnectionType connectionType);
+    ConnectionType getConnectionType() const;
+    void setAuthType(AuthType authType);
+    AuthType getAuthType() const;
+    // tokens of the XOAUTH2 and OAUTHBEARER logins, the cache is not owned
+    void setOAuthTokenCache(oauthTokenCache * cache);
+
+    // NOOP every idle session, close the ones that fail or stayed idle too long
+    void checkIdleSessions();
+    // close the idle sessions of one account, when it has nothing left to do
+    void closeIdleSessions(const string& server, uint16_t port, const string& user);
+    void clear();
+
+    size_t getIdleCount() const;
+    size_t getActiveCount() const;
+    // acquire() results: session with the folder already selected, other idle session, new session
+    uint64_t getFolderHits() const;
+    uint64_t getReuses() const;
+    uint64_t getConnects() const;
+
+private:
+    struct idleSession {
+        mailImap *  imap;
+        time_t      lastUsed;       // released, what maxIdle counts from
+        time_t      lastChecked;    // released or answered a NOOP, what checkDelay counts from
+    };
+    struct account {
+        vector<idleSession> idle;   // most recently released last
+        size_t      active = 0;
+    };
+
+    static string accountKey(const string& server, uint16_t port, const string& user);
+    bool takeIdle(account& a, const string& folder, idleSession& session);
+
+    size_t      m_maxPerAccount;
+    ConnectionType m_connectionType = ConnectionTypeClear;
+    AuthType    m_authType = AuthTypeLogin;
+    oauthTokenCache * m_tokenCache = NULL;
+    time_t      m_checkDelay;
+    time_t      m_maxIdle;
+    uint64_t    m_folderHits = 0;
+    uint64_t    m_reuses = 0;
+    uint64_t    m_connects = 0;
+
+    map<string, account> m_accounts;
+    map<mailImap *, string> m_owners;   // acquired session -> account key
+    mutable mutex m_mutex;
+    condition_variable m_released;
+};
+
+#endif
@@ -0,0 +1,406 @@
+#include "decoder.h"
+#include <string.h>
+#include <stdint.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define DECODER_X86
+#endif
+
+#ifdef DECODER_X86
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define DECODER_TARGET(name)
+#	else
+#		define DECODER_TARGET(name) __attribute__((target(name)))
+#	endif
+#endif
+
+static const signed char base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/*
+decodes as many whole blocks of base64 characters as possible and stops
+at the first block containing anything else (line breaks, padding),
+which is then left to the scalar loop.
+*/
+
+typedef void base64_block_decoder(const unsigned char ** p_in, const unsigned char * end, char ** p_out);
+
+#ifdef DECODER_X86
+
+/* SSSE3 lookup and packing, 16 characters into 12 bytes */
+
+DECODER_TARGET("ssse3")
+static void decode_base64_blocks_ssse3(const unsigned char ** p_in, const unsigned char * end, char ** p_out)
+{
+    const unsigned char * in = *p_in;
+    char * out = *p_out;
+
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_0f = _mm_set1_epi8(0x0f);
+    const __m128i slash = _mm_set1_epi8(0x2f);
+    const __m128i merge_ab_bc = _mm_set1_epi32(0x01400140);
+    const __m128i merge_abc = _mm_set1_epi32(0x00011000);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    while (end - in >= 16) {
+        __m128i input = _mm_loadu_si128((const __m128i *) in);
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(input, 4), mask_0f);
+        __m128i lo_nibbles = _mm_and_si128(input, mask_0f);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+            break;
+
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(input, slash), hi_nibbles));
+        __m128i values = _mm_add_epi8(input, roll);
+        __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, merge_ab_bc), merge_abc);
+
+        // 16 bytes are stored but only 12 are kept, out never gets ahead of in
+        _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(merged, pack));
+        in += 16;
+        out += 12;
+    }
+
+    *p_in = in;
+    *p_out = out;
+}
+
+/* same as above on both 128 bit lanes, 32 characters into 24 bytes */
+
+DECODER_TARGET("avx2")
+static void decode_base64_blocks_avx2(const unsigned char ** p_in, const unsigned char * end, char ** p_out)
+{
+    const unsigned char * in = *p_in;
+    char * out = *p_out;
+
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_0f = _mm256_set1_epi8(0x0f);
+    const __m256i slash = _mm256_set1_epi8(0x2f);
+    const __m256i merge_ab_bc = _mm256_set1_epi32(0x01400140);
+    const __m256i merge_abc = _mm256_set1_epi32(0x00011000);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    while (end - in >= 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *) in);
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(input, 4), mask_0f);
+        __m256i lo_nibbles = _mm256_and_si256(input, mask_0f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())) != 0)
+            break;
+
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(input, slash), hi_nibbles));
+        __m256i values = _mm256_add_epi8(input, roll);
+        __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(values, merge_ab_bc), merge_abc);
+
+        merged = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), lanes);
+        _mm256_storeu_si256((__m256i *) out, merged);
+        in += 32;
+        out += 24;
+    }
+
+    *p_in = in;
+    *p_out = out;
+
+    // leaving AVX state dirty makes the following SSE code very slow on some cpus
+    _mm256_zeroupper();
+    decode_base64_blocks_ssse3(p_in, end, p_out);
+}
+
+static base64_block_decoder * select_base64_block_decoder()
+{
+#ifdef _MSC_VER
+    int info[4];
+    bool ssse3;
+    bool avx2 = false;
+
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    ssse3 = (info[2] & (1 << 9)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool ssse3 = __builtin_cpu_supports("ssse3") != 0;
+    bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+    if (avx2)
+        return decode_base64_blocks_avx2;
+    if (ssse3)
+        return decode_base64_blocks_ssse3;
+    return NULL;
+}
+
+#else
+
+static base64_block_decoder * select_base64_block_decoder()
+{
+    return NULL;
+}
+
+#endif
+
+size_t decode_base64(const char * data, size_t length, char * out)
+{
+    static base64_block_decoder * const block_decoder = select_base64_block_decoder();
+    const unsigned char * in = (const unsigned char *) data;
+    const unsigned char * end = in + length;
+    char * cur = out;
+    uint32_t value = 0;
+    int count = 0;
+
+    while (in < end) {
+        if (count == 0 && block_decoder != NULL && end - in >= 16) {
+            block_decoder(&in, end, &cur);
+            if (in >= end)
+                break;
+        }
+
+        unsigned char c = *in++;
+        int v = base64_values[c];
+        if (v < 0) {
+            if (c == '=')
+                break;
+            // line breaks and other garbage
+            continue;
+        }
+
+        value = (value << 6) | (uint32_t) v;
+        count++;
+        if (count == 4) {
+            cur[0] = (char) (value >> 16);
+            cur[1] = (char) (value >> 8);
+            cur[2] = (char) value;
+            cur += 3;
+            value = 0;
+            count = 0;
+        }
+    }
+
+    if (count == 2) {
+        *cur++ = (char) (value >> 4);
+    }
+    else if (count == 3) {
+        cur[0] = (char) (value >> 10);
+        cur[1] = (char) (value >> 2);
+        cur += 2;
+    }
+
+    return cur - out;
+}
+
+size_t base64_decodable_length(const char * data, size_t length)
+{
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        if (base64_values[(unsigned char) data[i]] >= 0 || data[i] == '=')
+            count++;
+    }
+
+    // give back the characters of the last incomplete quartet
+    count %= 4;
+    i = length;
+    while (count > 0) {
+        i--;
+        if (base64_values[(unsigned char) data[i]] >= 0 || data[i] == '=')
+            count--;
+    }
+
+    return i;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+size_t decode_quoted_printable(const char * data, size_t length, char * out)
+{
+    const char * in = data;
+    const char * end = data + length;
+    char * cur = out;
+
+    while (in < end) {
+        // copy everything up to the next escape in one go
+        const char * escape = (const char *) memchr(in, '=', end - in);
+        size_t literal = (escape != NULL ? escape : end) - in;
+
+        if (cur != in)
+            memmove(cur, in, literal);
+        cur += literal;
+        in += literal;
+        if (in >= end)
+            break;
+
+        // in points to '='
+        if (end - in >= 3 && hex_value(in[1]) >= 0 && hex_value(in[2]) >= 0) {
+            *cur++ = (char) ((hex_value(in[1]) << 4) | hex_value(in[2]));
+            in += 3;
+            continue;
+        }
+
+        // soft line break, transport padding may sit between '=' and the line break
+        const char * p = in + 1;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p == '\n') {
+            in = p + 1;
+        }
+        else if (end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+            in = p + 2;
+        }
+        else if (p == end) {
+            in = end;
+        }
+        else {
+            *cur++ = '=';
+            in++;
+        }
+    }
+
+    return cur - out;
+}
+
+size_t quoted_printable_decodable_length(const char * data, size_t length)
+{
+    size_t i = length;
+
+    // an escape or a soft line break may continue in the next chunk
+    while (i > 0 && length - i < 2) {
+        i--;
+        if (data[i] == '=')
+            return i;
+    }
+
+    // transport padding after the last '=' of the chunk
+    i = length;
+    while (i > 0 && (data[i - 1] == ' ' || data[i - 1] == '\t' || data[i - 1] == '\r'))
+        i--;
+    if (i > 0 && data[i - 1] == '=')
+        return i - 1;
+
+    return length;
+}
+
+#define UU_VALUE(c) (((c) - ' ') & 0x3f)
+
+size_t decode_uuencode(const char * data, size_t length, char * out)
+{
+    const char * in = data;
+    const char * end = data + length;
+    char * cur = out;
+
+    while (in < end) {
+        const char * eol = (const char *) memchr(in, '\n', end - in);
+        const char * line_end = (eol != NULL) ? eol : end;
+        const char * next = (eol != NULL) ? eol + 1 : end;
+
+        if (line_end > in && line_end[-1] == '\r')
+            line_end--;
+
+        size_t line_length = line_end - in;
+        if (line_length >= 6 && strncmp(in, "begin ", 6) == 0) {
+            in = next;
+            continue;
+        }
+        if (line_length >= 3 && strncmp(in, "end", 3) == 0)
+            break;
+        if (line_length == 0) {
+            in = next;
+            continue;
+        }
+
+        size_t count = UU_VALUE(in[0]);
+        const char * p = in + 1;
+
+        if (count == 0)
+            break;
+
+        while (count > 0) {
+            char c[4];
+
+            for (int i = 0; i < 4; i++)
+                c[i] = (p + i < line_end) ? (char) UU_VALUE(p[i]) : 0;
+
+            char decoded[3];
+            decoded[0] = (char) ((c[0] << 2) | (c[1] >> 4));
+            decoded[1] = (char) ((c[1] << 4) | (c[2] >> 2));
+            decoded[2] = (char) ((c[2] << 6) | c[3]);
+
+            size_t n = count < 3 ? count : 3;
+            memcpy(cur, decoded, n);
+            cur += n;
+            count -= n;
+            p += 4;
+        }
+
+        in = next;
+    }
+
+    return cur - out;
+}
+
+size_t uuencode_decodable_length(const char * data, size_t length)
+{
+    size_t i = length;
+
+    // only complete lines
+    while (i > 0 && data[i - 1] != '\n')
+        i--;
+
+    return i;
+}
@@ -0,0 +1,27 @@
+#ifndef __DECODER_H__
+
+#define __DECODER_H__
+
+#include <stddef.h>
+
+/*
+content transfer decoders.
+
+out must hold at least length bytes and may be equal to data, which
+decodes in place. the decoded length is returned.
+*/
+
+size_t decode_base64(const char * data, size_t length, char * out);
+size_t decode_quoted_printable(const char * data, size_t length, char * out);
+size_t decode_uuencode(const char * data, size_t length, char * out);
+
+/*
+length of the longest prefix that decodes the same way whatever follows it,
+used when the encoded data arrives in chunks.
+*/
+
+size_t base64_decodable_length(const char * data, size_t length);
+size_t quoted_printable_decodable_length(const char * data, size_t length);
+size_t uuencode_decodable_length(const char * data, size_t length);
+
+#endif
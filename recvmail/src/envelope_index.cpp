@@ -0,0 +1,309 @@
+#include "envelope_index.h"
+#include <string.h>
+#include <algorithm>
+
+const uint32_t stringPool::probeId;
+
+stringPool::stringPool()
+    : m_ids(16, idHash{ this }, idEqual{ this })
+{
+    m_offsets.push_back(0);
+    m_offsets.push_back(0);
+}
+
+/* FNV-1a */
+
+size_t stringPool::idHash::operator()(uint32_t id) const
+{
+    const unsigned char * p = (const unsigned char *) pool->keyData(id);
+    size_t length = pool->keyLength(id);
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool stringPool::idEqual::operator()(uint32_t a, uint32_t b) const
+{
+    size_t length = pool->keyLength(a);
+    return length == pool->keyLength(b) && memcmp(pool->keyData(a), pool->keyData(b), length) == 0;
+}
+
+uint32_t stringPool::intern(const char * str, size_t length)
+{
+    uint32_t id;
+
+    if (length == 0)
+        return 0;
+
+    m_probe = str;
+    m_probeLength = length;
+    unordered_set<uint32_t, idHash, idEqual>::iterator it = m_ids.find(probeId);
+    m_probe = NULL;
+    m_probeLength = 0;
+    if (it != m_ids.end())
+        return *it;
+
+    m_data.append(str, length);
+    m_offsets.push_back((uint32_t) m_data.size());
+    id = (uint32_t) count() - 1;
+    m_ids.insert(id);
+
+    return id;
+}
+
+uint32_t stringPool::find(const string& str) const
+{
+    uint32_t id = 0;
+
+    if (str.empty())
+        return 0;
+
+    m_probe = str.data();
+    m_probeLength = str.size();
+    unordered_set<uint32_t, idHash, idEqual>::const_iterator it = m_ids.find(probeId);
+    if (it != m_ids.end())
+        id = *it;
+    m_probe = NULL;
+    m_probeLength = 0;
+
+    return id;
+}
+
+string stringPool::str(uint32_t id) const
+{
+    return string(data(id), length(id));
+}
+
+void stringPool::clear()
+{
+    m_ids.clear();
+    m_data.clear();
+    m_offsets.clear();
+    m_offsets.push_back(0);
+    m_offsets.push_back(0);
+}
+
+size_t stringPool::memoryUsage() const
+{
+    return m_data.capacity() + m_offsets.capacity() * sizeof(uint32_t) +
+        m_ids.bucket_count() * sizeof(void *) + m_ids.size() * (sizeof(uint32_t) + 2 * sizeof(void *));
+}
+
+envelopeIndex::envelopeIndex()
+{
+}
+
+size_t envelopeIndex::add(uint32_t uid, time_t internalDate, uint32_t size, MessageFlag flags,
+    const string& subject, const string& fromName, const string& fromAddress, const string& toAddress)
+{
+    if (!m_uids.empty() && uid <= m_uids.back())
+        m_uidsSorted = false;
+
+    m_uids.push_back(uid);
+    m_internalDates.push_back((int64_t) internalDate);
+    m_sizes.push_back(size);
+    m_flags.push_back((uint16_t) flags);
+    m_subjects.push_back(m_strings.intern(subject));
+    m_fromNames.push_back(m_strings.intern(fromName));
+    m_fromAddresses.push_back(m_strings.intern(fromAddress));
+    m_toAddresses.push_back(m_strings.intern(toAddress));
+
+    return m_uids.size() - 1;
+}
+
+void envelopeIndex::reserve(size_t count)
+{
+    m_uids.reserve(count);
+    m_internalDates.reserve(count);
+    m_sizes.reserve(count);
+    m_flags.reserve(count);
+    m_subjects.reserve(count);
+    m_fromNames.reserve(count);
+    m_fromAddresses.reserve(count);
+    m_toAddresses.reserve(count);
+}
+
+void envelopeIndex::clear()
+{
+    m_uids.clear();
+    m_internalDates.clear();
+    m_sizes.clear();
+    m_flags.clear();
+    m_subjects.clear();
+    m_fromNames.clear();
+    m_fromAddresses.clear();
+    m_toAddresses.clear();
+    m_uidsSorted = true;
+    m_strings.clear();
+}
+
+long envelopeIndex::rowOfUid(uint32_t uid) const
+{
+    if (m_uidsSorted) {
+        vector<uint32_t>::const_iterator it = lower_bound(m_uids.begin(), m_uids.end(), uid);
+        if (it == m_uids.end() || *it != uid)
+            return -1;
+        return (long) (it - m_uids.begin());
+    }
+
+    for (size_t i = 0; i < m_uids.size(); i++) {
+        if (m_uids[i] == uid)
+            return (long) i;
+    }
+    return -1;
+}
+
+static int compare_nocase(const char * a, size_t a_length, const char * b, size_t b_length)
+{
+    size_t length = a_length < b_length ? a_length : b_length;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ca = (unsigned char) a[i];
+        unsigned char cb = (unsigned char) b[i];
+
+        if (ca >= 'A' && ca <= 'Z')
+            ca = ca - 'A' + 'a';
+        if (cb >= 'A' && cb <= 'Z')
+            cb = cb - 'A' + 'a';
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    if (a_length == b_length)
+        return 0;
+    return a_length < b_length ? -1 : 1;
+}
+
+/*
+rank of every string id used by column, so that rows are then sorted on
+integers: only the distinct strings are compared as strings.
+*/
+
+vector<uint32_t> envelopeIndex::stringRanks(const vector<uint32_t>& column) const
+{
+    vector<uint32_t> ids;
+    vector<uint32_t> ranks(m_strings.count(), 0);
+    vector<bool> used(m_strings.count(), false);
+
+    for (size_t i = 0; i < column.size(); i++) {
+        if (!used[column[i]]) {
+            used[column[i]] = true;
+            ids.push_back(column[i]);
+        }
+    }
+
+    const stringPool& strings = m_strings;
+    sort(ids.begin(), ids.end(), [&strings](uint32_t a, uint32_t b) {
+        return compare_nocase(strings.data(a), strings.length(a), strings.data(b), strings.length(b)) < 0;
+    });
+
+    uint32_t rank = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (i > 0 && compare_nocase(strings.data(ids[i - 1]), strings.length(ids[i - 1]),
+            strings.data(ids[i]), strings.length(ids[i])) != 0)
+            rank++;
+        ranks[ids[i]] = rank;
+    }
+
+    return ranks;
+}
+
+template <class T>
+static void sort_rows(vector<uint32_t>& rows, const vector<T>& column, bool ascending)
+{
+    // ties keep uid order whatever the direction
+    if (ascending) {
+        stable_sort(rows.begin(), rows.end(), [&column](uint32_t a, uint32_t b) { return column[a] < column[b]; });
+    }
+    else {
+        stable_sort(rows.begin(), rows.end(), [&column](uint32_t a, uint32_t b) { return column[b] < column[a]; });
+    }
+}
+
+vector<uint32_t> envelopeIndex::sortedRows(EnvelopeSortKey key, bool ascending) const
+{
+    vector<uint32_t> rows(m_uids.size());
+
+    for (size_t i = 0; i < rows.size(); i++)
+        rows[i] = (uint32_t) i;
+
+    // rows start in uid order, the stable sorts below keep it for equal keys
+    if (!m_uidsSorted)
+        sort_rows(rows, m_uids, true);
+
+    switch (key) {
+    case EnvelopeSortUid:
+        if (!ascending)
+            reverse(rows.begin(), rows.end());
+        break;
+    case EnvelopeSortInternalDate:
+        sort_rows(rows, m_internalDates, ascending);
+        break;
+    case EnvelopeSortSize:
+        sort_rows(rows, m_sizes, ascending);
+        break;
+    case EnvelopeSortSubject:
+    case EnvelopeSortFrom: {
+        const vector<uint32_t>& column = (key == EnvelopeSortSubject) ? m_subjects : m_fromAddresses;
+        vector<uint32_t> ranks = stringRanks(column);
+        vector<uint32_t> rowRanks(column.size());
+
+        for (size_t i = 0; i < column.size(); i++)
+            rowRanks[i] = ranks[column[i]];
+        sort_rows(rows, rowRanks, ascending);
+        break;
+    }
+    }
+
+    return rows;
+}
+
+vector<uint32_t> envelopeIndex::rowsWithFlags(MessageFlag set, MessageFlag unset) const
+{
+    vector<uint32_t> rows;
+    uint16_t mask = (uint16_t) (set | unset);
+
+    for (size_t i = 0; i < m_flags.size(); i++) {
+        if ((m_flags[i] & mask) == (uint16_t) set)
+            rows.push_back((uint32_t) i);
+    }
+    return rows;
+}
+
+vector<uint32_t> envelopeIndex::rowsFrom(const string& address) const
+{
+    vector<uint32_t> rows;
+    uint32_t id = m_strings.find(address);
+
+    if (id == 0)
+        return rows;
+
+    for (size_t i = 0; i < m_fromAddresses.size(); i++) {
+        if (m_fromAddresses[i] == id)
+            rows.push_back((uint32_t) i);
+    }
+    return rows;
+}
+
+vector<uint32_t> envelopeIndex::rowsBetween(time_t from, time_t to) const
+{
+    vector<uint32_t> rows;
+
+    for (size_t i = 0; i < m_internalDates.size(); i++) {
+        if (m_internalDates[i] >= (int64_t) from && m_internalDates[i] < (int64_t) to)
+            rows.push_back((uint32_t) i);
+    }
+    return rows;
+}
+
+size_t envelopeIndex::memoryUsage() const
+{
+    return m_uids.capacity() * sizeof(uint32_t) + m_internalDates.capacity() * sizeof(int64_t) +
+        m_sizes.capacity() * sizeof(uint32_t) + m_flags.capacity() * sizeof(uint16_t) +
+        (m_subjects.capacity() + m_fromNames.capacity() + m_fromAddresses.capacity() +
+            m_toAddresses.capacity()) * sizeof(uint32_t) +
+        m_strings.memoryUsage();
+}
@@ -0,0 +1,123 @@
+#ifndef __ENVELOPE_INDEX_H__
+#define __ENVELOPE_INDEX_H__
+
+#include <time.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "imap.h"
+
+using namespace std;
+
+enum EnvelopeSortKey {
+    EnvelopeSortUid,
+    EnvelopeSortInternalDate,
+    EnvelopeSortSize,
+    EnvelopeSortSubject,
+    EnvelopeSortFrom,
+};
+
+/*
+strings stored once, one after the other in a single buffer.
+id 0 is the empty string.
+*/
+class stringPool
+{
+public:
+    stringPool();
+    stringPool(const stringPool&) = delete;
+    stringPool& operator=(const stringPool&) = delete;
+
+    uint32_t intern(const char * str, size_t length);
+    uint32_t intern(const string& str) { return intern(str.data(), str.size()); }
+    // 0 when str was never interned
+    uint32_t find(const string& str) const;
+
+    string str(uint32_t id) const;
+    const char * data(uint32_t id) const { return m_data.data() + m_offsets[id]; }
+    size_t length(uint32_t id) const { return m_offsets[id + 1] - m_offsets[id]; }
+    size_t count() const { return m_offsets.size() - 1; }
+
+    void clear();
+    size_t memoryUsage() const;
+
+private:
+    // ids are hashed through the pool, a lookup goes through this id that stands for m_probe
+    static const uint32_t probeId = 0xffffffff;
+    const char * keyData(uint32_t id) const { return id == probeId ? m_probe : data(id); }
+    size_t keyLength(uint32_t id) const { return id == probeId ? m_probeLength : length(id); }
+
+    struct idHash {
+        const stringPool * pool;
+        size_t operator()(uint32_t id) const;
+    };
+    struct idEqual {
+        const stringPool * pool;
+        bool operator()(uint32_t a, uint32_t b) const;
+    };
+
+    string m_data;
+    vector<uint32_t> m_offsets;
+    unordered_set<uint32_t, idHash, idEqual> m_ids;
+    mutable const char * m_probe = NULL;
+    mutable size_t m_probeLength = 0;
+};
+
+/*
+message list of a folder stored by column (struct of arrays).
+
+row i of every column describes the same message. addresses and
+subjects are interned, a row costs 34 bytes plus the strings
+that are not shared with other messages, and sorting or filtering
+only touches the columns it needs.
+*/
+class envelopeIndex
+{
+public:
+    envelopeIndex();
+
+    size_t add(uint32_t uid, time_t internalDate, uint32_t size, MessageFlag flags,
+        const string& subject, const string& fromName, const string& fromAddress, const string& toAddress);
+    void reserve(size_t count);
+    void clear();
+
+    size_t size() const { return m_uids.size(); }
+    // row of uid, -1 when it is not in the index
+    long rowOfUid(uint32_t uid) const;
+
+    uint32_t uid(size_t row) const { return m_uids[row]; }
+    time_t internalDate(size_t row) const { return (time_t) m_internalDates[row]; }
+    uint32_t messageSize(size_t row) const { return m_sizes[row]; }
+    MessageFlag flags(size_t row) const { return (MessageFlag) m_flags[row]; }
+    void setFlags(size_t row, MessageFlag flags) { m_flags[row] = (uint16_t) flags; }
+    string subject(size_t row) const { return m_strings.str(m_subjects[row]); }
+    string fromName(size_t row) const { return m_strings.str(m_fromNames[row]); }
+    string fromAddress(size_t row) const { return m_strings.str(m_fromAddresses[row]); }
+    string toAddress(size_t row) const { return m_strings.str(m_toAddresses[row]); }
+
+    // rows ordered by key, subjects and addresses compare case insensitively
+    vector<uint32_t> sortedRows(EnvelopeSortKey key, bool ascending = true) const;
+    // rows with all of the set flags and none of the unset flags
+    vector<uint32_t> rowsWithFlags(MessageFlag set, MessageFlag unset = MessageFlagNone) const;
+    vector<uint32_t> rowsFrom(const string& address) const;
+    vector<uint32_t> rowsBetween(time_t from, time_t to) const;
+
+    size_t memoryUsage() const;
+
+private:
+    vector<uint32_t> stringRanks(const vector<uint32_t>& column) const;
+
+    vector<uint32_t> m_uids;
+    vector<int64_t> m_internalDates;
+    vector<uint32_t> m_sizes;
+    vector<uint16_t> m_flags;
+    vector<uint32_t> m_subjects;
+    vector<uint32_t> m_fromNames;
+    vector<uint32_t> m_fromAddresses;
+    vector<uint32_t> m_toAddresses;
+    bool m_uidsSorted = true;
+    stringPool m_strings;
+};
+
+#endif
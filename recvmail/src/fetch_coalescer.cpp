@@ -0,0 +1,82 @@
+#include "fetch_coalescer.h"
+
+fetchCoalescer::fetchCoalescer()
+{
+}
+
+string fetchCoalescer::flightKey(const string& server, const string& user, const string& folder, uint32_t uid)
+{
+    char uidString[16];
+
+    sprintf_s(uidString, sizeof(uidString), "%u", uid);
+
+    string key = server;
+    key.push_back('\0');
+    key += user;
+    key.push_back('\0');
+    key += folder;
+    key.push_back('\0');
+    key += uidString;
+    return key;
+}
+
+int fetchCoalescer::getMessageByUid(mailImap& imap, const string& folder, uint32_t uid, sharedMessage& data)
+{
+    string key = flightKey(imap.getServer(), imap.getUserid(), folder, uid);
+    promise<fetchResult> leader;
+    shared_future<fetchResult> flight;
+    bool fetch = false;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, shared_future<fetchResult> >::iterator it = m_flights.find(key);
+
+        if (it != m_flights.end()) {
+            flight = it->second;
+            m_coalesced++;
+        }
+        else {
+            flight = leader.get_future().share();
+            m_flights[key] = flight;
+            m_fetches++;
+            fetch = true;
+        }
+    }
+
+    if (fetch) {
+        fetchResult result;
+        shared_ptr<imapBuffer> buffer = make_shared<imapBuffer>();
+
+        result.error = imap.getMessageByUid(folder, uid, *buffer);
+        if (result.error == ErrorNone)
+            result.data = buffer;
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_flights.erase(key);
+        }
+        leader.set_value(result);
+    }
+
+    const fetchResult& result = flight.get();
+    data = result.data;
+    return result.error;
+}
+
+uint64_t fetchCoalescer::getCoalesced() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_coalesced;
+}
+
+uint64_t fetchCoalescer::getFetches() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_fetches;
+}
+
+size_t fetchCoalescer::inFlight() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_flights.size();
+}
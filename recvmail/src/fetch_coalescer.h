@@ -0,0 +1,52 @@
+#ifndef __FETCH_COALESCER_H__
+#define __FETCH_COALESCER_H__
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <string>
+
+#include "imap.h"
+
+using namespace std;
+
+// a message shared by every request that asked for it, freed with the last reference
+typedef shared_ptr<const imapBuffer> sharedMessage;
+
+/*
+one fetch for concurrent requests of the same message.
+
+the first request for (server, user, folder, uid) fetches it on the
+session it was given, the requests arriving while it is in flight wait
+for it and get the same buffer instead of fetching their own copy. a
+request arriving after the fetch finished fetches again, nothing is
+kept here (see messageCache for that).
+*/
+class fetchCoalescer
+{
+public:
+    fetchCoalescer();
+
+    int getMessageByUid(mailImap& imap, const string& folder, uint32_t uid, sharedMessage& data);
+
+    // requests that waited for another one instead of fetching
+    uint64_t getCoalesced() const;
+    uint64_t getFetches() const;
+    size_t inFlight() const;
+
+private:
+    struct fetchResult {
+        int         error = ErrorNone;
+        sharedMessage data;
+    };
+
+    static string flightKey(const string& server, const string& user, const string& folder, uint32_t uid);
+
+    map<string, shared_future<fetchResult> > m_flights;
+    uint64_t    m_coalesced = 0;
+    uint64_t    m_fetches = 0;
+    mutable mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include "folder_downloader.h"
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#define BACKOFF_MIN 1
+#define BACKOFF_MAX 60
+
+folderDownloader::folderDownloader(connectionPool& pool, const string& server, uint16_t port,
+    const string& user, const string& password)
+    : m_pool(pool)
+    , m_server(server)
+    , m_port(port)
+    , m_user(user)
+    , m_password(password)
+{
+}
+
+void folderDownloader::setConnections(size_t connections)
+{
+    m_connections = connections > 0 ? connections : 1;
+}
+
+size_t folderDownloader::getConnections() const
+{
+    return m_connections;
+}
+
+void folderDownloader::setChunkSize(uint32_t chunkSize)
+{
+    m_chunkSize = chunkSize > 0 ? chunkSize : 1;
+}
+
+uint32_t folderDownloader::getChunkSize() const
+{
+    return m_chunkSize;
+}
+
+void folderDownloader::setMaxRetries(unsigned int maxRetries)
+{
+    m_maxRetries = maxRetries;
+}
+
+size_t folderDownloader::getConnectionsUsed() const
+{
+    return m_connectionsUsed;
+}
+
+uint64_t folderDownloader::getBackoffs() const
+{
+    return m_backoffs;
+}
+
+// errors that go away by waiting, too many connections is handled by using less of them
+static bool is_overloaded(int error)
+{
+    return error == ErrorGmailTooManySimultaneousConnections || error == ErrorGmailExceededBandwidthLimit ||
+        error == ErrorConnection || error == ErrorParse;
+}
+
+int folderDownloader::download(const string& folder, messageSink sink, uint32_t firstUid)
+{
+    downloadState d;
+    folderStatus status;
+    mailImap * imap = NULL;
+    int r;
+
+    r = m_pool.acquire(m_server, m_port, m_user, m_password, folder, imap);
+    if (r != ErrorNone)
+        return r;
+    r = imap->getfolderStatus(folder, &status);
+    m_pool.release(imap, r);
+    if (r != ErrorNone)
+        return r;
+
+    // without UIDNEXT the folder is fetched as one chunk, up to its last message
+    uint32_t lastUid = status.uidNext() > 0 ? status.uidNext() - 1 : 0;
+    if (lastUid == 0) {
+        chunk c;
+        c.firstUid = firstUid;
+        d.chunks.push_back(c);
+    }
+    for (uint64_t first = firstUid; lastUid != 0 && first <= lastUid; first += m_chunkSize) {
+        chunk c;
+        c.firstUid = (uint32_t) first;
+        c.lastUid = (uint32_t) min<uint64_t>(first + m_chunkSize - 1, lastUid);
+        d.chunks.push_back(c);
+    }
+
+    d.folder = folder;
+    d.workers = min(m_connections, d.chunks.size());
+    d.connections = d.workers;
+    m_backoffs = 0;
+
+    vector<thread> threads;
+    for (size_t i = 0; i < d.workers; i++)
+        threads.push_back(thread(&folderDownloader::work, this, ref(d)));
+
+    while (r == ErrorNone) {
+        vector<pair<uint32_t, string> > messages;
+
+        {
+            unique_lock<mutex> lock(d.lock);
+            if (d.delivered == d.chunks.size())
+                break;
+            d.changed.wait(lock, [&d]() { return d.chunks[d.delivered].done || d.error != ErrorNone; });
+            if (d.error != ErrorNone) {
+                r = d.error;
+                break;
+            }
+            messages.swap(d.chunks[d.delivered].messages);
+        }
+
+        // a chunk comes back in the order the server chose
+        sort(messages.begin(), messages.end());
+        for (size_t i = 0; i < messages.size() && r == ErrorNone; i++)
+            r = sink(messages[i].first, messages[i].second.data(), messages[i].second.size());
+
+        {
+            lock_guard<mutex> lock(d.lock);
+            d.delivered++;
+        }
+        d.changed.notify_all();
+    }
+
+    {
+        lock_guard<mutex> lock(d.lock);
+        d.stopping = true;
+        m_connectionsUsed = d.connections;
+    }
+    d.changed.notify_all();
+
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    return r;
+}
+
+bool folderDownloader::takeChunk(downloadState& d, size_t& index)
+{
+    unique_lock<mutex> lock(d.lock);
+    size_t window = 2 * m_connections;
+
+    d.changed.wait(lock, [&d, window]() {
+        return d.stopping || !d.returned.empty() || d.next == d.chunks.size() || d.next < d.delivered + window;
+    });
+
+    if (!d.stopping && !d.returned.empty()) {
+        index = d.returned.front();
+        d.returned.pop_front();
+        return true;
+    }
+    if (d.stopping || d.next == d.chunks.size()) {
+        // under the same lock as the check, so that no chunk is given back to a thread leaving
+        d.workers--;
+        return false;
+    }
+
+    index = d.next++;
+    return true;
+}
+
+/* every connection waits, the server limits the account and not one connection */
+
+void folderDownloader::pause(downloadState& d)
+{
+    time_t until;
+
+    {
+        lock_guard<mutex> lock(d.lock);
+        time_t now = time(NULL);
+
+        d.backoff = (d.backoff == 0) ? BACKOFF_MIN : min<time_t>(d.backoff * 2, BACKOFF_MAX);
+        if (d.pausedUntil < now + d.backoff)
+            d.pausedUntil = now + d.backoff;
+        m_backoffs++;
+        until = d.pausedUntil;
+    }
+
+    while (time(NULL) < until) {
+        {
+            lock_guard<mutex> lock(d.lock);
+            if (d.stopping)
+                return;
+        }
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+}
+
+int folderDownloader::fetchChunk(downloadState& d, mailImap *& imap, chunk& c)
+{
+    vector<pair<uint32_t, string> > messages;
+    int r;
+
+    if (imap == NULL) {
+        r = m_pool.acquire(m_server, m_port, m_user, m_password, d.folder, imap);
+        if (r != ErrorNone) {
+            imap = NULL;
+            return r;
+        }
+    }
+
+    r = imap->getMessagesByUidRange(d.folder, c.firstUid, c.lastUid,
+        [&messages](uint32_t uid, const char * data, size_t length) {
+        messages.push_back(make_pair(uid, string(data, length)));
+        return (int) ErrorNone;
+    });
+    if (r != ErrorNone) {
+        m_pool.release(imap, r);
+        imap = NULL;
+        return r;
+    }
+
+    lock_guard<mutex> lock(d.lock);
+    c.messages.swap(messages);
+    c.done = true;
+    d.backoff = 0;
+    return ErrorNone;
+}
+
+void folderDownloader::work(downloadState& d)
+{
+    mailImap * imap = NULL;
+    size_t index;
+
+    while (takeChunk(d, index)) {
+        unsigned int attempts = 0;
+        bool stop = false;
+        int r;
+
+        for (;;) {
+            {
+                lock_guard<mutex> lock(d.lock);
+                if (d.stopping)
+                    break;
+            }
+
+            r = fetchChunk(d, imap, d.chunks[index]);
+            if (r == ErrorNone)
+                break;
+
+            attempts++;
+            if (r == ErrorGmailTooManySimultaneousConnections) {
+                lock_guard<mutex> lock(d.lock);
+                // one connection less, another one takes the chunk. the last thread keeps it and waits
+                if (d.workers > 1) {
+                    d.workers--;
+                    d.connections--;
+                    d.returned.push_back(index);
+                    stop = true;
+                    break;
+                }
+            }
+            if (!is_overloaded(r) || attempts > m_maxRetries) {
+                lock_guard<mutex> lock(d.lock);
+                if (d.error == ErrorNone)
+                    d.error = r;
+                d.workers--;
+                stop = true;
+                break;
+            }
+
+            pause(d);
+        }
+
+        d.changed.notify_all();
+        if (stop)
+            break;
+    }
+
+    if (imap != NULL)
+        m_pool.release(imap);
+}
@@ -0,0 +1,92 @@
+#ifndef __FOLDER_DOWNLOADER_H__
+#define __FOLDER_DOWNLOADER_H__
+
+#include <time.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+
+#include "imap.h"
+#include "connection_pool.h"
+
+using namespace std;
+
+/*
+one folder downloaded over several connections of the same account.
+
+the uids of the folder are cut in chunks of chunkSize uids fetched by
+one thread per connection, and the messages are delivered to the sink
+in uid order from the calling thread. the threads never get more than
+two chunks per connection ahead of the chunk being delivered, which
+bounds the memory used.
+
+when the server refuses a connection (gmail: too many simultaneous
+connections) the thread gives its chunk back and stops, the download
+goes on with the connections left. when the server asks to slow down
+(bandwidth limit) or a connection drops, every thread waits, from one
+second doubling up to one minute, before trying again.
+*/
+class folderDownloader
+{
+public:
+    folderDownloader(connectionPool& pool, const string& server, uint16_t port,
+        const string& user, const string& password);
+
+    // messages with uid >= firstUid, sink is called in uid order
+    int download(const string& folder, messageSink sink, uint32_t firstUid = 1);
+
+    void setConnections(size_t connections);
+    size_t getConnections() const;
+    void setChunkSize(uint32_t chunkSize);
+    uint32_t getChunkSize() const;
+    // attempts of a chunk before the download fails
+    void setMaxRetries(unsigned int maxRetries);
+
+    // connections still used at the end of the last download, and the pauses it made
+    size_t getConnectionsUsed() const;
+    uint64_t getBackoffs() const;
+
+private:
+    struct chunk {
+        uint32_t    firstUid = 0;
+        uint32_t    lastUid = 0;
+        bool        done = false;
+        vector<pair<uint32_t, string> > messages;
+    };
+    struct downloadState {
+        string      folder;
+        vector<chunk> chunks;
+        deque<size_t> returned;     // chunks given back by a connection that stopped
+        size_t      next = 0;       // first chunk never taken
+        size_t      delivered = 0;
+        size_t      workers = 0;      // threads still taking chunks
+        size_t      connections = 0;  // workers less the ones the server refused
+        int         error = ErrorNone;
+        time_t      pausedUntil = 0;
+        time_t      backoff = 0;
+        bool        stopping = false;
+        mutex       lock;
+        condition_variable changed;
+    };
+
+    void work(downloadState& d);
+    bool takeChunk(downloadState& d, size_t& index);
+    int fetchChunk(downloadState& d, mailImap *& imap, chunk& c);
+    void pause(downloadState& d);
+
+    connectionPool& m_pool;
+    string      m_server;
+    uint16_t    m_port;
+    string      m_user;
+    string      m_password;
+    size_t      m_connections = 4;
+    uint32_t    m_chunkSize = 1000;
+    unsigned int m_maxRetries = 8;
+    size_t      m_connectionsUsed = 0;
+    uint64_t    m_backoffs = 0;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "folder_queue.h"
+#include <vector>
+
+folderRequestQueue::folderRequestQueue(mailImap * imap, size_t maxBatch)
+    : m_imap(imap)
+    , m_maxBatch(maxBatch > 0 ? maxBatch : 1)
+{
+    m_thread = thread(&folderRequestQueue::run, this);
+}
+
+folderRequestQueue::~folderRequestQueue()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+future<int> folderRequestQueue::submit(const string& folder, folderRequest request, bool readOnly)
+{
+    pendingRequest p;
+
+    p.request = request;
+    p.readOnly = readOnly;
+    p.result = make_shared<promise<int> >();
+    future<int> f = p.result->get_future();
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        deque<pendingRequest>& requests = m_folders[folder];
+
+        if (requests.empty())
+            m_turns.push_back(folder);
+        requests.push_back(p);
+        m_pending++;
+
+        // what running the requests in arrival order would have cost
+        if (folder != m_lastSubmitted)
+            m_arrivalSelects++;
+        m_lastSubmitted = folder;
+    }
+    m_condition.notify_one();
+
+    return f;
+}
+
+void folderRequestQueue::setMaxBatch(size_t maxBatch)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_maxBatch = maxBatch > 0 ? maxBatch : 1;
+}
+
+size_t folderRequestQueue::getMaxBatch() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_maxBatch;
+}
+
+size_t folderRequestQueue::pending() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_pending;
+}
+
+uint64_t folderRequestQueue::getSelectsIssued() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_selectsIssued;
+}
+
+uint64_t folderRequestQueue::getSelectsSaved() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_arrivalSelects > m_selectsIssued ? m_arrivalSelects - m_selectsIssued : 0;
+}
+
+void folderRequestQueue::run()
+{
+    for (;;) {
+        vector<pendingRequest> batch;
+        bool readOnly = true;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_turns.empty(); });
+            if (m_turns.empty())
+                return;
+
+            string folder = m_turns.front();
+            deque<pendingRequest>& requests = m_folders[folder];
+
+            m_turns.pop_front();
+            while (!requests.empty() && batch.size() < m_maxBatch) {
+                batch.push_back(requests.front());
+                requests.pop_front();
+            }
+
+            // the rest of the folder waits for the other folders
+            if (requests.empty())
+                m_folders.erase(folder);
+            else
+                m_turns.push_back(folder);
+        }
+
+        for (size_t i = 0; i < batch.size(); i++)
+            readOnly = readOnly && batch[i].readOnly;
+
+        uint64_t selects = m_imap->getSelectCount();
+        m_imap->setReadOnly(readOnly);
+        for (size_t i = 0; i < batch.size(); i++)
+            batch[i].result->set_value(batch[i].request(*m_imap));
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_selectsIssued += m_imap->getSelectCount() - selects;
+            m_pending -= batch.size();
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __FOLDER_QUEUE_H__
+#define __FOLDER_QUEUE_H__
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <string>
+#include <functional>
+#include <condition_variable>
+
+#include "imap.h"
+
+using namespace std;
+
+// a command on the folder it was submitted for, returns an ErrorCode
+typedef function<int(mailImap& imap)> folderRequest;
+
+/*
+requests of one session, run by folder instead of by arrival.
+
+a thread takes the requests of the folder waiting the longest, up to
+maxBatch of them, and runs them one after the other so that the folder
+is selected once for all of them. then the next folder gets its turn,
+so a busy folder cannot keep the others waiting for more than one batch.
+
+a batch made only of read only requests opens the folder with EXAMINE.
+the session must not be used directly while the queue exists.
+*/
+class folderRequestQueue
+{
+public:
+    folderRequestQueue(mailImap * imap, size_t maxBatch = 32);
+    // runs the requests already submitted
+    ~folderRequestQueue();
+    folderRequestQueue(const folderRequestQueue&) = delete;
+    folderRequestQueue& operator=(const folderRequestQueue&) = delete;
+
+    // the future gets what request returned
+    future<int> submit(const string& folder, folderRequest request, bool readOnly = true);
+
+    void setMaxBatch(size_t maxBatch);
+    size_t getMaxBatch() const;
+    size_t pending() const;
+
+    // SELECT and EXAMINE sent by the requests, and the ones running them in arrival order would have sent more
+    uint64_t getSelectsIssued() const;
+    uint64_t getSelectsSaved() const;
+
+private:
+    struct pendingRequest {
+        folderRequest request;
+        bool        readOnly;
+        shared_ptr<promise<int> > result;
+    };
+
+    void run();
+
+    mailImap *  m_imap;
+    size_t      m_maxBatch;
+    map<string, deque<pendingRequest> > m_folders;
+    deque<string> m_turns;          // folders with requests, the next to run first
+    string      m_lastSubmitted;
+    uint64_t    m_arrivalSelects = 0;
+    uint64_t    m_selectsIssued = 0;
+    size_t      m_pending = 0;
+    bool        m_stopping = false;
+    mutable mutex m_mutex;
+    condition_variable m_condition;
+    thread      m_thread;
+};
+
+#endif
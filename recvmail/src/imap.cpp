@@ -1,4 +1,23 @@
 #include "imap.h"
+#include "decoder.h"
+#include "message_cache.h"
+#include "envelope_index.h"
+#include "imap_command.h"
+#include "capability_cache.h"
+#include "oauth_token_cache.h"
+#include "libetpan/libetpan.h"
+#include <string.h>
+#include <algorithm>
+#include <map>
+#ifdef WIN32
+#	include <winsock2.h>
+#else
+#	include <errno.h>
+#	include <poll.h>
+#endif
+
+// servers drop IDLE after 30 minutes, RFC 2177 asks to renew at least every 29
+#define IDLE_RENEW_DELAY (28 * 60)
 
 static struct {
     const char * name;
@@ -79,6 +98,294 @@ static int imap_mailbox_flags_to_flags(struct mailimap_mbx_list_flags * imap_fla
     return flags;
 }
 
+static MessageFlag flag_from_lep(struct mailimap_flag * flag)
+{
+    switch (flag->fl_type) {
+    case MAILIMAP_FLAG_ANSWERED:
+        return MessageFlagAnswered;
+    case MAILIMAP_FLAG_FLAGGED:
+        return MessageFlagFlagged;
+    case MAILIMAP_FLAG_DELETED:
+        return MessageFlagDeleted;
+    case MAILIMAP_FLAG_SEEN:
+        return MessageFlagSeen;
+    case MAILIMAP_FLAG_DRAFT:
+        return MessageFlagDraft;
+    case MAILIMAP_FLAG_KEYWORD:
+        if (strcasecmp(flag->fl_data.fl_keyword, "$Forwarded") == 0) {
+            return MessageFlagForwarded;
+        }
+        else if (strcasecmp(flag->fl_data.fl_keyword, "$MDNSent") == 0) {
+            return MessageFlagMDNSent;
+        }
+        else if (strcasecmp(flag->fl_data.fl_keyword, "$SubmitPending") == 0) {
+            return MessageFlagSubmitPending;
+        }
+        else if (strcasecmp(flag->fl_data.fl_keyword, "$Submitted") == 0) {
+            return MessageFlagSubmitted;
+        }
+    }
+
+    return MessageFlagNone;
+}
+
+static MessageFlag flags_from_lep_att_dynamic(struct mailimap_msg_att_dynamic * att_dynamic)
+{
+    clistiter * cur;
+    int flags;
+
+    if (att_dynamic->att_list == NULL)
+        return MessageFlagNone;
+
+    flags = MessageFlagNone;
+    for (cur = clist_begin(att_dynamic->att_list); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_flag_fetch * flag_fetch;
+
+        flag_fetch = (struct mailimap_flag_fetch *) clist_content(cur);
+        if (flag_fetch->fl_type != MAILIMAP_FLAG_FETCH_OTHER)
+            continue;
+
+        flags |= flag_from_lep(flag_fetch->fl_flag);
+    }
+
+    return (MessageFlag)flags;
+}
+
+/* split uids into sets of at most batchSize uids, contiguous uids are merged into one interval */
+
+static vector<struct mailimap_set *> uid_sets_from_uids(vector<uint32_t> uids, uint32_t batchSize)
+{
+    vector<struct mailimap_set *> result;
+    struct mailimap_set * set = NULL;
+    uint32_t count = 0;
+    size_t i = 0;
+
+    sort(uids.begin(), uids.end());
+    uids.erase(unique(uids.begin(), uids.end()), uids.end());
+    if (batchSize == 0)
+        batchSize = (uint32_t)uids.size();
+
+    while (i < uids.size()) {
+        uint32_t first = uids[i];
+        uint32_t last = first;
+
+        if (set == NULL) {
+            set = mailimap_set_new_empty();
+            count = 0;
+        }
+
+        i++;
+        count++;
+        while (i < uids.size() && uids[i] == last + 1 && count < batchSize) {
+            last = uids[i];
+            i++;
+            count++;
+        }
+        mailimap_set_add_interval(set, first, last);
+
+        if (count >= batchSize) {
+            result.push_back(set);
+            set = NULL;
+        }
+    }
+    if (set != NULL)
+        result.push_back(set);
+
+    return result;
+}
+
+struct fetch_messages_context {
+    messageSink * sink;
+    int error;
+};
+
+/* called by libetpan as soon as one FETCH response is parsed */
+
+static void fetch_messages_handler(struct mailimap_msg_att * msg_att, void * context)
+{
+    struct fetch_messages_context * ctx = (struct fetch_messages_context *) context;
+    clistiter * cur;
+    uint32_t uid = 0;
+    char * text = NULL;
+    size_t text_length = 0;
+
+    for (cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_msg_att_item * msg_att_item = (struct mailimap_msg_att_item *) clist_content(cur);
+
+        if (msg_att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC)
+            continue;
+
+        if (msg_att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID) {
+            uid = msg_att_item->att_data.att_static->att_data.att_uid;
+        }
+        else if (msg_att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODY_SECTION) {
+            // take ownership so that the body is released as soon as the sink is done with it
+            mailimap_nstring_free(text);
+            text = msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part;
+            msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part = NULL;
+            text_length = msg_att_item->att_data.att_static->att_data.att_body_section->sec_length;
+        }
+    }
+
+    if (ctx->error == ErrorNone && uid != 0 && text != NULL)
+        ctx->error = (*ctx->sink)(uid, text, text_length);
+
+    mailimap_nstring_free(text);
+}
+
+/* decode in place, returns the decoded length */
+
+static size_t decode_buffer(char * data, size_t length, Encoding encoding)
+{
+    switch (encoding) {
+    case EncodingBase64:
+        return decode_base64(data, length, data);
+    case EncodingQuotedPrintable:
+        return decode_quoted_printable(data, length, data);
+    case EncodingUUEncode:
+        return decode_uuencode(data, length, data);
+    default:
+        return length;
+    }
+}
+
+static size_t decodable_length(const char * data, size_t length, Encoding encoding)
+{
+    switch (encoding) {
+    case EncodingBase64:
+        return base64_decodable_length(data, length);
+    case EncodingQuotedPrintable:
+        return quoted_printable_decodable_length(data, length);
+    case EncodingUUEncode:
+        return uuencode_decodable_length(data, length);
+    default:
+        return length;
+    }
+}
+
+static bool needs_decoding(Encoding encoding)
+{
+    return encoding == EncodingBase64 || encoding == EncodingQuotedPrintable || encoding == EncodingUUEncode;
+}
+
+/* seconds since the epoch, days_from_civil() from H. Hinnant's date algorithms */
+
+static time_t time_from_date_time(struct mailimap_date_time * date_time)
+{
+    int64_t year = date_time->dt_year;
+    int64_t month = date_time->dt_month;
+    int64_t era;
+    int64_t yoe;
+    int64_t doy;
+    int64_t doe;
+    int64_t days;
+    int zone;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + date_time->dt_day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = era * 146097 + doe - 719468;
+
+    // dt_zone is written as in the message, -0700 is -700
+    zone = date_time->dt_zone;
+    return (time_t) (days * 86400 + date_time->dt_hour * 3600 + date_time->dt_min * 60 + date_time->dt_sec -
+        ((zone / 100) * 3600 + (zone % 100) * 60));
+}
+
+static string decoded_header(const char * value)
+{
+    string result;
+    char * decoded = NULL;
+    size_t cur_token = 0;
+
+    if (value == NULL)
+        return result;
+
+    if (mailmime_encoded_phrase_parse("iso-8859-1", value, strlen(value), &cur_token, "utf-8", &decoded) == MAILIMF_NO_ERROR &&
+        decoded != NULL) {
+        result = decoded;
+        free(decoded);
+        return result;
+    }
+
+    return value;
+}
+
+static void address_from_lep(clist * list, string * name, string * address)
+{
+    struct mailimap_address * addr;
+
+    if (list == NULL || clist_begin(list) == NULL)
+        return;
+
+    addr = (struct mailimap_address *) clist_content(clist_begin(list));
+    if (name != NULL)
+        *name = decoded_header(addr->ad_personal_name);
+    if (address != NULL && addr->ad_mailbox_name != NULL) {
+        *address = addr->ad_mailbox_name;
+        if (addr->ad_host_name != NULL) {
+            address->push_back('@');
+            address->append(addr->ad_host_name);
+        }
+    }
+}
+
+struct fetch_envelopes_context {
+    envelopeIndex * index;
+};
+
+/* called by libetpan for each FETCH response, nothing is kept once the row is added */
+
+static void fetch_envelopes_handler(struct mailimap_msg_att * msg_att, void * context)
+{
+    struct fetch_envelopes_context * ctx = (struct fetch_envelopes_context *) context;
+    clistiter * cur;
+    uint32_t uid = 0;
+    time_t internal_date = 0;
+    uint32_t size = 0;
+    MessageFlag flags = MessageFlagNone;
+    string subject;
+    string from_name;
+    string from_address;
+    string to_address;
+
+    for (cur = clist_begin(msg_att->att_list); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_msg_att_item * msg_att_item = (struct mailimap_msg_att_item *) clist_content(cur);
+
+        if (msg_att_item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC) {
+            flags = flags_from_lep_att_dynamic(msg_att_item->att_data.att_dyn);
+            continue;
+        }
+        if (msg_att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC)
+            continue;
+
+        struct mailimap_msg_att_static * att_static = msg_att_item->att_data.att_static;
+        switch (att_static->att_type) {
+        case MAILIMAP_MSG_ATT_UID:
+            uid = att_static->att_data.att_uid;
+            break;
+        case MAILIMAP_MSG_ATT_INTERNALDATE:
+            internal_date = time_from_date_time(att_static->att_data.att_internal_date);
+            break;
+        case MAILIMAP_MSG_ATT_RFC822_SIZE:
+            size = att_static->att_data.att_rfc822_size;
+            break;
+        case MAILIMAP_MSG_ATT_ENVELOPE:
+            subject = decoded_header(att_static->att_data.att_env->env_subject);
+            if (att_static->att_data.att_env->env_from != NULL)
+                address_from_lep(att_static->att_data.att_env->env_from->frm_list, &from_name, &from_address);
+            if (att_static->att_data.att_env->env_to != NULL)
+                address_from_lep(att_static->att_data.att_env->env_to->to_list, NULL, &to_address);
+            break;
+        }
+    }
+
+    if (uid != 0)
+        ctx->index->add(uid, internal_date, size, flags, subject, from_name, from_address, to_address);
+}
+
 mailImap::mailImap(const string& server, uint16_t port, const string& userid, const string& pwd)
 {
     init();
@@ -89,505 +396,2512 @@ mailImap::mailImap(const string& server, uint16_t port, const string& userid, co
     setPassword(pwd);
 }
 
+/* server name sent in the TLS handshake, for the servers hosting several domains (SNI) */
+
+static void tls_context_callback(struct mailstream_ssl_context * ssl_context, void * data)
+{
+    mailImap * session = (mailImap *) data;
+    string server = session->getServer();
+
+    mailstream_ssl_set_server_name(ssl_context, (char *) server.c_str());
+}
+
+mailImap::~mailImap()
+{
+    disconnect();
+}
+
 int mailImap::connect()
 {
     if (m_isConnected)
         return 0;
 
+    if (m_imap != NULL)
+        mailimap_free(m_imap);
     m_imap = mailimap_new(0, NULL);
     mailimap_set_timeout(m_imap, m_timeout);
-    int r = mailimap_socket_connect_voip(m_imap, m_server.c_str(), m_port, m_voipEenable);
 
-    if (r == MAILIMAP_NO_ERROR_NON_AUTHENTICATED)
+    int r;
+    if (m_connectionType == ConnectionTypeTLS)
+        r = mailimap_ssl_connect_voip_with_callback(m_imap, m_server.c_str(), m_port, m_voipEenable, tls_context_callback, this);
+    else
+        r = mailimap_socket_connect_voip(m_imap, m_server.c_str(), m_port, m_voipEenable);
+
+    if (r == MAILIMAP_ERROR_SSL)
+        return ErrorTLSNotAvailable;
+    else if (hasError(r))
+        return ErrorConnection;
+
+    if (m_connectionType == ConnectionTypeStartTLS) {
+        r = mailimap_socket_starttls(m_imap);
+        if (r == MAILIMAP_ERROR_STREAM || r == MAILIMAP_ERROR_PARSE)
+            return ErrorConnection;
+        else if (hasError(r))
+            return ErrorStartTLSNotAvailable;
+    }
+
+    if (!hasError(r))
     {
         printf("mailimap_socket_connect_voip errno:%d\n", r);
         m_isConnected = true;
         m_status = SS_CONNECTED;
         r = ErrorNone;
+
+        // until COMPRESS is negotiated wire bytes and data bytes are the same
+        m_isCompressed = false;
+        m_wireLow = mailstream_get_low(m_imap->imap_stream);
+        mailstream_low_set_logger(m_wireLow, streamLogger, this);
     }
 
     return r;
 }
 
-int mailImap::login()
+void mailImap::disconnect()
 {
-    if (m_isLogined)
-        return 0;
-
-    mailstream_low * low;
-    low = mailstream_get_low(m_imap->imap_stream);
-    //string identifier = m_userid + "@" + m_server + ":" + port;
-    size_t len = m_userid.length() + m_server.length() + 10;
-    char* identifier = new char[len];
-    sprintf_s(identifier, len, "%s@%s:%d", m_userid.c_str(), m_server.c_str(), m_port);
-    int r = mailstream_low_set_identifier(low, identifier);
-    printf("mailstream_low_set_identifier errno:%d\n", r);
-
-    r = mailimap_login(m_imap, m_userid.c_str(), m_pwd.c_str());
+    if (m_imap == NULL)
+        return;
 
-    if (!r)
-    {
-        m_status = SS_LOGGEDIN;
-        m_isLogined = true;
-    }
+    if (m_isConnected && !m_idling)
+        mailimap_logout(m_imap);
+    mailimap_free(m_imap);
+    m_imap = NULL;
 
-    return r;
+    m_isConnected = false;
+    m_isLogined = false;
+    m_idling = false;
+    m_isCompressed = false;
+    m_wireLow = NULL;
+    m_status = SS_DISCONNECTED;
+    m_currentFolder.clear();
 }
 
-void mailImap::init()
+int mailImap::noop()
 {
-    m_port = 0;
-    m_imap = NULL;
+    int r = loginIfNeeded();
+    if (r)
+        return r;
 
-    m_isConnected   = false;
-    m_isLogined     = false;
+    r = mailimap_noop(m_imap);
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorNoop;
+    }
+
+    return ErrorNone;
 }
 
-void mailImap::setServer(const string& server)
+void mailImap::setConnectionType(ConnectionType connectionType)
 {
-    m_server = server;
+    m_connectionType = connectionType;
 }
-string mailImap::getServer()
+
+ConnectionType mailImap::getConnectionType() const
 {
-    return m_server;
+    return m_connectionType;
 }
-void mailImap::setPort(uint16_t port)
+
+uint64_t mailImap::getReconnectCount() const
 {
-    m_port = port;
+    return m_reconnectCount;
 }
-uint16_t mailImap::getPort() const
+
+string mailImap::currentFolder() const
 {
-    return m_port;
+    if (m_status != SS_SELECTED)
+        return string();
+    return m_currentFolder;
 }
-void mailImap::setUserid(const string& userid)
+
+void mailImap::setReadOnly(bool readOnly)
 {
-    m_userid = userid;
+    m_readOnly = readOnly;
 }
-string mailImap::getUserid() const
+
+bool mailImap::isReadOnly() const
 {
-    return m_userid;
+    return m_readOnly;
 }
-void mailImap::setPassword(const string& pwd)
+
+uint64_t mailImap::getSelectCount() const
 {
-    m_pwd = pwd;
+    return m_selectCount;
 }
-string mailImap::getPassword() const
+
+void mailImap::streamLogger(mailstream_low * s, int log_type, const char * str, size_t size, void * context)
 {
-    return m_pwd;
+    mailImap * session = (mailImap *) context;
+    bool wire = (s == session->m_wireLow);
+    bool data = !session->m_isCompressed || !wire;
+
+    // only the sizes are counted
+    (void) str;
+
+    switch (log_type) {
+    case MAILSTREAM_LOG_TYPE_DATA_RECEIVED:
+        if (wire)
+            session->m_wireBytesReceived += size;
+        if (data)
+            session->m_dataBytesReceived += size;
+        break;
+    case MAILSTREAM_LOG_TYPE_DATA_SENT:
+    case MAILSTREAM_LOG_TYPE_DATA_SENT_PRIVATE:
+        if (wire)
+            session->m_wireBytesSent += size;
+        if (data)
+            session->m_dataBytesSent += size;
+        break;
+    }
 }
 
-int mailImap::getMessageByUid(const string& folder, uint32_t uid, string& data)
+/*
+the reason of a NO is only in the text of the response, the errors
+callers can act on (back off, ask for another password...) are
+recognized from it.
+*/
+
+static int error_from_text(const char * text, int defaultError)
 {
-    return getMessage(folder, true, uid, data);
+    static const struct {
+        const char * text;
+        int error;
+    } responses[] = {
+        { "not enabled for IMAP use", ErrorGmailIMAPNotEnabled },
+        { "IMAP access is disabled", ErrorGmailIMAPNotEnabled },
+        { "bandwidth limits", ErrorGmailExceededBandwidthLimit },
+        { "Too many simultaneous connections", ErrorGmailTooManySimultaneousConnections },
+        { "Maximum number of connections", ErrorGmailTooManySimultaneousConnections },
+        { "Application-specific password required", ErrorGmailApplicationSpecificPasswordRequired },
+        { "http://me.com/move", ErrorMobileMeMoved },
+        { "OCF12", ErrorYahooUnavailable },
+        { "Login to your account via a web browser", ErrorOutlookLoginViaWebBrowser },
+    };
+
+    if (text == NULL)
+        return defaultError;
+
+    for (size_t i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+        if (strstr(text, responses[i].text) != NULL)
+            return responses[i].error;
+    }
+
+    return defaultError;
 }
 
-int mailImap::getMessageByNumber(const string& folder, uint32_t num, string& data)
+static int error_from_response(mailimap * imap, int defaultError)
 {
-    return getMessage(folder, false, num, data);
+    int r = error_from_text(imap->imap_response, defaultError);
+
+    if (r == defaultError && imap->imap_response_info != NULL)
+        r = error_from_text(imap->imap_response_info->rsp_alert, defaultError);
+
+    return r;
 }
 
-int mailImap::getMessage(const string& folder, bool isUid, uint32_t uidOrNumber, string& data)
+int mailImap::login()
 {
-    int r = selectIfNeeded(folder);
-    if (r)
-        return r;
+    if (m_isLogined)
+        return 0;
 
-    char * rfc822;
-    size_t rfc822_len = 0;
+    mailstream_low * low;
+    low = mailstream_get_low(m_imap->imap_stream);
+    //string identifier = m_userid + "@" + m_server + ":" + port;
+    size_t len = m_userid.length() + m_server.length() + 10;
+    char* identifier = new char[len];
+    sprintf_s(identifier, len, "%s@%s:%d", m_userid.c_str(), m_server.c_str(), m_port);
+    int r = mailstream_low_set_identifier(low, identifier);
+    printf("mailstream_low_set_identifier errno:%d\n", r);
 
-    rfc822 = NULL;
-    r = fetch_rfc822(m_imap, isUid, uidOrNumber, &rfc822, &rfc822_len);
+    string token;
+    if (m_authType != AuthTypeLogin) {
+        r = oauth2Token(token);
+        if (r != ErrorNone)
+            return r;
+    }
+
+    if (m_authType == AuthTypeOAuthBearer) {
+        // libetpan has no OAUTHBEARER, the errors are already mapped
+        r = oauthBearerAuthenticate(token);
+        if (r == ErrorAuthentication)
+            oauth2TokenRefused(token);
+        if (r != ErrorNone)
+            return r;
+    }
+    else {
+        if (m_authType == AuthTypeXOAuth2)
+            r = mailimap_oauth2_authenticate(m_imap, m_userid.c_str(), token.c_str());
+        else
+            r = mailimap_login(m_imap, m_userid.c_str(), m_pwd.c_str());
+        if (r == MAILIMAP_ERROR_STREAM) {
+            m_shouldDisconnect = true;
+            return ErrorConnection;
+        }
+        else if (r == MAILIMAP_ERROR_PARSE) {
+            m_shouldDisconnect = true;
+            return ErrorParse;
+        }
+        else if (hasError(r)) {
+            r = error_from_response(m_imap, ErrorAuthentication);
+            if (r == ErrorAuthentication && m_authType == AuthTypeXOAuth2)
+                oauth2TokenRefused(token);
+            return r;
+        }
+    }
 
-    if (r == MAILIMAP_NO_ERROR) {
-        size_t len;
+    if (!r)
+    {
+        m_status = SS_LOGGEDIN;
+        m_isLogined = true;
 
-        len = 0;
-        if (rfc822 != NULL) {
-            len = strlen(rfc822);
+        r = capability();
+        if (r == ErrorNone) {
+            enableFeaturesIfNeeded();
+            r = compressIfNeeded();
         }
-        //bodyProgress((unsigned int)len, (unsigned int)len);
     }
 
+    return r;
+}
+
+int mailImap::compressIfNeeded()
+{
+    if (!m_compressionEnabled || m_isCompressed || !mailimap_has_compress_deflate(m_imap))
+        return ErrorNone;
+
+    int r = mailimap_compress(m_imap);
     if (r == MAILIMAP_ERROR_STREAM) {
-        //mShouldDisconnect = true;
+        m_shouldDisconnect = true;
         return ErrorConnection;
     }
     else if (r == MAILIMAP_ERROR_PARSE) {
-        //mShouldDisconnect = true;
+        m_shouldDisconnect = true;
         return ErrorParse;
     }
     else if (hasError(r)) {
-        return ErrorFetch;
-    }
-
-    if (rfc822 != NULL) {
-        data = string(rfc822, (unsigned int)rfc822_len);
+        return ErrorCompression;
     }
 
-    mailimap_nstring_free(rfc822);
+    // the deflate layer now sits on top of the socket, count what goes through it as data
+    m_isCompressed = true;
+    mailstream_low_set_logger(mailstream_get_low(m_imap->imap_stream), streamLogger, this);
 
     return ErrorNone;
 }
 
-int mailImap::getMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, string& data)
+void mailImap::setCompressionEnabled(bool enabled)
 {
-    return getMessageAttachment(folder, true, uid, partId, encoding, data);
+    m_compressionEnabled = enabled;
+}
+bool mailImap::isCompressionEnabled() const
+{
+    return m_compressionEnabled;
 }
 
-int mailImap::getMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, string& data)
+void mailImap::setMessageCache(messageCache * cache)
 {
-    int r = getNonDecodedMessageAttachment(folder, isUid, uidOrNumber, partId, true, 0, 0, encoding, data);
-    if (r == ErrorNone)
-        decodeData(data, encoding);
+    m_cache = cache;
+}
 
-    return r;
+messageCache * mailImap::getMessageCache() const
+{
+    return m_cache;
+}
+void mailImap::setAuthType(AuthType authType)
+{
+    m_authType = authType;
 }
 
-int mailImap::getNonDecodedMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId,
-    bool wholePart, uint32_t offset, uint32_t length, Encoding encoding, string& data)
+AuthType mailImap::getAuthType() const
+{
+    return m_authType;
+}
+
+void mailImap::setOAuth2Token(const string& token)
+{
+    m_oauth2Token = token;
+}
+
+string mailImap::getOAuth2Token() const
+{
+    return m_oauth2Token;
+}
+
+void mailImap::setOAuthTokenCache(oauthTokenCache * cache)
+{
+    m_tokenCache = cache;
+}
+
+oauthTokenCache * mailImap::getOAuthTokenCache() const
+{
+    return m_tokenCache;
+}
+
+/* logins only wait here the first time an account is used, the cache refreshes tokens beforehand */
+
+int mailImap::oauth2Token(string& token)
+{
+    if (m_tokenCache != NULL)
+        return m_tokenCache->getToken(m_userid, token);
+
+    if (m_oauth2Token.empty())
+        return ErrorAuthentication;
+    token = m_oauth2Token;
+    return ErrorNone;
+}
+
+/* a token revoked before its expiry is refreshed by the next login */
+
+void mailImap::oauth2TokenRefused(const string& token)
+{
+    if (m_tokenCache != NULL)
+        m_tokenCache->invalidate(m_userid, token);
+}
+
+void mailImap::setPipelinedLoginEnabled(bool enabled)
+{
+    m_pipelinedLoginEnabled = enabled;
+}
+
+bool mailImap::isPipelinedLoginEnabled() const
+{
+    return m_pipelinedLoginEnabled;
+}
+
+void mailImap::setCapabilityCache(capabilityCache * cache)
+{
+    m_capabilityCache = cache;
+}
+
+capabilityCache * mailImap::getCapabilityCache() const
+{
+    return m_capabilityCache;
+}
+uint64_t mailImap::getWireBytesReceived() const
+{
+    return m_wireBytesReceived;
+}
+uint64_t mailImap::getWireBytesSent() const
+{
+    return m_wireBytesSent;
+}
+uint64_t mailImap::getDataBytesReceived() const
+{
+    return m_dataBytesReceived;
+}
+uint64_t mailImap::getDataBytesSent() const
+{
+    return m_dataBytesSent;
+}
+
+/* capabilities may change after authentication, ask for them again */
+
+int mailImap::capability()
+{
+    struct mailimap_capability_data * cap;
+
+    int r = mailimap_capability(m_imap, &cap);
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorCapability;
+    }
+
+    mailimap_capability_data_free(cap);
+    capabilitiesChanged();
+
+    return ErrorNone;
+}
+
+void mailImap::capabilitiesChanged()
+{
+    m_condstoreEnabled = mailimap_has_condstore(m_imap) != 0;
+    m_qresyncEnabled = mailimap_has_qresync(m_imap) != 0;
+    m_idleEnabled = mailimap_has_idle(m_imap) != 0;
+    m_xlistEnabled = mailimap_has_xlist(m_imap) != 0;
+    m_listStatusEnabled = mailimap_has_extension(m_imap, (char *) "LIST-STATUS") != 0;
+    m_specialUseEnabled = mailimap_has_extension(m_imap, (char *) "SPECIAL-USE") != 0;
+}
+
+void mailImap::enableFeaturesIfNeeded()
+{
+    if (m_qresyncEnabled) {
+        // QRESYNC implies CONDSTORE
+        m_qresyncEnabled = enableFeature("QRESYNC");
+        m_condstoreEnabled = m_condstoreEnabled || m_qresyncEnabled;
+    }
+    else if (m_condstoreEnabled) {
+        m_condstoreEnabled = enableFeature("CONDSTORE");
+    }
+}
+
+bool mailImap::enableFeature(const string& feature)
+{
+    struct mailimap_capability_data * caps;
+    struct mailimap_capability_data * result;
+    struct mailimap_capability * cap;
+    clist * cap_list;
+    int r;
+
+    if (!mailimap_has_enable(m_imap))
+        return false;
+
+    cap_list = clist_new();
+    cap = mailimap_capability_new(MAILIMAP_CAPABILITY_NAME, NULL, _strdup(feature.c_str()));
+    clist_append(cap_list, cap);
+    caps = mailimap_capability_data_new(cap_list);
+
+    r = mailimap_enable(m_imap, caps, &result);
+    mailimap_capability_data_free(caps);
+    if (r != MAILIMAP_NO_ERROR)
+        return false;
+
+    mailimap_capability_data_free(result);
+
+    return true;
+}
+
+bool mailImap::isCondstoreEnabled() const
+{
+    return m_condstoreEnabled;
+}
+
+bool mailImap::isQResyncEnabled() const
+{
+    return m_qresyncEnabled;
+}
+
+void mailImap::init()
+{
+    m_port = 0;
+    m_imap = NULL;
+
+    m_isConnected   = false;
+    m_isLogined     = false;
+
+    m_status        = SS_DISCONNECTED;
+    m_delimiter     = 0;
+}
+
+void mailImap::setServer(const string& server)
+{
+    m_server = server;
+}
+string mailImap::getServer()
+{
+    return m_server;
+}
+void mailImap::setPort(uint16_t port)
+{
+    m_port = port;
+}
+uint16_t mailImap::getPort() const
+{
+    return m_port;
+}
+void mailImap::setUserid(const string& userid)
+{
+    m_userid = userid;
+}
+string mailImap::getUserid() const
+{
+    return m_userid;
+}
+void mailImap::setPassword(const string& pwd)
+{
+    m_pwd = pwd;
+}
+string mailImap::getPassword() const
+{
+    return m_pwd;
+}
+void mailImap::setFetchBatchSize(uint32_t batchSize)
+{
+    m_fetchBatchSize = batchSize;
+}
+uint32_t mailImap::getFetchBatchSize() const
+{
+    return m_fetchBatchSize;
+}
+void mailImap::setStreamChunkSize(uint32_t chunkSize)
+{
+    assert(chunkSize > 0);
+    m_streamChunkSize = chunkSize;
+}
+uint32_t mailImap::getStreamChunkSize() const
+{
+    return m_streamChunkSize;
+}
+
+int mailImap::getMessageByUid(const string& folder, uint32_t uid, string& data)
+{
+    return getMessage(folder, true, uid, data);
+}
+
+int mailImap::getMessageByNumber(const string& folder, uint32_t num, string& data)
+{
+    return getMessage(folder, false, num, data);
+}
+
+int mailImap::getMessageByUid(const string& folder, uint32_t uid, imapBuffer& data)
+{
+    return getMessage(folder, true, uid, data);
+}
+
+int mailImap::getMessageByNumber(const string& folder, uint32_t num, imapBuffer& data)
+{
+    return getMessage(folder, false, num, data);
+}
+
+int mailImap::getMessage(const string& folder, bool isUid, uint32_t uidOrNumber, string& data)
+{
+    imapBuffer buffer;
+
+    int r = getMessage(folder, isUid, uidOrNumber, buffer);
+    if (r == ErrorNone)
+        data.assign(buffer.data(), buffer.size());
+
+    return r;
+}
+
+/*
+a folder selected before is looked up in the cache with the UIDVALIDITY
+of its last SELECT, and only selected on a miss: reading cached messages
+of several folders costs no round trip. the key is checked again with
+the UIDVALIDITY the SELECT returns.
+*/
+
+int mailImap::getMessage(const string& folder, bool isUid, uint32_t uidOrNumber, imapBuffer& data)
+{
+    string cacheKey;
+
+    // sequence numbers change with every expunge, only UIDs are cached
+    if (m_cache != NULL && isUid) {
+        map<string, uint32_t>::iterator it = m_uidValidities.find(folder);
+        if (it != m_uidValidities.end()) {
+            cacheKey = messageCache::messageKey(m_server, m_userid, folder, it->second, uidOrNumber);
+            if (m_cache->get(cacheKey, data))
+                return ErrorNone;
+        }
+    }
+
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    if (m_cache != NULL && isUid && m_imap->imap_selection_info != NULL) {
+        string selectedKey = messageCache::messageKey(m_server, m_userid, folder,
+            m_imap->imap_selection_info->sel_uidvalidity, uidOrNumber);
+        if (selectedKey != cacheKey) {
+            cacheKey = selectedKey;
+            if (m_cache->get(cacheKey, data))
+                return ErrorNone;
+        }
+    }
+
+    char * rfc822;
+    size_t rfc822_len = 0;
+
+    rfc822 = NULL;
+    r = fetch_rfc822(m_imap, isUid, uidOrNumber, &rfc822, &rfc822_len);
+
+    //if (r == MAILIMAP_NO_ERROR)
+    //    bodyProgress((unsigned int)rfc822_len, (unsigned int)rfc822_len);
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorFetch;
+    }
+
+    data.reset(rfc822, rfc822_len);
+    if (!cacheKey.empty())
+        m_cache->put(cacheKey, data.data(), data.size());
+
+    return ErrorNone;
+}
+
+int mailImap::getMessagesByUids(const string& folder, const vector<uint32_t>& uids, messageSink sink)
+{
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    vector<struct mailimap_set *> sets = uid_sets_from_uids(uids, m_fetchBatchSize);
+
+    r = ErrorNone;
+    for (size_t i = 0; i < sets.size(); i++) {
+        if (r == ErrorNone)
+            r = fetchMessages(sets[i], sink);
+        mailimap_set_free(sets[i]);
+    }
+
+    return r;
+}
+
+int mailImap::getMessagesByUidRange(const string& folder, uint32_t firstUid, uint32_t lastUid, messageSink sink)
+{
+    struct mailimap_set * set;
+
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    if (lastUid == 0 || m_fetchBatchSize == 0) {
+        set = mailimap_set_new_interval(firstUid, lastUid);
+        r = fetchMessages(set, sink);
+        mailimap_set_free(set);
+        return r;
+    }
+
+    for (uint64_t first = firstUid; first <= lastUid && r == ErrorNone; first += m_fetchBatchSize) {
+        uint64_t last = first + m_fetchBatchSize - 1;
+        if (last > lastUid)
+            last = lastUid;
+
+        set = mailimap_set_new_interval((uint32_t)first, (uint32_t)last);
+        r = fetchMessages(set, sink);
+        mailimap_set_free(set);
+    }
+
+    return r;
+}
+
+int mailImap::fetchMessages(struct mailimap_set * set, messageSink& sink)
 {
     struct mailimap_fetch_type * fetch_type;
-    struct mailimap_fetch_att * fetch_att;
     struct mailimap_section * section;
-    struct mailimap_section_part * section_part;
-    clist * sec_list;
-    vector<string> partIDArray;
-    //Array * partIDArray;
+    struct fetch_messages_context context;
+    clist * fetch_result = NULL;
     int r;
-    char * text = NULL;
-    size_t text_length = 0;
-    //Data * data;
-    r = selectIfNeeded(folder);
+
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    section = mailimap_section_new(NULL);
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_body_peek_section(section));
+
+    context.sink = &sink;
+    context.error = ErrorNone;
+
+    mailimap_set_msg_att_handler(m_imap, fetch_messages_handler, &context);
+    r = mailimap_uid_fetch(m_imap, set, fetch_type, &fetch_result);
+    mailimap_set_msg_att_handler(m_imap, NULL, NULL);
+    mailimap_fetch_type_free(fetch_type);
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return error_from_response(m_imap, ErrorFetch);
+    }
+
+    mailimap_fetch_list_free(fetch_result);
+
+    return context.error;
+}
+
+int mailImap::fetchEnvelopes(const string& folder, uint32_t firstUid, uint32_t lastUid, envelopeIndex& index)
+{
+    struct mailimap_set * set;
+
+    int r = selectIfNeeded(folder);
     if (r)
         return r;
 
-    partIDArray = splictStr(partId, ".");
-    sec_list = clist_new();
-    for (unsigned int i = 0; i < partIDArray.size(); i++) {
-        uint32_t * value;
-        string element;
+    if (lastUid == 0 || m_fetchBatchSize == 0) {
+        set = mailimap_set_new_interval(firstUid, lastUid);
+        r = fetchEnvelopes(set, index);
+        mailimap_set_free(set);
+        return r;
+    }
+
+    for (uint64_t first = firstUid; first <= lastUid && r == ErrorNone; first += m_fetchBatchSize) {
+        uint64_t last = first + m_fetchBatchSize - 1;
+        if (last > lastUid)
+            last = lastUid;
+
+        set = mailimap_set_new_interval((uint32_t)first, (uint32_t)last);
+        r = fetchEnvelopes(set, index);
+        mailimap_set_free(set);
+    }
+
+    return r;
+}
+
+int mailImap::fetchEnvelopes(struct mailimap_set * set, envelopeIndex& index)
+{
+    struct mailimap_fetch_type * fetch_type;
+    struct fetch_envelopes_context context;
+    clist * fetch_result = NULL;
+    int r;
+
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_internaldate());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_rfc822_size());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_flags());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_envelope());
+
+    context.index = &index;
+
+    mailimap_set_msg_att_handler(m_imap, fetch_envelopes_handler, &context);
+    r = mailimap_uid_fetch(m_imap, set, fetch_type, &fetch_result);
+    mailimap_set_msg_att_handler(m_imap, NULL, NULL);
+    mailimap_fetch_type_free(fetch_type);
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorFetch;
+    }
+
+    mailimap_fetch_list_free(fetch_result);
+
+    return ErrorNone;
+}
+
+int mailImap::getMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, string& data)
+{
+    return getMessageAttachment(folder, true, uid, partId, encoding, data);
+}
+
+int mailImap::getMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, imapBuffer& data)
+{
+    return getMessageAttachment(folder, true, uid, partId, encoding, data);
+}
+
+int mailImap::getMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, imapBuffer& data)
+{
+    int r = getNonDecodedMessageAttachment(folder, isUid, uidOrNumber, partId, true, 0, 0, encoding, data);
+    if (r == ErrorNone)
+        decodeData(data, encoding);
+
+    return r;
+}
+
+int mailImap::getMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, string& data)
+{
+    int r = getNonDecodedMessageAttachment(folder, isUid, uidOrNumber, partId, true, 0, 0, encoding, data);
+    if (r == ErrorNone)
+        decodeData(data, encoding);
+
+    return r;
+}
+
+int mailImap::getMessageAttachmentRangeByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding,
+    uint32_t offset, uint32_t length, imapBuffer& data)
+{
+    return getNonDecodedMessageAttachment(folder, true, uid, partId, false, offset, length, encoding, data);
+}
+
+int mailImap::getNonDecodedMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId,
+    bool wholePart, uint32_t offset, uint32_t length, Encoding encoding, string& data)
+{
+    imapBuffer buffer;
+
+    int r = getNonDecodedMessageAttachment(folder, isUid, uidOrNumber, partId, wholePart, offset, length, encoding, buffer);
+    if (r == ErrorNone)
+        data.assign(buffer.data(), buffer.size());
+
+    return r;
+}
+
+int mailImap::getNonDecodedMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId,
+    bool wholePart, uint32_t offset, uint32_t length, Encoding encoding, imapBuffer& data)
+{
+    struct mailimap_fetch_type * fetch_type;
+    struct mailimap_fetch_att * fetch_att;
+    struct mailimap_section * section;
+    struct mailimap_section_part * section_part;
+    clist * sec_list;
+    vector<string> partIDArray;
+    //Array * partIDArray;
+    int r;
+    char * text = NULL;
+    size_t text_length = 0;
+    //Data * data;
+    r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    if (partId.empty()) {
+        // the whole message
+        section = mailimap_section_new(NULL);
+    }
+    else {
+        partIDArray = splictStr(partId, ".");
+        sec_list = clist_new();
+        for (unsigned int i = 0; i < partIDArray.size(); i++) {
+            uint32_t * value;
+            string element;
+
+            element = partIDArray.at(i);
+            value = (uint32_t *)malloc(sizeof(*value));
+            *value = (uint32_t)(atol(element.c_str()));
+            clist_append(sec_list, value);
+        }
+
+        section_part = mailimap_section_part_new(sec_list);
+        section = mailimap_section_new_part(section_part);
+    }
+    if (wholePart) {
+        fetch_att = mailimap_fetch_att_new_body_peek_section(section);
+    }
+    else {
+        fetch_att = mailimap_fetch_att_new_body_peek_section_partial(section, offset, length);
+    }
+    fetch_type = mailimap_fetch_type_new_fetch_att(fetch_att);
+
+#ifdef LIBETPAN_HAS_MAILIMAP_RAMBLER_WORKAROUND
+    if (m_ramblerRuServer && (encoding == EncodingBase64 || encoding == EncodingUUEncode)) {
+        mailimap_set_rambler_workaround_enabled(m_imap, 1);
+    }
+#endif
+
+    r = fetch_imap(m_imap, isUid, uidOrNumber, fetch_type, &text, &text_length);
+    mailimap_fetch_type_free(fetch_type);
+
+#ifdef LIBETPAN_HAS_MAILIMAP_RAMBLER_WORKAROUND
+    mailimap_set_rambler_workaround_enabled(m_imap, 0);
+#endif
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        //*pError = ErrorConnection;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        //*pError = ErrorParse;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        //*pError = ErrorFetch;
+        return ErrorFetch;
+    }
+
+    data.reset(text, text_length);
+
+    return ErrorNone;
+}
+int mailImap::streamMessageByUid(const string& folder, uint32_t uid, chunkSink sink)
+{
+    string partId;
+
+    return streamSection(folder, true, uid, partId, Encoding8Bit, sink);
+}
+
+int mailImap::streamMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, chunkSink sink)
+{
+    return streamSection(folder, true, uid, partId, encoding, sink);
+}
+
+static const imapPart * find_part(const imapPart& part, const string& partId)
+{
+    if (part.partId() == partId)
+        return &part;
+    for (size_t i = 0; i < part.parts().size(); i++) {
+        const imapPart * found = find_part(part.parts().at(i), partId);
+        if (found != NULL)
+            return found;
+    }
+    return NULL;
+}
+
+/*
+encoded size of a section, RFC822.SIZE for the whole message and the
+BODYSTRUCTURE size for a part.
+*/
+
+int mailImap::sectionSize(const string& folder, uint32_t uid, const string& partId, uint32_t& size)
+{
+    if (!partId.empty()) {
+        imapPart root;
+        const imapPart * part;
+
+        int r = getBodyStructure(folder, uid, root);
+        if (r != ErrorNone)
+            return r;
+        part = find_part(root, partId);
+        if (part == NULL)
+            return ErrorFetch;
+        size = part->size();
+        return ErrorNone;
+    }
+
+    struct mailimap_fetch_type * fetch_type;
+    struct mailimap_set * set;
+    clist * fetch_result = NULL;
+    clistiter * cur;
+    bool found = false;
+
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_rfc822_size());
+
+    set = mailimap_set_new_single(uid);
+    r = mailimap_uid_fetch(m_imap, set, fetch_type, &fetch_result);
+    mailimap_set_free(set);
+    mailimap_fetch_type_free(fetch_type);
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorFetch;
+    }
+
+    for (cur = clist_begin(fetch_result); cur != NULL && !found; cur = clist_next(cur)) {
+        struct mailimap_msg_att * msg_att = (struct mailimap_msg_att *) clist_content(cur);
+        uint32_t att_uid = 0;
+        uint32_t att_size = 0;
+        bool has_size = false;
+        clistiter * item_cur;
+
+        for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+            struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
+
+            if (att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC)
+                continue;
+            if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID) {
+                att_uid = att_item->att_data.att_static->att_data.att_uid;
+            }
+            else if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_RFC822_SIZE) {
+                att_size = att_item->att_data.att_static->att_data.att_rfc822_size;
+                has_size = true;
+            }
+        }
+
+        // unsolicited FETCH responses for other messages may be mixed in
+        if (att_uid == uid && has_size) {
+            size = att_size;
+            found = true;
+        }
+    }
+    mailimap_fetch_list_free(fetch_result);
+
+    if (!found)
+        return ErrorFetch;
+
+    return ErrorNone;
+}
+
+/*
+the section is read in chunks of m_streamChunkSize until a chunk comes
+back short. when the first chunk is full the size of the section is
+asked once, so that a section of an exact multiple of the chunk size
+ends without reading past its end: servers answer that with an empty
+string, NIL or NO. a NO on any other chunk is an error.
+*/
+
+int mailImap::streamSection(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, chunkSink& sink)
+{
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    bool knowSize = false;
+    // encoded characters that can only be decoded together with the next chunk
+    string pending;
+    int r;
+
+    while (1) {
+        imapBuffer chunk;
+        size_t chunk_length;
+
+        r = getNonDecodedMessageAttachment(folder, isUid, uidOrNumber, partId, false, offset, m_streamChunkSize, encoding, chunk);
+        if (r != ErrorNone)
+            return r;
+
+        chunk_length = chunk.size();
+        if (chunk_length > 0) {
+            if (!needs_decoding(encoding)) {
+                r = sink(chunk.data(), chunk_length);
+            }
+            else if (pending.empty()) {
+                size_t length = decodable_length(chunk.data(), chunk_length, encoding);
+
+                pending.assign(chunk.data() + length, chunk_length - length);
+                r = sink(chunk.data(), decode_buffer(chunk.data(), length, encoding));
+            }
+            else {
+                pending.append(chunk.data(), chunk_length);
+                chunk.reset();
+
+                size_t length = decodable_length(pending.data(), pending.size(), encoding);
+                r = sink(pending.data(), decode_buffer(&pending[0], length, encoding));
+                pending.erase(0, length);
+            }
+            if (r != ErrorNone)
+                return r;
+        }
+
+        if (chunk_length < m_streamChunkSize)
+            break;
+        offset += (uint32_t)chunk_length;
+
+        if (!knowSize && isUid) {
+            r = sectionSize(folder, uidOrNumber, partId, size);
+            if (r != ErrorNone)
+                return r;
+            knowSize = true;
+        }
+        if (knowSize && offset >= size)
+            break;
+    }
+
+    if (!pending.empty())
+        return sink(pending.data(), decode_buffer(&pending[0], pending.size(), encoding));
+
+    return ErrorNone;
+}
+
+vector<string> mailImap::splictStr(const string& str, const string& sep)
+{
+    vector<string> result;
+    string::size_type pos = 0, first_pos = 0;
+
+    while (1)
+    {
+        pos = str.find(sep, first_pos);
+        if (pos == string::npos)
+        {
+            result.push_back(str.substr(first_pos));
+            break;
+        }
+        else
+        {
+            result.push_back(str.substr(first_pos, pos - first_pos));
+            first_pos = pos + 1;
+        }
+    }
+    
+    return result;
+}
+
+void mailImap::decodeData(string& data, Encoding encoding)
+{
+    if (data.empty() || !needs_decoding(encoding))
+        return;
+
+    data.resize(decode_buffer(&data[0], data.size(), encoding));
+}
+void mailImap::decodeData(imapBuffer& data, Encoding encoding)
+{
+    if (data.empty() || !needs_decoding(encoding))
+        return;
+
+    data.setSize(decode_buffer(data.data(), data.size(), encoding));
+}
+int mailImap::selectIfNeeded(const string& folder)
+{
+    int r = loginIfNeeded(folder);
+    if (r)
+        return r;
+
+    if (m_status == SS_SELECTED)
+    {
+        // a folder opened read only has to be selected again to be changed
+        if (m_currentFolder != folder || (m_selectedReadOnly && !m_readOnly))
+            r = selectFolder(folder);
+    }
+    else if(m_status == SS_LOGGEDIN)
+    {
+        r = selectFolder(folder);
+    }
+    else
+    {
+        r = 0;
+    }
+    
+    return r;
+}
+
+int mailImap::selectFolder(const string& folder)
+{
+    assert(m_status == SS_SELECTED || m_status == SS_LOGGEDIN);
+
+    int r;
+    if (m_readOnly)
+        r = mailimap_examine(m_imap, folder.c_str());
+    else
+        r = mailimap_select(m_imap, folder.c_str());
+    m_selectCount++;
+    if (r == MAILIMAP_ERROR_STREAM)
+    {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE)
+    {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r))
+    {
+        return ErrorNonExistantFolder;
+    }
+
+    m_currentFolder = folder;
+    m_selectedReadOnly = m_readOnly;
+    if (m_imap->imap_selection_info != NULL && m_imap->imap_selection_info->sel_uidvalidity != 0)
+        m_uidValidities[folder] = m_imap->imap_selection_info->sel_uidvalidity;
+
+    m_status = SS_SELECTED;
+    return ErrorNone;
+}
+
+static bool hasError(int errorCode)
+{
+    return ((errorCode != MAILIMAP_NO_ERROR) && (errorCode != MAILIMAP_NO_ERROR_AUTHENTICATED) &&
+        (errorCode != MAILIMAP_NO_ERROR_NON_AUTHENTICATED));
+}
+int mailImap::loginIfNeeded(const string& folder)
+{
+    int r = connectIfNeeded();
+    if (r)
+        return r;
+
+    // the caller selects folder itself, the folder selected before the reconnection is not needed
+    if (!folder.empty() && m_reconnectFolder != folder)
+        m_reconnectFolder.clear();
+
+    if (m_status == SS_CONNECTED && m_pipelinedLoginEnabled)
+        r = pipelinedLogin(!folder.empty() ? folder : m_reconnectFolder);
+    else if(m_status == SS_CONNECTED)
+        r = login();
+
+    if (r == ErrorNone && !m_reconnectFolder.empty() && m_status == SS_LOGGEDIN) {
+        string reconnectFolder = m_reconnectFolder;
+
+        m_reconnectFolder.clear();
+        r = selectFolder(reconnectFolder);
+        // the folder may have been deleted meanwhile, the session is usable anyway
+        if (r == ErrorNonExistantFolder)
+            r = ErrorNone;
+    }
+
+    return r;
+}
+int mailImap::connectIfNeeded()
+{
+    int r = 0;
+
+    if (m_shouldDisconnect) {
+        // the connection broke during the last command, the folder is selected again after login
+        if (m_status == SS_SELECTED)
+            m_reconnectFolder = m_currentFolder;
+        // no LOGOUT on a broken stream
+        m_isConnected = false;
+        disconnect();
+        m_shouldDisconnect = false;
+        m_reconnectCount++;
+    }
+
+    if (m_status == SS_DISCONNECTED)
+        r = connect();
+
+    return r;
+}
+
+
+static string base64_encode(const string& data)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string result;
+    size_t i;
+
+    for (i = 0; i + 2 < data.size(); i += 3) {
+        uint32_t value = ((uint8_t) data[i] << 16) | ((uint8_t) data[i + 1] << 8) | (uint8_t) data[i + 2];
+
+        result.push_back(alphabet[(value >> 18) & 0x3f]);
+        result.push_back(alphabet[(value >> 12) & 0x3f]);
+        result.push_back(alphabet[(value >> 6) & 0x3f]);
+        result.push_back(alphabet[value & 0x3f]);
+    }
+    if (i < data.size()) {
+        uint32_t value = (uint8_t) data[i] << 16;
+
+        if (i + 1 < data.size())
+            value |= (uint8_t) data[i + 1] << 8;
+        result.push_back(alphabet[(value >> 18) & 0x3f]);
+        result.push_back(alphabet[(value >> 12) & 0x3f]);
+        result.push_back(i + 1 < data.size() ? alphabet[(value >> 6) & 0x3f] : '=');
+        result.push_back('=');
+    }
+
+    return result;
+}
+
+/* RFC 7628, a is the user as for XOAUTH2, "," and "=" are escaped in it */
+
+static string oauthbearer_response(const string& user, const string& token)
+{
+    string name;
+
+    for (size_t i = 0; i < user.size(); i++) {
+        if (user[i] == ',')
+            name += "=2C";
+        else if (user[i] == '=')
+            name += "=3D";
+        else
+            name.push_back(user[i]);
+    }
+
+    return base64_encode("n,a=" + name + ",\x01" "auth=Bearer " + token + "\x01\x01");
+}
+
+static string xoauth2_response(const string& user, const string& token)
+{
+    return base64_encode("user=" + user + "\x01" "auth=Bearer " + token + "\x01\x01");
+}
+
+/* the capabilities libetpan knows, as announced: "AUTH=PLAIN", "IDLE" */
+
+static vector<string> capability_names(mailimap * imap)
+{
+    vector<string> names;
+    clistiter * cur;
+
+    if (imap->imap_connection_info == NULL || imap->imap_connection_info->imap_capability == NULL)
+        return names;
+
+    for (cur = clist_begin(imap->imap_connection_info->imap_capability->cap_list); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_capability * cap = (struct mailimap_capability *) clist_content(cur);
+
+        if (cap->cap_type == MAILIMAP_CAPABILITY_AUTH_TYPE)
+            names.push_back(string("AUTH=") + cap->cap_data.cap_auth_type);
+        else
+            names.push_back(cap->cap_data.cap_name);
+    }
+
+    return names;
+}
+
+/* what a CAPABILITY sent by imapCommandStream answered, for mailimap_has_...() */
+
+static void set_capabilities(mailimap * imap, const vector<string>& names)
+{
+    clist * cap_list = clist_new();
+
+    for (size_t i = 0; i < names.size(); i++) {
+        struct mailimap_capability * cap;
+
+        if (toupper(names[i].substr(0, 5)) == "AUTH=")
+            cap = mailimap_capability_new(MAILIMAP_CAPABILITY_AUTH_TYPE, _strdup(names[i].substr(5).c_str()), NULL);
+        else
+            cap = mailimap_capability_new(MAILIMAP_CAPABILITY_NAME, NULL, _strdup(names[i].c_str()));
+        clist_append(cap_list, cap);
+    }
+
+    if (imap->imap_connection_info->imap_capability != NULL)
+        mailimap_capability_data_free(imap->imap_connection_info->imap_capability);
+    imap->imap_connection_info->imap_capability = mailimap_capability_data_new(cap_list);
+}
+
+/* "[UIDNEXT 42] Predicted next UID" gives UIDNEXT and 42, false without a response code */
+
+static bool response_code(const string& text, string& name, string& value)
+{
+    if (text.empty() || text[0] != '[')
+        return false;
+
+    size_t end = text.find(']');
+    if (end == string::npos)
+        return false;
+
+    string code = text.substr(1, end - 1);
+    size_t space = code.find(' ');
+    name = toupper(code.substr(0, space));
+    value = (space != string::npos) ? code.substr(space + 1) : string();
+    return true;
+}
+
+/*
+RFC 3501 5.5 lets a client send commands without waiting for the answer of
+the one before: LOGIN, CAPABILITY, ENABLE and SELECT go in one write. when
+the login fails the commands after it fail too and nothing changes.
+
+AUTHENTICATE PLAIN is only used with an initial response (SASL-IR, RFC
+4959), otherwise the server would take the next command line for the
+response to its continuation request.
+
+ENABLE has to come before SELECT, and it depends on what the server
+announces after login: ENABLE and SELECT are only pipelined when these
+capabilities are in the cache. the first session of a server sends
+ENABLE and SELECT once logged in, and fills the cache.
+*/
+
+int mailImap::pipelinedLogin(const string& folder)
+{
+    imapCommandStream stream(m_imap);
+    vector<string> beforeLogin = capability_names(m_imap);
+    vector<string> afterLogin;
+    vector<string> enabled;
+    bool knownAfterLogin = false;
+    bool hasCapabilities = false;
+    map<string, string> statuses;
+    string loginTag;
+    string capabilityTag;
+    string enableTag;
+    string selectTag;
+    string loginText;
+    string selectText;
+    struct mailimap_selection_info selection;
+    int r;
+
+    memset(&selection, 0, sizeof(selection));
+
+    if (m_capabilityCache != NULL) {
+        // most servers announce their capabilities in the greeting
+        if (!beforeLogin.empty())
+            m_capabilityCache->setBeforeLogin(m_server, m_port, beforeLogin);
+        else
+            m_capabilityCache->getBeforeLogin(m_server, m_port, beforeLogin);
+        knownAfterLogin = m_capabilityCache->getAfterLogin(m_server, m_port, afterLogin);
+    }
+
+    bool initialResponse = capabilityCache::hasCapability(beforeLogin, "SASL-IR");
+    string token;
+    if (m_authType != AuthTypeLogin) {
+        // without SASL-IR the token waits for a continuation request, it cannot be pipelined
+        if (!initialResponse)
+            return login();
+        r = oauth2Token(token);
+        if (r != ErrorNone)
+            return r;
+    }
+    else if (!(initialResponse && capabilityCache::hasCapability(beforeLogin, "AUTH=PLAIN")) &&
+        (!imapCommandStream::canQuote(m_userid) || !imapCommandStream::canQuote(m_pwd))) {
+        // libetpan sends them as literals, which wait for a continuation request
+        return login();
+    }
+
+    loginTag = stream.nextTag();
+    if (m_authType == AuthTypeXOAuth2)
+        r = stream.send(loginTag, "AUTHENTICATE XOAUTH2 " + xoauth2_response(m_userid, token));
+    else if (m_authType == AuthTypeOAuthBearer)
+        r = stream.send(loginTag, "AUTHENTICATE OAUTHBEARER " + oauthbearer_response(m_userid, token));
+    else if (initialResponse && capabilityCache::hasCapability(beforeLogin, "AUTH=PLAIN"))
+        r = stream.send(loginTag, "AUTHENTICATE PLAIN " + base64_encode(string(1, '\0') + m_userid + string(1, '\0') + m_pwd));
+    else
+        r = stream.send(loginTag, "LOGIN " + imapCommandStream::quote(m_userid) + " " + imapCommandStream::quote(m_pwd));
+
+    capabilityTag = stream.nextTag();
+    if (r == ErrorNone)
+        r = stream.send(capabilityTag, "CAPABILITY");
+
+    if (knownAfterLogin && capabilityCache::hasCapability(afterLogin, "ENABLE")) {
+        string feature;
+
+        if (capabilityCache::hasCapability(afterLogin, "QRESYNC"))
+            feature = "QRESYNC";
+        else if (capabilityCache::hasCapability(afterLogin, "CONDSTORE"))
+            feature = "CONDSTORE";
+        if (!feature.empty() && r == ErrorNone) {
+            enableTag = stream.nextTag();
+            r = stream.send(enableTag, "ENABLE " + feature);
+        }
+    }
+
+    // a folder that needs a literal is selected by selectIfNeeded() once logged in
+    if (knownAfterLogin && !folder.empty() && imapCommandStream::canQuote(folder) && r == ErrorNone) {
+        selectTag = stream.nextTag();
+        r = stream.send(selectTag, (m_readOnly ? "EXAMINE " : "SELECT ") + imapCommandStream::quote(folder));
+    }
+
+    if (r == ErrorNone)
+        r = stream.flush();
+
+    // the status of each command sent, empty until its tagged response is read
+    statuses[loginTag] = string();
+    statuses[capabilityTag] = string();
+    if (!enableTag.empty())
+        statuses[enableTag] = string();
+    if (!selectTag.empty())
+        statuses[selectTag] = string();
+
+    size_t pending = statuses.size();
+    while (r == ErrorNone && pending > 0) {
+        string line;
+
+        r = stream.readLine(line);
+        if (r != ErrorNone)
+            break;
+
+        if (line.compare(0, 1, "+") == 0) {
+            // a refused token (XOAUTH2, OAUTHBEARER) comes with a challenge: the server takes
+            // the CAPABILITY line for its answer, then refuses the login
+            if (statuses[capabilityTag].empty() && statuses[loginTag].empty()) {
+                statuses[capabilityTag] = "NO";
+                pending--;
+                continue;
+            }
+            r = ErrorParse;
+            break;
+        }
+
+        if (line.compare(0, 2, "* ") == 0) {
+            vector<string> words = splictStr(line.substr(2), " ");
+            string kind = toupper(words.at(0));
+            string code;
+            string value;
+
+            if (kind == "CAPABILITY") {
+                afterLogin.assign(words.begin() + 1, words.end());
+                hasCapabilities = true;
+            }
+            else if (kind == "ENABLED") {
+                enabled.insert(enabled.end(), words.begin() + 1, words.end());
+            }
+            else if (words.size() >= 2 && toupper(words.at(1)) == "EXISTS") {
+                selection.sel_exists = (uint32_t) strtoul(words.at(0).c_str(), NULL, 10);
+                selection.sel_has_exists = 1;
+            }
+            else if (words.size() >= 2 && toupper(words.at(1)) == "RECENT") {
+                selection.sel_recent = (uint32_t) strtoul(words.at(0).c_str(), NULL, 10);
+                selection.sel_has_recent = 1;
+            }
+            else if (kind == "OK" && words.size() >= 2 && response_code(line.substr(5), code, value)) {
+                if (code == "UIDVALIDITY")
+                    selection.sel_uidvalidity = (uint32_t) strtoul(value.c_str(), NULL, 10);
+                else if (code == "UIDNEXT")
+                    selection.sel_uidnext = (uint32_t) strtoul(value.c_str(), NULL, 10);
+                else if (code == "UNSEEN")
+                    selection.sel_first_unseen = (uint32_t) strtoul(value.c_str(), NULL, 10);
+            }
+            continue;
+        }
+
+        size_t space = line.find(' ');
+        if (space == string::npos)
+            continue;
+        map<string, string>::iterator it = statuses.find(line.substr(0, space));
+        if (it == statuses.end() || !it->second.empty())
+            continue;
+
+        size_t next = line.find(' ', space + 1);
+        it->second = toupper(line.substr(space + 1, next == string::npos ? string::npos : next - space - 1));
+        if (next != string::npos && it->first == loginTag)
+            loginText = line.substr(next + 1);
+        if (next != string::npos && it->first == selectTag)
+            selectText = line.substr(next + 1);
+        pending--;
+    }
+
+    if (r != ErrorNone) {
+        m_shouldDisconnect = true;
+        return r;
+    }
+
+    if (statuses[loginTag] != "OK") {
+        r = error_from_text(loginText.c_str(), ErrorAuthentication);
+        if (r == ErrorAuthentication && m_authType != AuthTypeLogin)
+            oauth2TokenRefused(token);
+        return r;
+    }
 
-        element = partIDArray.at(i);
-        value = (uint32_t *)malloc(sizeof(*value));
-        *value = (uint32_t)(atol(element.c_str()));
-        clist_append(sec_list, value);
+    m_status = SS_LOGGEDIN;
+    m_isLogined = true;
+    m_imap->imap_state = MAILIMAP_STATE_AUTHENTICATED;
+
+    // some servers only announce the capabilities after login in the OK of the login
+    string code;
+    string value;
+    if (!hasCapabilities && response_code(loginText, code, value) && code == "CAPABILITY") {
+        afterLogin = splictStr(value, " ");
+        hasCapabilities = true;
     }
 
-    section_part = mailimap_section_part_new(sec_list);
-    section = mailimap_section_new_part(section_part);
-    if (wholePart) {
-        fetch_att = mailimap_fetch_att_new_body_peek_section(section);
+    if (hasCapabilities) {
+        set_capabilities(m_imap, afterLogin);
+        capabilitiesChanged();
+        if (m_capabilityCache != NULL)
+            m_capabilityCache->setAfterLogin(m_server, m_port, afterLogin);
     }
     else {
-        fetch_att = mailimap_fetch_att_new_body_peek_section_partial(section, offset, length);
+        r = capability();
+        if (r != ErrorNone)
+            return r;
     }
-    fetch_type = mailimap_fetch_type_new_fetch_att(fetch_att);
 
-#ifdef LIBETPAN_HAS_MAILIMAP_RAMBLER_WORKAROUND
-    if (m_ramblerRuServer && (encoding == EncodingBase64 || encoding == EncodingUUEncode)) {
-        mailimap_set_rambler_workaround_enabled(m_imap, 1);
+    if (!enableTag.empty()) {
+        m_qresyncEnabled = capabilityCache::hasCapability(enabled, "QRESYNC");
+        m_condstoreEnabled = m_qresyncEnabled || capabilityCache::hasCapability(enabled, "CONDSTORE");
+    }
+    else if (selectTag.empty()) {
+        enableFeaturesIfNeeded();
+    }
+    else {
+        // the cache said ENABLE was not needed
+        m_qresyncEnabled = false;
+        m_condstoreEnabled = false;
     }
-#endif
 
-    r = fetch_imap(m_imap, isUid, uidOrNumber, fetch_type, &text, &text_length);
+    // a folder that cannot be selected is left to selectIfNeeded(), which reports why
+    if (!selectTag.empty() && statuses[selectTag] == "OK") {
+        struct mailimap_selection_info * info = mailimap_selection_info_new();
+
+        m_selectCount++;
+        m_reconnectFolder.clear();
+
+        if (info != NULL) {
+            info->sel_uidnext = selection.sel_uidnext;
+            info->sel_uidvalidity = selection.sel_uidvalidity;
+            info->sel_first_unseen = selection.sel_first_unseen;
+            info->sel_exists = selection.sel_exists;
+            info->sel_recent = selection.sel_recent;
+            info->sel_has_exists = selection.sel_has_exists;
+            info->sel_has_recent = selection.sel_has_recent;
+            if (m_imap->imap_selection_info != NULL)
+                mailimap_selection_info_free(m_imap->imap_selection_info);
+            m_imap->imap_selection_info = info;
+        }
+
+        m_imap->imap_state = MAILIMAP_STATE_SELECTED;
+        m_currentFolder = folder;
+        if (selection.sel_uidvalidity != 0)
+            m_uidValidities[folder] = selection.sel_uidvalidity;
+        // a server may open the folder read only even for SELECT
+        m_selectedReadOnly = m_readOnly || (response_code(selectText, code, value) && code == "READ-ONLY");
+        m_status = SS_SELECTED;
+    }
+
+    return compressIfNeeded();
+}
+
+/*
+RFC 7628. the token goes with the command when the server has SASL-IR,
+otherwise after the first continuation request. a refused token comes
+with a challenge holding the reason, answered with %x01 to get the
+tagged NO.
+*/
+
+int mailImap::oauthBearerAuthenticate(const string& token)
+{
+    imapCommandStream stream(m_imap);
+    string response = oauthbearer_response(m_userid, token);
+    bool responseSent = mailimap_has_extension(m_imap, (char *) "SASL-IR") != 0;
+    string tag = stream.nextTag();
+    string status;
+    string line;
+    int r;
+
+    r = stream.send(tag, responseSent ? "AUTHENTICATE OAUTHBEARER " + response : "AUTHENTICATE OAUTHBEARER");
+    if (r == ErrorNone)
+        r = stream.flush();
+
+    while (r == ErrorNone) {
+        r = stream.readLine(line);
+        if (r != ErrorNone)
+            break;
+
+        if (line.compare(0, 1, "+") == 0) {
+            r = stream.sendLine(responseSent ? "AQ==" : response);
+            if (r == ErrorNone)
+                r = stream.flush();
+            responseSent = true;
+            continue;
+        }
+        if (line.compare(0, tag.size() + 1, tag + " ") == 0)
+            break;
+    }
+
+    if (r != ErrorNone) {
+        m_shouldDisconnect = true;
+        return r;
+    }
+
+    status = toupper(line.substr(tag.size() + 1, 2));
+    if (status != "OK")
+        return error_from_text(line.c_str(), ErrorAuthentication);
+
+    m_imap->imap_state = MAILIMAP_STATE_AUTHENTICATED;
+    return ErrorNone;
+}
+
+static int fetch_rfc822(mailimap * session, bool identifier_is_uid,
+    uint32_t identifier, char ** result, size_t * result_len)
+{
+    struct mailimap_section * section;
+    struct mailimap_fetch_att * fetch_att;
+    struct mailimap_fetch_type * fetch_type;
+
+    section = mailimap_section_new(NULL);
+    fetch_att = mailimap_fetch_att_new_body_peek_section(section);
+    fetch_type = mailimap_fetch_type_new_fetch_att(fetch_att);
+    cout << "1 att_type:" << fetch_att->att_type << " att_size:" << fetch_att->att_size << endl;
+    int r = fetch_imap(session, identifier_is_uid, identifier,
+        fetch_type, result, result_len);
     mailimap_fetch_type_free(fetch_type);
+    cout << "2 att_type:" << fetch_att->att_type << " att_size:" << fetch_att->att_size << endl;
+    cout << "fetch_rfc822 errno:" << r << endl;
+    return r;
+}
 
-#ifdef LIBETPAN_HAS_MAILIMAP_RAMBLER_WORKAROUND
-    mailimap_set_rambler_workaround_enabled(m_imap, 0);
-#endif
+static int
+fetch_imap(mailimap * imap, bool identifier_is_uid, uint32_t identifier,
+    struct mailimap_fetch_type * fetch_type,
+    char ** result, size_t * result_len)
+{
+    int r;
+    struct mailimap_msg_att * msg_att;
+    struct mailimap_msg_att_item * msg_att_item;
+    clist * fetch_result;
+    struct mailimap_set * set;
+    char * text;
+    size_t text_length;
+    clistiter * cur;
+
+    set = mailimap_set_new_single(identifier);
+    if (identifier_is_uid) {
+        r = mailimap_uid_fetch(imap, set, fetch_type, &fetch_result);
+        cout << "mailimap_uid_fetch errno:" << r << " fetch_type:" << fetch_type->ft_type << endl;
+    }
+    else {
+        r = mailimap_fetch(imap, set, fetch_type, &fetch_result);
+    }
+
+    mailimap_set_free(set);
+
+    switch (r) {
+    case MAILIMAP_NO_ERROR:
+        break;
+    default:
+        return r;
+    }
+
+    if (clist_isempty(fetch_result)) {
+        mailimap_fetch_list_free(fetch_result);
+        return MAILIMAP_ERROR_FETCH;
+    }
+
+    msg_att = (struct mailimap_msg_att *) clist_begin(fetch_result)->data;
+
+    text = NULL;
+    text_length = 0;
+
+    for (cur = clist_begin(msg_att->att_list); cur != NULL;
+        cur = clist_next(cur)) {
+        msg_att_item = (struct mailimap_msg_att_item *) clist_content(cur);
+
+        if (msg_att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {
+            continue;
+        }
+
+        if (msg_att_item->att_data.att_static->att_type !=
+            MAILIMAP_MSG_ATT_BODY_SECTION) {
+            continue;
+        }
+
+        text = msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part;
+        msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part = NULL;
+        text_length = msg_att_item->att_data.att_static->att_data.att_body_section->sec_length;
+    }
+
+    mailimap_fetch_list_free(fetch_result);
+
+    if (text == NULL)
+        return MAILIMAP_ERROR_FETCH;
+
+    *result = text;
+    *result_len = text_length;
+
+    return MAILIMAP_NO_ERROR;
+}
+
+
+int mailImap::getfolderStatus(const string& folder, folderStatus* fs)
+{
+    int r = loginIfNeeded();
+    if (r)
+        return r;
+
+    struct mailimap_mailbox_data_status * status;
+
+    struct mailimap_status_att_list * status_att_list;
+
+    status_att_list = mailimap_status_att_list_new_empty();
+    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UNSEEN);
+    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_MESSAGES);
+    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_RECENT);
+    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDNEXT);
+    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDVALIDITY);
+    if (m_condstoreEnabled) {
+        mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_HIGHESTMODSEQ);
+    }
+
+    r = mailimap_status(m_imap, folder.c_str(), status_att_list, &status);
 
     if (r == MAILIMAP_ERROR_STREAM) {
-        //mShouldDisconnect = true;
+        m_shouldDisconnect = true;
         //*pError = ErrorConnection;
+        //MCLog("status error : %s %i", MCUTF8DESC(this), *pError);
+        mailimap_status_att_list_free(status_att_list);
         return ErrorConnection;
     }
     else if (r == MAILIMAP_ERROR_PARSE) {
-        //mShouldDisconnect = true;
+        m_shouldDisconnect = true;
         //*pError = ErrorParse;
+        mailimap_status_att_list_free(status_att_list);
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        //*pError = ErrorNonExistantFolder;
+        mailimap_status_att_list_free(status_att_list);
+        return ErrorNonExistantFolder;
+    }
+
+    clistiter * cur;
+
+    if (status != NULL) {
+
+        struct mailimap_status_info * status_info;
+        for (cur = clist_begin(status->st_info_list); cur != NULL;
+            cur = clist_next(cur)) {
+
+            status_info = (struct mailimap_status_info *) clist_content(cur);
+
+            switch (status_info->st_att) {
+            case MAILIMAP_STATUS_ATT_UNSEEN:
+                fs->setUnseenCount(status_info->st_value);
+                break;
+            case MAILIMAP_STATUS_ATT_MESSAGES:
+                fs->setMessageCount(status_info->st_value);
+                break;
+            case MAILIMAP_STATUS_ATT_RECENT:
+                fs->setRecentCount(status_info->st_value);
+                break;
+            case MAILIMAP_STATUS_ATT_UIDNEXT:
+                fs->setUidNext(status_info->st_value);
+                break;
+            case MAILIMAP_STATUS_ATT_UIDVALIDITY:
+                fs->setUidValidity(status_info->st_value);
+                break;
+            case MAILIMAP_STATUS_ATT_EXTENSION: {
+                struct mailimap_extension_data * ext_data = status_info->st_ext_data;
+                if (ext_data->ext_extension == &mailimap_extension_condstore) {
+                    struct mailimap_condstore_status_info * status_info = (struct mailimap_condstore_status_info *) ext_data->ext_data;
+                    fs->setHighestModSeqValue(status_info->cs_highestmodseq_value);
+                }
+                break;
+            }
+            }
+        }
+
+        mailimap_mailbox_data_status_free(status);
+    }
+
+    mailimap_status_att_list_free(status_att_list);
+
+    return ErrorNone;
+}
+
+int mailImap::syncMessageFlagsByUid(const string& folder, uint64_t modSeq,
+    vector<messageFlags>& changed, vector<uint32_t>& vanished)
+{
+    struct mailimap_fetch_type * fetch_type;
+    struct mailimap_qresync_vanished * qr_vanished = NULL;
+    struct mailimap_set * set;
+    clist * fetch_result = NULL;
+    clistiter * cur;
+
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    if (!m_condstoreEnabled)
+        return ErrorCapability;
+
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_flags());
+
+    set = mailimap_set_new_interval(1, 0);
+    if (m_qresyncEnabled) {
+        r = mailimap_uid_fetch_qresync(m_imap, set, fetch_type, modSeq, &fetch_result, &qr_vanished);
+    }
+    else {
+        r = mailimap_uid_fetch_changedsince(m_imap, set, fetch_type, modSeq, &fetch_result);
+    }
+    mailimap_set_free(set);
+    mailimap_fetch_type_free(fetch_type);
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
         return ErrorParse;
     }
     else if (hasError(r)) {
-        //*pError = ErrorFetch;
         return ErrorFetch;
     }
 
-    data = string(text, text_length);
+    for (cur = clist_begin(fetch_result); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_msg_att * msg_att = (struct mailimap_msg_att *) clist_content(cur);
+        messageFlags flags;
+        clistiter * item_cur;
+
+        for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+            struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
+
+            if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC) {
+                flags.setFlags(flags_from_lep_att_dynamic(att_item->att_data.att_dyn));
+            }
+            else if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_STATIC) {
+                if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
+                    flags.setUid(att_item->att_data.att_static->att_data.att_uid);
+            }
+            else if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_EXTENSION) {
+                struct mailimap_extension_data * ext_data = att_item->att_data.att_extension_data;
+                if (ext_data->ext_extension == &mailimap_extension_condstore) {
+                    struct mailimap_condstore_fetch_mod_resp * fetch_data = (struct mailimap_condstore_fetch_mod_resp *) ext_data->ext_data;
+                    flags.setModSeqValue(fetch_data->cs_modseq_value);
+                }
+            }
+        }
+
+        if (flags.uid() != 0)
+            changed.push_back(flags);
+    }
+    mailimap_fetch_list_free(fetch_result);
+
+    if (qr_vanished != NULL) {
+        if (qr_vanished->qr_known_uids != NULL) {
+            for (cur = clist_begin(qr_vanished->qr_known_uids->set_list); cur != NULL; cur = clist_next(cur)) {
+                struct mailimap_set_item * item = (struct mailimap_set_item *) clist_content(cur);
+
+                for (uint64_t uid = item->set_first; uid <= item->set_last; uid++)
+                    vanished.push_back((uint32_t)uid);
+            }
+        }
+        mailimap_qresync_vanished_free(qr_vanished);
+    }
 
     return ErrorNone;
 }
-vector<string> mailImap::splictStr(const string& str, const string& sep)
-{
-    vector<string> result;
-    string::size_type pos = 0, first_pos = 0;
 
-    while (1)
+static string tolower(const string& str)
+{
+    string result;
+    for (size_t i = 0; i < str.size(); i++)
     {
-        pos = str.find(sep, first_pos);
-        if (pos == string::npos)
+        char t = str.at(i);
+        if (t >= 'A' && t <= 'Z')
         {
-            result.push_back(str.substr(first_pos));
-            break;
+            result.push_back(t - 'A' + 'a');
         }
         else
         {
-            result.push_back(str.substr(first_pos, pos - first_pos));
-            first_pos = pos + 1;
+            result.push_back(t);
         }
     }
-    
+
     return result;
 }
 
-void mailImap::decodeData(string& data, Encoding encoding)
+static string body_param_value(struct mailimap_body_fld_param * params, const char * name)
 {
+    clistiter * cur;
+
+    if (params == NULL || params->pa_list == NULL)
+        return string();
 
+    for (cur = clist_begin(params->pa_list); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_single_body_fld_param * param = (struct mailimap_single_body_fld_param *) clist_content(cur);
+
+        if (param->pa_name != NULL && param->pa_value != NULL && toupper(param->pa_name) == toupper(name))
+            return param->pa_value;
+    }
+
+    return string();
 }
-int mailImap::selectIfNeeded(const string& folder)
+
+static void part_from_body_fields(struct mailimap_body_fields * fields, imapPart& part)
 {
-    int r = loginIfNeeded();
-    if (r)
-        return r;
+    if (fields == NULL)
+        return;
+
+    if (fields->bd_encoding != NULL)
+        part.setEncoding((Encoding) fields->bd_encoding->enc_type);
+    part.setSize(fields->bd_size);
+    if (fields->bd_id != NULL)
+        part.setContentId(fields->bd_id);
+    part.setCharset(tolower(body_param_value(fields->bd_parameter, "charset")));
+    // Content-Type name, superseded by the Content-Disposition filename when there is one
+    part.setFilename(body_param_value(fields->bd_parameter, "name"));
+}
 
-    if (m_status == SS_SELECTED)
-    {
-        if (m_currentFolder != folder)
-            r = selectFolder(folder);
-    }
-    else if(m_status == SS_LOGGEDIN)
-    {
-        r = selectFolder(folder);
-    }
-    else
-    {
-        r = 0;
+static void part_from_ext_1part(struct mailimap_body_ext_1part * ext, imapPart& part)
+{
+    string filename;
+
+    if (ext == NULL || ext->bd_disposition == NULL)
+        return;
+
+    if (ext->bd_disposition->dsp_type != NULL && toupper(ext->bd_disposition->dsp_type) == "ATTACHMENT")
+        part.setAttachment(true);
+    filename = body_param_value(ext->bd_disposition->dsp_attributes, "filename");
+    if (!filename.empty())
+        part.setFilename(filename);
+}
+
+static const char * media_basic_type(struct mailimap_media_basic * media)
+{
+    switch (media->med_type) {
+    case MAILIMAP_MEDIA_BASIC_APPLICATION:
+        return "application";
+    case MAILIMAP_MEDIA_BASIC_AUDIO:
+        return "audio";
+    case MAILIMAP_MEDIA_BASIC_IMAGE:
+        return "image";
+    case MAILIMAP_MEDIA_BASIC_MESSAGE:
+        return "message";
+    case MAILIMAP_MEDIA_BASIC_VIDEO:
+        return "video";
+    default:
+        return media->med_basic_type != NULL ? media->med_basic_type : "application";
     }
-    
-    return r;
 }
 
-int mailImap::selectFolder(const string& folder)
+static string child_part_id(const string& parentId, size_t index)
 {
-    assert(m_status == SS_SELECTED || m_status == SS_LOGGEDIN);
+    char number[16];
 
-    int r = mailimap_select(m_imap, folder.c_str());
-    if (r == MAILIMAP_ERROR_STREAM)
-    {
-        return ErrorConnection;
-    }
-    else if (r == MAILIMAP_ERROR_PARSE)
-    {
-        return ErrorParse;
-    }
-    else if (hasError(r))
-    {
-        return ErrorNonExistantFolder;
+    sprintf_s(number, sizeof(number), "%u", (unsigned int) index);
+    if (parentId.empty())
+        return number;
+    return parentId + "." + number;
+}
+
+static void part_from_message_body(struct mailimap_body * body, const string& messageId, imapPart& part);
+
+/*
+part numbering follows RFC 3501 6.4.5: the children of a multipart are
+numbered from 1 under the id of the multipart. a multipart has the id
+of the message it is the body of, a single part body is part 1 of its
+message.
+*/
+
+static void part_from_body(struct mailimap_body * body, const string& partId, imapPart& part)
+{
+    part.setPartId(partId);
+
+    if (body->bd_type == MAILIMAP_BODY_MPART) {
+        struct mailimap_body_type_mpart * mpart = body->bd_data.bd_body_mpart;
+        clistiter * cur;
+        size_t index = 1;
+
+        part.setType(PartTypeMultipart);
+        part.setMimeType("multipart/" + tolower(mpart->bd_media_subtype != NULL ? mpart->bd_media_subtype : "mixed"));
+        for (cur = clist_begin(mpart->bd_list); cur != NULL; cur = clist_next(cur), index++) {
+            imapPart child;
+
+            part_from_body((struct mailimap_body *) clist_content(cur), child_part_id(partId, index), child);
+            part.parts().push_back(child);
+        }
+        return;
     }
 
-    m_currentFolder = folder;
+    struct mailimap_body_type_1part * single = body->bd_data.bd_body_1part;
 
-    m_status = SS_SELECTED;
-    return ErrorNone;
+    switch (single->bd_type) {
+    case MAILIMAP_BODY_TYPE_1PART_BASIC:
+        part.setMimeType(tolower(media_basic_type(single->bd_data.bd_type_basic->bd_media_basic)) + "/" +
+            tolower(single->bd_data.bd_type_basic->bd_media_basic->med_subtype));
+        part_from_body_fields(single->bd_data.bd_type_basic->bd_fields, part);
+        break;
+    case MAILIMAP_BODY_TYPE_1PART_TEXT:
+        part.setMimeType("text/" + tolower(single->bd_data.bd_type_text->bd_media_text));
+        part_from_body_fields(single->bd_data.bd_type_text->bd_fields, part);
+        break;
+    case MAILIMAP_BODY_TYPE_1PART_MSG:
+        part.setType(PartTypeMessage);
+        part.setMimeType("message/rfc822");
+        part_from_body_fields(single->bd_data.bd_type_msg->bd_fields, part);
+        if (single->bd_data.bd_type_msg->bd_body != NULL) {
+            imapPart child;
+
+            part_from_message_body(single->bd_data.bd_type_msg->bd_body, partId, child);
+            part.parts().push_back(child);
+        }
+        break;
+    }
+    part_from_ext_1part(single->bd_ext_1part, part);
 }
 
-static bool hasError(int errorCode)
+static void part_from_message_body(struct mailimap_body * body, const string& messageId, imapPart& part)
 {
-    return ((errorCode != MAILIMAP_NO_ERROR) && (errorCode != MAILIMAP_NO_ERROR_AUTHENTICATED) &&
-        (errorCode != MAILIMAP_NO_ERROR_NON_AUTHENTICATED));
+    if (body->bd_type == MAILIMAP_BODY_MPART)
+        part_from_body(body, messageId, part);
+    else
+        part_from_body(body, child_part_id(messageId, 1), part);
 }
-int mailImap::loginIfNeeded()
-{
-    int r = connectIfNeeded();
-    if (r)
-        return r;
 
-    if(m_status == SS_CONNECTED)
-        r = login();
+static void collect_text_parts(const imapPart& part, bool includeHtml, vector<imapPart>& result)
+{
+    if (part.type() == PartTypeSingle) {
+        if (!part.isAttachment() &&
+            (part.mimeType() == "text/plain" || (includeHtml && part.mimeType() == "text/html")))
+            result.push_back(part);
+        return;
+    }
 
-    return r;
+    for (size_t i = 0; i < part.parts().size(); i++)
+        collect_text_parts(part.parts().at(i), includeHtml, result);
 }
-int mailImap::connectIfNeeded()
+
+static struct mailimap_section * section_from_part_id(const string& partId)
 {
-    int r = 0;
-    if (m_status == SS_DISCONNECTED)
-        r = connect();
+    clist * sec_list;
+    const char * p = partId.c_str();
 
-    return r;
+    sec_list = clist_new();
+    while (*p != '\0') {
+        uint32_t * value;
+        char * end;
+
+        value = (uint32_t *)malloc(sizeof(*value));
+        *value = (uint32_t) strtoul(p, &end, 10);
+        clist_append(sec_list, value);
+        p = (*end == '.') ? end + 1 : end;
+        if (end == p && *p != '\0')
+            break;
+    }
+
+    return mailimap_section_new_part(mailimap_section_part_new(sec_list));
 }
 
+static string part_id_from_section(struct mailimap_section * section)
+{
+    string partId;
+    clistiter * cur;
+
+    if (section == NULL || section->sec_spec == NULL ||
+        section->sec_spec->sec_type != MAILIMAP_SECTION_SPEC_SECTION_PART)
+        return partId;
 
-static int fetch_rfc822(mailimap * session, bool identifier_is_uid,
-    uint32_t identifier, char ** result, size_t * result_len)
+    for (cur = clist_begin(section->sec_spec->sec_data.sec_part->sec_id); cur != NULL; cur = clist_next(cur)) {
+        char number[16];
+
+        sprintf_s(number, sizeof(number), "%u", *(uint32_t *) clist_content(cur));
+        if (!partId.empty())
+            partId.push_back('.');
+        partId.append(number);
+    }
+
+    return partId;
+}
+
+int mailImap::getBodyStructure(const string& folder, uint32_t uid, imapPart& root)
 {
-    struct mailimap_section * section;
-    struct mailimap_fetch_att * fetch_att;
     struct mailimap_fetch_type * fetch_type;
+    struct mailimap_set * set;
+    clist * fetch_result = NULL;
+    clistiter * cur;
+    bool found = false;
 
-    section = mailimap_section_new(NULL);
-    fetch_att = mailimap_fetch_att_new_body_peek_section(section);
-    fetch_type = mailimap_fetch_type_new_fetch_att(fetch_att);
-    cout << "1 att_type:" << fetch_att->att_type << " att_size:" << fetch_att->att_size << endl;
-    int r = fetch_imap(session, identifier_is_uid, identifier,
-        fetch_type, result, result_len);
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_bodystructure());
+
+    set = mailimap_set_new_single(uid);
+    r = mailimap_uid_fetch(m_imap, set, fetch_type, &fetch_result);
+    mailimap_set_free(set);
     mailimap_fetch_type_free(fetch_type);
-    cout << "2 att_type:" << fetch_att->att_type << " att_size:" << fetch_att->att_size << endl;
-    cout << "fetch_rfc822 errno:" << r << endl;
-    return r;
+
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorFetch;
+    }
+
+    for (cur = clist_begin(fetch_result); cur != NULL && !found; cur = clist_next(cur)) {
+        struct mailimap_msg_att * msg_att = (struct mailimap_msg_att *) clist_content(cur);
+        struct mailimap_body * body = NULL;
+        uint32_t att_uid = 0;
+        clistiter * item_cur;
+
+        for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+            struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
+
+            if (att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC)
+                continue;
+            if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
+                att_uid = att_item->att_data.att_static->att_data.att_uid;
+            else if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODYSTRUCTURE)
+                body = att_item->att_data.att_static->att_data.att_bodystructure;
+        }
+
+        // unsolicited FETCH responses for other messages may be mixed in
+        if (att_uid == uid && body != NULL) {
+            root = imapPart();
+            part_from_message_body(body, "", root);
+            found = true;
+        }
+    }
+    mailimap_fetch_list_free(fetch_result);
+
+    if (!found)
+        return ErrorFetch;
+
+    return ErrorNone;
 }
 
-static int
-fetch_imap(mailimap * imap, bool identifier_is_uid, uint32_t identifier,
-    struct mailimap_fetch_type * fetch_type,
-    char ** result, size_t * result_len)
+int mailImap::getTextParts(const string& folder, uint32_t uid, vector<imapPart>& parts, vector<string>& texts,
+    bool includeHtml, uint32_t maxLength)
 {
-    int r;
-    struct mailimap_msg_att * msg_att;
-    struct mailimap_msg_att_item * msg_att_item;
-    clist * fetch_result;
+    imapPart root;
+
+    int r = getBodyStructure(folder, uid, root);
+    if (r)
+        return r;
+
+    return getTextParts(folder, uid, root, parts, texts, includeHtml, maxLength);
+}
+
+int mailImap::getTextParts(const string& folder, uint32_t uid, const imapPart& root, vector<imapPart>& parts,
+    vector<string>& texts, bool includeHtml, uint32_t maxLength)
+{
+    struct mailimap_fetch_type * fetch_type;
     struct mailimap_set * set;
-    char * text;
-    size_t text_length;
+    clist * fetch_result = NULL;
     clistiter * cur;
+    vector<imapPart> textParts;
 
-    set = mailimap_set_new_single(identifier);
-    if (identifier_is_uid) {
-        r = mailimap_uid_fetch(imap, set, fetch_type, &fetch_result);
-        cout << "mailimap_uid_fetch errno:" << r << " fetch_type:" << fetch_type->ft_type << endl;
+    collect_text_parts(root, includeHtml, textParts);
+    if (textParts.empty()) {
+        parts.clear();
+        texts.clear();
+        return ErrorNone;
     }
-    else {
-        r = mailimap_fetch(imap, set, fetch_type, &fetch_result);
+
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
+
+    // one command for all the text parts, attachments are never requested
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    for (size_t i = 0; i < textParts.size(); i++) {
+        struct mailimap_section * section = section_from_part_id(textParts.at(i).partId());
+        struct mailimap_fetch_att * fetch_att;
+
+        if (maxLength > 0)
+            fetch_att = mailimap_fetch_att_new_body_peek_section_partial(section, 0, maxLength);
+        else
+            fetch_att = mailimap_fetch_att_new_body_peek_section(section);
+        mailimap_fetch_type_new_fetch_att_list_add(fetch_type, fetch_att);
     }
 
+    set = mailimap_set_new_single(uid);
+    r = mailimap_uid_fetch(m_imap, set, fetch_type, &fetch_result);
     mailimap_set_free(set);
+    mailimap_fetch_type_free(fetch_type);
 
-    switch (r) {
-    case MAILIMAP_NO_ERROR:
-        break;
-    default:
-        return r;
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
     }
-
-    if (clist_isempty(fetch_result)) {
-        mailimap_fetch_list_free(fetch_result);
-        return MAILIMAP_ERROR_FETCH;
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorFetch;
     }
 
-    msg_att = (struct mailimap_msg_att *) clist_begin(fetch_result)->data;
+    parts = textParts;
+    texts.assign(textParts.size(), string());
 
-    text = NULL;
-    text_length = 0;
+    for (cur = clist_begin(fetch_result); cur != NULL; cur = clist_next(cur)) {
+        struct mailimap_msg_att * msg_att = (struct mailimap_msg_att *) clist_content(cur);
+        uint32_t att_uid = 0;
+        clistiter * item_cur;
 
-    for (cur = clist_begin(msg_att->att_list); cur != NULL;
-        cur = clist_next(cur)) {
-        msg_att_item = (struct mailimap_msg_att_item *) clist_content(cur);
+        for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+            struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
 
-        if (msg_att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {
+            if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_STATIC &&
+                att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
+                att_uid = att_item->att_data.att_static->att_data.att_uid;
+        }
+        if (att_uid != uid)
             continue;
+
+        for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+            struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
+            struct mailimap_msg_att_body_section * body_section;
+            string partId;
+
+            if (att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC ||
+                att_item->att_data.att_static->att_type != MAILIMAP_MSG_ATT_BODY_SECTION)
+                continue;
+
+            body_section = att_item->att_data.att_static->att_data.att_body_section;
+            if (body_section->sec_body_part == NULL)
+                continue;
+
+            partId = part_id_from_section(body_section->sec_section);
+            for (size_t i = 0; i < parts.size(); i++) {
+                if (parts.at(i).partId() != partId)
+                    continue;
+
+                Encoding encoding = parts.at(i).encoding();
+                size_t length = body_section->sec_length;
+
+                // a truncated part ends where it can still be decoded
+                if (maxLength > 0 && length >= maxLength)
+                    length = decodable_length(body_section->sec_body_part, length, encoding);
+                length = decode_buffer(body_section->sec_body_part, length, encoding);
+                texts.at(i).assign(body_section->sec_body_part, length);
+                break;
+            }
         }
+    }
+    mailimap_fetch_list_free(fetch_result);
 
-        if (msg_att_item->att_data.att_static->att_type !=
-            MAILIMAP_MSG_ATT_BODY_SECTION) {
+    return ErrorNone;
+}
+
+bool mailImap::isIdleEnabled() const
+{
+    return m_idleEnabled;
+}
+
+/*
+returns 1 when fd is readable, 0 on timeout, -1 on error.
+poll() has no FD_SETSIZE limit on the descriptor, which select() has.
+*/
+
+static int wait_readable(int fd, time_t seconds)
+{
+    time_t deadline = time(NULL) + seconds;
+#ifdef WIN32
+    WSAPOLLFD pfd;
+#else
+    struct pollfd pfd;
+#endif
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    while (1) {
+        time_t left = deadline - time(NULL);
+        int r;
+
+        if (left < 0)
+            left = 0;
+#ifdef WIN32
+        r = WSAPoll(&pfd, 1, (INT) (left * 1000));
+#else
+        r = poll(&pfd, 1, (int) (left * 1000));
+        // a signal interrupted the wait, wait for the rest of the delay
+        if (r < 0 && errno == EINTR)
             continue;
+#endif
+        return r > 0 ? 1 : r;
+    }
+}
+
+int mailImap::idle(const string& folder, idleCallback callback, time_t timeout)
+{
+    time_t deadline = (timeout > 0) ? time(NULL) + timeout : 0;
+
+    while (1) {
+        time_t delay = IDLE_RENEW_DELAY;
+        int r;
+
+        if (deadline != 0) {
+            time_t now = time(NULL);
+            if (now >= deadline)
+                return ErrorNone;
+            if (deadline - now < delay)
+                delay = deadline - now;
+        }
+
+        r = startIdle(folder);
+        if (r)
+            return r;
+
+        // responses already buffered would never wake the socket up
+        if (!hasIdleData()) {
+            if (wait_readable(idleFd(), delay) < 0) {
+                finishIdle(callback);
+                return ErrorIdle;
+            }
         }
 
-        text = msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part;
-        msg_att_item->att_data.att_static->att_data.att_body_section->sec_body_part = NULL;
-        text_length = msg_att_item->att_data.att_static->att_data.att_body_section->sec_length;
+        r = finishIdle(callback);
+        if (r)
+            return r;
     }
+}
 
-    mailimap_fetch_list_free(fetch_result);
+int mailImap::startIdle(const string& folder)
+{
+    int r = selectIfNeeded(folder);
+    if (r)
+        return r;
 
-    if (text == NULL)
-        return MAILIMAP_ERROR_FETCH;
+    if (!m_idleEnabled)
+        return ErrorIdle;
 
-    *result = text;
-    *result_len = text_length;
+    m_imap->imap_selection_info->sel_has_exists = 0;
+    m_imap->imap_selection_info->sel_has_recent = 0;
 
-    return MAILIMAP_NO_ERROR;
-}
+    r = mailimap_idle(m_imap);
+    if (r == MAILIMAP_ERROR_STREAM) {
+        m_shouldDisconnect = true;
+        return ErrorConnection;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        m_shouldDisconnect = true;
+        return ErrorParse;
+    }
+    else if (hasError(r)) {
+        return ErrorIdle;
+    }
 
+    m_idling = true;
+    return ErrorNone;
+}
 
-int mailImap::getfolderStatus(const string& folder, folderStatus* fs)
+int mailImap::idleFd()
 {
-    assert(m_status == STATE_LOGGEDIN || m_status == STATE_SELECTED);
-
-    int r;
-
-    struct mailimap_mailbox_data_status * status;
+    return mailimap_idle_get_fd(m_imap);
+}
 
-    struct mailimap_status_att_list * status_att_list;
+bool mailImap::hasIdleData() const
+{
+    return m_idling && m_imap->imap_stream != NULL && m_imap->imap_stream->read_buffer_len > 0;
+}
 
-    status_att_list = mailimap_status_att_list_new_empty();
-    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UNSEEN);
-    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_MESSAGES);
-    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_RECENT);
-    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDNEXT);
-    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDVALIDITY);
-    //if (mCondstoreEnabled || mXYMHighestModseqEnabled) {
-    //    mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_HIGHESTMODSEQ);
-    //}
+int mailImap::finishIdle(idleCallback& callback)
+{
+    clistiter * cur;
 
-    r = mailimap_status(m_imap, folder.c_str(), status_att_list, &status);
+    if (!m_idling)
+        return ErrorNone;
+    m_idling = false;
 
+    int r = mailimap_idle_done(m_imap);
     if (r == MAILIMAP_ERROR_STREAM) {
-        //mShouldDisconnect = true;
-        //*pError = ErrorConnection;
-        //MCLog("status error : %s %i", MCUTF8DESC(this), *pError);
-        mailimap_status_att_list_free(status_att_list);
+        m_shouldDisconnect = true;
         return ErrorConnection;
     }
     else if (r == MAILIMAP_ERROR_PARSE) {
-        //mShouldDisconnect = true;
-        //*pError = ErrorParse;
-        mailimap_status_att_list_free(status_att_list);
+        m_shouldDisconnect = true;
         return ErrorParse;
     }
     else if (hasError(r)) {
-        //*pError = ErrorNonExistantFolder;
-        mailimap_status_att_list_free(status_att_list);
-        return ErrorNonExistantFolder;
+        return ErrorIdle;
     }
 
-    clistiter * cur;
-
-    if (status != NULL) {
-
-        struct mailimap_status_info * status_info;
-        for (cur = clist_begin(status->st_info_list); cur != NULL;
-            cur = clist_next(cur)) {
+    // untagged responses received during IDLE are parsed by mailimap_idle_done
+    if (m_imap->imap_response_info != NULL) {
+        for (cur = clist_begin(m_imap->imap_response_info->rsp_expunged); cur != NULL; cur = clist_next(cur)) {
+            uint32_t * seq = (uint32_t *) clist_content(cur);
 
-            status_info = (struct mailimap_status_info *) clist_content(cur);
+            r = callback(IdleEventExpunge, *seq, MessageFlagNone);
+            if (r)
+                return r;
+        }
 
-            switch (status_info->st_att) {
-            case MAILIMAP_STATUS_ATT_UNSEEN:
-                fs->setUnseenCount(status_info->st_value);
-                break;
-            case MAILIMAP_STATUS_ATT_MESSAGES:
-                fs->setMessageCount(status_info->st_value);
-                break;
-            case MAILIMAP_STATUS_ATT_RECENT:
-                fs->setRecentCount(status_info->st_value);
-                break;
-            case MAILIMAP_STATUS_ATT_UIDNEXT:
-                fs->setUidNext(status_info->st_value);
-                break;
-            case MAILIMAP_STATUS_ATT_UIDVALIDITY:
-                fs->setUidValidity(status_info->st_value);
-                break;
-            case MAILIMAP_STATUS_ATT_EXTENSION: {
-                struct mailimap_extension_data * ext_data = status_info->st_ext_data;
-                if (ext_data->ext_extension == &mailimap_extension_condstore) {
-                    struct mailimap_condstore_status_info * status_info = (struct mailimap_condstore_status_info *) ext_data->ext_data;
-                    fs->setHighestModSeqValue(status_info->cs_highestmodseq_value);
+        // with QRESYNC enabled the server sends VANISHED instead of EXPUNGE
+        for (cur = clist_begin(m_imap->imap_response_info->rsp_extension_list); cur != NULL; cur = clist_next(cur)) {
+            struct mailimap_extension_data * ext_data = (struct mailimap_extension_data *) clist_content(cur);
+            struct mailimap_qresync_vanished * qr_vanished;
+            clistiter * set_cur;
+
+            if (ext_data->ext_extension != &mailimap_extension_qresync || ext_data->ext_type != MAILIMAP_QRESYNC_TYPE_VANISHED)
+                continue;
+            qr_vanished = (struct mailimap_qresync_vanished *) ext_data->ext_data;
+            if (qr_vanished->qr_known_uids == NULL)
+                continue;
+
+            for (set_cur = clist_begin(qr_vanished->qr_known_uids->set_list); set_cur != NULL; set_cur = clist_next(set_cur)) {
+                struct mailimap_set_item * item = (struct mailimap_set_item *) clist_content(set_cur);
+
+                for (uint64_t uid = item->set_first; uid <= item->set_last; uid++) {
+                    r = callback(IdleEventExpunge, (uint32_t)uid, MessageFlagNone);
+                    if (r)
+                        return r;
                 }
-                break;
-            }
             }
         }
 
-        mailimap_mailbox_data_status_free(status);
+        for (cur = clist_begin(m_imap->imap_response_info->rsp_fetch_list); cur != NULL; cur = clist_next(cur)) {
+            struct mailimap_msg_att * msg_att = (struct mailimap_msg_att *) clist_content(cur);
+            MessageFlag flags = MessageFlagNone;
+            clistiter * item_cur;
+
+            for (item_cur = clist_begin(msg_att->att_list); item_cur != NULL; item_cur = clist_next(item_cur)) {
+                struct mailimap_msg_att_item * att_item = (struct mailimap_msg_att_item *) clist_content(item_cur);
+
+                if (att_item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC)
+                    flags = flags_from_lep_att_dynamic(att_item->att_data.att_dyn);
+            }
+
+            r = callback(IdleEventFetch, msg_att->att_number, flags);
+            if (r)
+                return r;
+        }
     }
 
-    mailimap_status_att_list_free(status_att_list);
+    if (m_imap->imap_selection_info != NULL && m_imap->imap_selection_info->sel_has_exists) {
+        r = callback(IdleEventExists, m_imap->imap_selection_info->sel_exists, MessageFlagNone);
+        if (r)
+            return r;
+    }
 
     return ErrorNone;
 }
@@ -643,8 +2957,8 @@ int mailImap::fetchDelimiterIfNeeded(char defaultDelimiter, char& result)
 
     r = mailimap_list(m_imap, "", "", &imap_folders);
     r = resultsWithError(r, imap_folders, folders);
-    //if (*pError == ErrorConnection || *pError == ErrorParse)
-        //mShouldDisconnect = true;
+    if (r == ErrorConnection || r == ErrorParse)
+        m_shouldDisconnect = true;
     if (r != ErrorNone)
         return r;
 
@@ -661,7 +2975,7 @@ int mailImap::fetchDelimiterIfNeeded(char defaultDelimiter, char& result)
     r = ErrorNone;
     return r;
 }
-int mailImap::fetchAllFolders(vector<string>& allFolders)
+int mailImap::fetchAllFolders(vector<imapFolder>& allFolders)
 {
     int r;
     clist * imap_folders;
@@ -681,60 +2995,348 @@ int mailImap::fetchAllFolders(vector<string>& allFolders)
         m_delimiter = delimiter;
     }
 
-    //String * prefix = NULL;
-    //if (defaultNamespace()) {
-    //    prefix = defaultNamespace()->mainPrefix();
-    //}
-    //if (prefix == NULL) {
-    //    prefix = MCSTR("");
-    //}
-    //if (prefix->length() > 0) {
-    //    if (!prefix->hasSuffix(String::stringWithUTF8Format("%c", mDelimiter))) {
-    //        prefix = prefix->stringByAppendingUTF8Format("%c", mDelimiter);
-    //    }
-    //}
+    string prefix = "";
+    //prefix = defaultNamespace()->mainPrefix();
 
-    //if (mXListEnabled) {
-    //    r = mailimap_xlist(mImap, MCUTF8(prefix), "*", &imap_folders);
-    //}
-    //else {
-    //    r = mailimap_list(mImap, MCUTF8(prefix), "*", &imap_folders);
-    //}
-    //Array * result = resultsWithError(r, imap_folders, pError);
-    //if (*pError == ErrorConnection || *pError == ErrorParse)
-    //    mShouldDisconnect = true;
-
-    //if (result != NULL) {
-    //    bool hasInbox = false;
-    //    mc_foreacharray(IMAPFolder, folder, result) {
-    //        if (folder->path()->isEqual(MCSTR("INBOX"))) {
-    //            hasInbox = true;
-    //        }
-    //    }
+    if (m_xlistEnabled) {
+        r = mailimap_xlist(m_imap, prefix.c_str(), "*", &imap_folders);
+    }
+    else {
+        r = mailimap_list(m_imap, prefix.c_str(), "*", &imap_folders);
+    }
+    r = resultsWithError(r, imap_folders, allFolders);
+    if (r == ErrorConnection || r == ErrorParse)
+        m_shouldDisconnect = true;
+    if (r != ErrorNone)
+        return r;
 
-    //    if (!hasInbox) {
-    //        mc_foreacharray(IMAPFolder, folder, result) {
-    //            if (folder->flags() & IMAPFolderFlagInbox) {
-    //                // some mail providers use non-standart name for inbox folder
-    //                hasInbox = true;
-    //                folder->setPath(MCSTR("INBOX"));
-    //                break;
-    //            }
-    //        }
-
-    //        if (!hasInbox) {
-    //            r = mailimap_list(mImap, "", "INBOX", &imap_folders);
-    //            Array * inboxResult = resultsWithError(r, imap_folders, pError);
-    //            if (*pError == ErrorConnection || *pError == ErrorParse)
-    //                mShouldDisconnect = true;
-    //            result->addObjectsFromArray(inboxResult);
-    //            hasInbox = true;
-    //        }
-    //    }
-    //}
+    return addInboxIfNeeded(allFolders);
+}
 
-    return result;
+int mailImap::addInboxIfNeeded(vector<imapFolder>& folders)
+{
+    int r;
+    clist * imap_folders;
+
+    for (size_t i = 0; i < folders.size(); i++) {
+        if (folders.at(i).path() == "INBOX")
+            return ErrorNone;
+    }
+
+    for (size_t i = 0; i < folders.size(); i++) {
+        if (folders.at(i).flags() & IMAPFolderFlagInbox) {
+            // some mail providers use non-standart name for inbox folder
+            folders.at(i).setPath("INBOX");
+            return ErrorNone;
+        }
+    }
+
+    r = mailimap_list(m_imap, "", "INBOX", &imap_folders);
+    r = resultsWithError(r, imap_folders, folders);
+    if (r == ErrorConnection || r == ErrorParse)
+        m_shouldDisconnect = true;
+
+    return r;
+}
+
+bool mailImap::isListStatusEnabled() const
+{
+    return m_listStatusEnabled;
+}
+
+int mailImap::fetchAllFoldersStatus(vector<imapFolder>& allFolders, vector<folderStatus>& statuses)
+{
+    int r = loginIfNeeded();
+    if (r != ErrorNone)
+        return r;
+
+    if (m_listStatusEnabled)
+        return listStatus(allFolders, statuses);
+
+    r = fetchAllFolders(allFolders);
+    if (r != ErrorNone)
+        return r;
+
+    vector<string> paths;
+    vector<size_t> indexes;
+    vector<folderStatus> selectable;
+
+    for (size_t i = 0; i < allFolders.size(); i++) {
+        if (allFolders.at(i).flags() & IMAPFolderFlagNoSelect)
+            continue;
+        paths.push_back(allFolders.at(i).path());
+        indexes.push_back(i);
+    }
+
+    r = getFoldersStatus(paths, selectable);
+    if (r != ErrorNone)
+        return r;
+
+    statuses.assign(allFolders.size(), folderStatus());
+    for (size_t i = 0; i < indexes.size(); i++)
+        statuses.at(indexes.at(i)) = selectable.at(i);
+
+    return ErrorNone;
+}
+
+static int folder_flags_from_tokens(const imapToken& list)
+{
+    int flags = 0;
+
+    for (size_t i = 0; i < list.items.size(); i++) {
+        string name = list.items.at(i).value;
+
+        if (name.size() > 0 && name.at(0) == '\\')
+            name = name.substr(1);
+        name = toupper(name);
+
+        if (name == "MARKED") {
+            flags |= IMAPFolderFlagMarked;
+        }
+        else if (name == "UNMARKED") {
+            flags |= IMAPFolderFlagUnmarked;
+        }
+        else if (name == "NOSELECT" || name == "NONEXISTENT") {
+            flags |= IMAPFolderFlagNoSelect;
+        }
+        else if (name == "NOINFERIORS") {
+            flags |= IMAPFolderFlagNoInferiors;
+        }
+        else {
+            for (unsigned int k = 0; k < sizeof(mb_keyword_flag) / sizeof(mb_keyword_flag[0]); k++) {
+                if (toupper(mb_keyword_flag[k].name) == name) {
+                    flags |= mb_keyword_flag[k].flag;
+                }
+            }
+        }
+    }
+
+    return flags;
+}
+
+static void status_from_tokens(const imapToken& list, folderStatus& fs)
+{
+    for (size_t i = 0; i + 1 < list.items.size(); i += 2) {
+        string name = toupper(list.items.at(i).value);
+        const string& value = list.items.at(i + 1).value;
+
+        if (name == "MESSAGES") {
+            fs.setMessageCount((uint32_t) strtoul(value.c_str(), NULL, 10));
+        }
+        else if (name == "RECENT") {
+            fs.setRecentCount((uint32_t) strtoul(value.c_str(), NULL, 10));
+        }
+        else if (name == "UNSEEN") {
+            fs.setUnseenCount((uint32_t) strtoul(value.c_str(), NULL, 10));
+        }
+        else if (name == "UIDNEXT") {
+            fs.setUidNext((uint32_t) strtoul(value.c_str(), NULL, 10));
+        }
+        else if (name == "UIDVALIDITY") {
+            fs.setUidValidity((uint32_t) strtoul(value.c_str(), NULL, 10));
+        }
+        else if (name == "HIGHESTMODSEQ") {
+            fs.setHighestModSeqValue(strtoull(value.c_str(), NULL, 10));
+        }
+    }
+}
+
+static string folder_path(const string& name)
+{
+    if (toupper(name) == "INBOX")
+        return "INBOX";
+    return name;
+}
+
+/*
+RFC 5819: LIST "" "*" RETURN (STATUS (...)) answers with the LIST of every
+folder, each followed by its STATUS. libetpan keeps only the last STATUS
+of a command, the command goes through imapCommandStream.
+*/
+
+int mailImap::listStatus(vector<imapFolder>& folders, vector<folderStatus>& statuses)
+{
+    vector<string> untagged;
+    map<string, size_t> indexes;
+    string command;
+    string status;
+    string text;
+    string tag;
+
+    // the capabilities are only known once logged in, and a reconnection replaces m_imap
+    int r = loginIfNeeded();
+    if (r)
+        return r;
+
+    command = "LIST \"\" \"*\" RETURN (";
+    if (m_specialUseEnabled)
+        command += "SPECIAL-USE ";
+    command += "STATUS (MESSAGES RECENT UNSEEN UIDNEXT UIDVALIDITY";
+    if (m_condstoreEnabled)
+        command += " HIGHESTMODSEQ";
+    command += "))";
+
+    imapCommandStream stream(m_imap);
+    tag = stream.nextTag();
+    r = stream.send(tag, command);
+    if (r == ErrorNone)
+        r = stream.flush();
+    if (r == ErrorNone)
+        r = stream.readResponse(tag, untagged, status, text);
+    if (r != ErrorNone) {
+        m_shouldDisconnect = true;
+        return r;
+    }
+    if (toupper(status) != "OK")
+        return ErrorNonExistantFolder;
+
+    size_t first = folders.size();
+    for (size_t i = 0; i < untagged.size(); i++) {
+        vector<imapToken> tokens;
+
+        if (!imapCommandStream::parseLine(untagged.at(i), tokens) || tokens.size() < 4)
+            continue;
+
+        string kind = toupper(tokens.at(1).value);
+        if (kind == "LIST" && tokens.size() >= 5 && tokens.at(2).type == imapToken::List) {
+            imapFolder folder;
+
+            folder.setPath(folder_path(tokens.at(4).value));
+            if (tokens.at(3).type != imapToken::Nil && !tokens.at(3).value.empty())
+                folder.setDelimiter(tokens.at(3).value.at(0));
+            folder.setFlags((IMAPFolderFlag) folder_flags_from_tokens(tokens.at(2)));
+            indexes[folder.path()] = folders.size();
+            folders.push_back(folder);
+        }
+        else if (kind == "STATUS" && tokens.at(3).type == imapToken::List) {
+            // STATUS always follows the LIST of its folder
+            map<string, size_t>::iterator it = indexes.find(folder_path(tokens.at(2).value));
+            if (it == indexes.end())
+                continue;
+            if (statuses.size() < folders.size())
+                statuses.resize(folders.size());
+            status_from_tokens(tokens.at(3), statuses.at(it->second));
+        }
+    }
+    statuses.resize(folders.size());
+
+    if (m_delimiter == 0 && folders.size() > first)
+        m_delimiter = folders.at(first).delimiter();
+
+    size_t listed = folders.size();
+    r = addInboxIfNeeded(folders);
+    statuses.resize(folders.size());
+    if (r == ErrorNone && folders.size() > listed) {
+        // INBOX had to be listed on its own, its status too
+        r = getfolderStatus("INBOX", &statuses.back());
+    }
+
+    return r;
+}
+
+void mailImap::setStatusPipelineDepth(uint32_t depth)
+{
+    m_statusPipelineDepth = depth;
+}
+
+uint32_t mailImap::getStatusPipelineDepth() const
+{
+    return m_statusPipelineDepth;
+}
+
+/*
+STATUS commands are sent by groups of m_statusPipelineDepth and the group
+is flushed at once, so that a group costs one round trip instead of one
+per folder. the depth bounds what the server has to buffer before we
+start reading, and keeps both sides from blocking on full socket buffers.
+*/
+
+int mailImap::getFoldersStatus(const vector<string>& folders, vector<folderStatus>& statuses)
+{
+    string items;
+    size_t depth;
+    // folders whose name needs a literal, asked one by one through libetpan
+    vector<size_t> literals;
+
+    int r = loginIfNeeded();
+    if (r)
+        return r;
+
+    // after loginIfNeeded(), a reconnection replaces m_imap
+    imapCommandStream stream(m_imap);
+
+    items = "(MESSAGES RECENT UNSEEN UIDNEXT UIDVALIDITY";
+    if (m_condstoreEnabled)
+        items += " HIGHESTMODSEQ";
+    items += ")";
+
+    statuses.assign(folders.size(), folderStatus());
+    depth = m_statusPipelineDepth > 0 ? m_statusPipelineDepth : 1;
+
+    for (size_t first = 0; first < folders.size(); first += depth) {
+        size_t last = first + depth;
+        map<string, size_t> pending;
+        map<string, size_t> indexes;
+
+        if (last > folders.size())
+            last = folders.size();
+
+        for (size_t i = first; i < last && r == ErrorNone; i++) {
+            if (!imapCommandStream::canQuote(folders.at(i))) {
+                literals.push_back(i);
+                continue;
+            }
+
+            string tag = stream.nextTag();
+
+            pending[tag] = i;
+            indexes[folder_path(folders.at(i))] = i;
+            r = stream.send(tag, "STATUS " + imapCommandStream::quote(folders.at(i)) + " " + items);
+        }
+        if (r == ErrorNone)
+            r = stream.flush();
+
+        while (r == ErrorNone && !pending.empty()) {
+            vector<imapToken> tokens;
+            string line;
+
+            r = stream.readLine(line);
+            if (r != ErrorNone)
+                break;
+
+            if (line.compare(0, 2, "* ") == 0) {
+                if (imapCommandStream::parseLine(line, tokens) && tokens.size() >= 4 &&
+                    toupper(tokens.at(1).value) == "STATUS" && tokens.at(3).type == imapToken::List) {
+                    map<string, size_t>::iterator it = indexes.find(folder_path(tokens.at(2).value));
+                    if (it != indexes.end())
+                        status_from_tokens(tokens.at(3), statuses.at(it->second));
+                }
+                continue;
+            }
+            if (line.compare(0, 1, "+") == 0)
+                continue;
+
+            // tagged: OK, or NO for a folder that cannot be opened, the status stays empty
+            map<string, size_t>::iterator it = pending.find(line.substr(0, line.find(' ')));
+            if (it == pending.end()) {
+                r = ErrorParse;
+                break;
+            }
+            pending.erase(it);
+        }
+    }
+
+    for (size_t i = 0; i < literals.size() && r == ErrorNone; i++) {
+        r = getfolderStatus(folders.at(literals.at(i)), &statuses.at(literals.at(i)));
+        if (r == ErrorNonExistantFolder)
+            r = ErrorNone;
+    }
+
+    if (r == ErrorConnection || r == ErrorParse)
+        m_shouldDisconnect = true;
+    return r;
 }
+
 int mailImap::renameFolder(string& folder, string& otherName)
 {
 
@@ -5,11 +5,23 @@
 #include <assert.h>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <functional>
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #include "libetpan/mailimap.h"
 
 class folderStatus;
 class imapFolder;
+class imapBuffer;
+class messageFlags;
+class messageCache;
+class imapPart;
+class envelopeIndex;
+class capabilityCache;
+class oauthTokenCache;
 
 using namespace std;
 
@@ -24,6 +36,37 @@ enum Encoding {
                                  EncodingUUEncode = -1
 };
 
+enum MessageFlag {
+    MessageFlagNone = 0,
+    MessageFlagSeen = 1 << 0,
+    MessageFlagAnswered = 1 << 1,
+    MessageFlagFlagged = 1 << 2,
+    MessageFlagDeleted = 1 << 3,
+    MessageFlagDraft = 1 << 4,
+    MessageFlagMDNSent = 1 << 5,
+    MessageFlagForwarded = 1 << 6,
+    MessageFlagSubmitPending = 1 << 7,
+    MessageFlagSubmitted = 1 << 8,
+};
+
+enum PartType {
+    PartTypeSingle,         // a leaf
+    PartTypeMessage,        // message/rfc822, parts() holds its body
+    PartTypeMultipart,      // multipart/*, parts() holds the alternatives or the attachments
+};
+
+enum ConnectionType {
+    ConnectionTypeClear = 1 << 0,       // plain text
+    ConnectionTypeStartTLS = 1 << 1,    // plain text upgraded with STARTTLS before login
+    ConnectionTypeTLS = 1 << 2,         // TLS from the start (port 993)
+};
+
+enum AuthType {
+    AuthTypeLogin,          // LOGIN with the password
+    AuthTypeXOAuth2,        // AUTHENTICATE XOAUTH2 with an OAuth2 access token (gmail, outlook)
+    AuthTypeOAuthBearer,    // AUTHENTICATE OAUTHBEARER (RFC 7628) with an OAuth2 access token
+};
+
 enum IMAPFolderFlag {
     IMAPFolderFlagNone = 0,
     IMAPFolderFlagMarked = 1 << 0,
@@ -59,13 +102,39 @@ static int resultsWithError(int r, clist * list, vector<imapFolder>& result);
 static bool hasError(int errorCode);
 
 static string toupper(const string& str);
+
+// receives one message per call, returning anything but ErrorNone stops delivering
+typedef function<int(uint32_t uid, const char * data, size_t length)> messageSink;
+// receives consecutive chunks of one body, returning anything but ErrorNone stops the fetch
+typedef function<int(const char * data, size_t length)> chunkSink;
+
+enum IdleEvent {
+    IdleEventExists,    // number is the new message count
+    IdleEventExpunge,   // number is the sequence number of the expunged message, its uid when QRESYNC is enabled
+    IdleEventFetch,     // number is the sequence number of the message whose flags changed
+};
+// called for each notification received while idling, returning anything but ErrorNone stops idling
+typedef function<int(IdleEvent event, uint32_t number, MessageFlag flags)> idleCallback;
 //static int fetch_imap_message(mailimap* session, uint32_t uid, char** result, size_t* result_len);
 class mailImap
 {
 public:
     mailImap(const string& server, uint16_t port, const string& userid, const string& pwd);
+    virtual ~mailImap();
     int connect();
     int login();
+    // LOGOUT and close the connection, the next command connects again
+    void disconnect();
+    // round trip to check the connection, also lets the server send pending notifications
+    int noop();
+    // the selected folder, empty when none is
+    string currentFolder() const;
+    // open folders with EXAMINE: the folder cannot be changed and fetched messages are not marked seen.
+    // a folder opened with SELECT is kept for read only commands
+    void setReadOnly(bool readOnly);
+    bool isReadOnly() const;
+    // SELECT and EXAMINE commands sent
+    uint64_t getSelectCount() const;
     void setServer(const string& server);
     string getServer();
     void setPort(uint16_t port);
@@ -74,16 +143,113 @@ public:
     string getUserid() const;
     void setPassword(const string& pwd);
     string getPassword() const;
+    void setConnectionType(ConnectionType connectionType);
+    ConnectionType getConnectionType() const;
+    void setAuthType(AuthType authType);
+    AuthType getAuthType() const;
+    // access token of the XOAUTH2 and OAUTHBEARER logins when there is no token cache
+    void setOAuth2Token(const string& token);
+    string getOAuth2Token() const;
+    // the token of userid is taken from cache at each login, a token the server refuses is
+    // invalidated in the cache. the cache is not owned
+    void setOAuthTokenCache(oauthTokenCache * cache);
+    oauthTokenCache * getOAuthTokenCache() const;
+    // connections opened again after one broke, the next command reconnects and selects the folder again
+    uint64_t getReconnectCount() const;
 
     int getMessageByUid(const string& folder, uint32_t uid, string& data);
     int getMessageByNumber(const string& folder, uint32_t num, string& data);
+    // same as above without copying the body libetpan already allocated
+    int getMessageByUid(const string& folder, uint32_t uid, imapBuffer& data);
+    int getMessageByNumber(const string& folder, uint32_t num, imapBuffer& data);
+    // fetch many messages with as few UID FETCH round trips as possible
+    int getMessagesByUids(const string& folder, const vector<uint32_t>& uids, messageSink sink);
+    // all the messages with firstUid <= uid <= lastUid, lastUid 0 means up to the last message
+    int getMessagesByUidRange(const string& folder, uint32_t firstUid, uint32_t lastUid, messageSink sink);
+
+    // UID, INTERNALDATE, RFC822.SIZE, FLAGS and ENVELOPE of firstUid <= uid <= lastUid (0 for the last message)
+    // appended to index, in batches of getFetchBatchSize() uids
+    int fetchEnvelopes(const string& folder, uint32_t firstUid, uint32_t lastUid, envelopeIndex& index);
+
+    void setFetchBatchSize(uint32_t batchSize);
+    uint32_t getFetchBatchSize() const;
+
+    // fetch a body in partial chunks so that at most one chunk is held in memory,
+    // attachment chunks are decoded like getMessageAttachmentByUid does
+    int streamMessageByUid(const string& folder, uint32_t uid, chunkSink sink);
+    int streamMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, chunkSink sink);
+
+    void setStreamChunkSize(uint32_t chunkSize);
+    uint32_t getStreamChunkSize() const;
 
     int getMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, string& data);
+    int getMessageAttachmentByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding, imapBuffer& data);
+    // length bytes of the part from offset, still encoded (BODY.PEEK[partId]<offset.length>).
+    // data is shorter than length at the end of the part
+    int getMessageAttachmentRangeByUid(const string& folder, uint32_t uid, string& partId, Encoding encoding,
+        uint32_t offset, uint32_t length, imapBuffer& data);
+
+    // the MIME tree of a message from BODYSTRUCTURE, nothing of the body is downloaded
+    virtual int getBodyStructure(const string& folder, uint32_t uid, imapPart& root);
+    // the text/plain (and text/html when includeHtml) parts that are not attachments, fetched
+    // with one UID FETCH and decoded. maxLength > 0 only fetches the start of each part, for previews
+    virtual int getTextParts(const string& folder, uint32_t uid, vector<imapPart>& parts, vector<string>& texts,
+        bool includeHtml = true, uint32_t maxLength = 0);
+    virtual int getTextParts(const string& folder, uint32_t uid, const imapPart& root, vector<imapPart>& parts,
+        vector<string>& texts, bool includeHtml = true, uint32_t maxLength = 0);
 
     virtual int getfolderStatus(const string& folder, folderStatus* fs);
+    // STATUS of many folders on this connection, pipelined by getStatusPipelineDepth() commands
+    // without waiting for each answer. statuses[i] is the status of folders[i], left zero when the
+    // server refused it (a folder that does not exist anymore)
+    virtual int getFoldersStatus(const vector<string>& folders, vector<folderStatus>& statuses);
+    void setStatusPipelineDepth(uint32_t depth);
+    uint32_t getStatusPipelineDepth() const;
+
+    // messages added or whose flags changed after modSeq, and with QRESYNC the uids expunged since then
+    virtual int syncMessageFlagsByUid(const string& folder, uint64_t modSeq,
+        vector<messageFlags>& changed, vector<uint32_t>& vanished);
+    bool isCondstoreEnabled() const;
+    bool isQResyncEnabled() const;
+
+    // keep folder in IDLE until timeout seconds elapsed (0 waits forever) or callback stops it
+    int idle(const string& folder, idleCallback callback, time_t timeout);
+    // the steps of idle(), for callers waiting on many sessions at once
+    int startIdle(const string& folder);
+    int idleFd();
+    // responses already read from the socket while idling, idleFd() will not signal them
+    bool hasIdleData() const;
+    int finishIdle(idleCallback& callback);
+    bool isIdleEnabled() const;
+
+    // getMessageByUid looks in cache first and stores what it fetched, the cache is not owned
+    void setMessageCache(messageCache * cache);
+    messageCache * getMessageCache() const;
+
+    // negotiate COMPRESS=DEFLATE after login when the server supports it
+    void setCompressionEnabled(bool enabled);
+    bool isCompressionEnabled() const;
+    // bytes on the socket, and bytes before compression / after decompression
+    uint64_t getWireBytesReceived() const;
+    uint64_t getWireBytesSent() const;
+    uint64_t getDataBytesReceived() const;
+    uint64_t getDataBytesSent() const;
+
+    // send LOGIN (AUTHENTICATE PLAIN when the server has SASL-IR), CAPABILITY, ENABLE and the SELECT
+    // of the first folder used at once, a new session is ready after one round trip when the
+    // capabilities of the server are in the capability cache
+    void setPipelinedLoginEnabled(bool enabled);
+    bool isPipelinedLoginEnabled() const;
+    // capabilities shared by the sessions of the same server, the cache is not owned
+    void setCapabilityCache(capabilityCache * cache);
+    capabilityCache * getCapabilityCache() const;
 
     virtual int fetchSubscribedFolders(vector<imapFolder>& subFolders);
-    virtual int fetchAllFolders(vector<string>& allFolders); // will use xlist if available
+    virtual int fetchAllFolders(vector<imapFolder>& allFolders); // will use xlist if available
+    // all the folders and their status, statuses[i] is the status of allFolders[i] (zero for \Noselect folders).
+    // one LIST-STATUS round trip when the server supports it, otherwise LIST then one STATUS per folder
+    virtual int fetchAllFoldersStatus(vector<imapFolder>& allFolders, vector<folderStatus>& statuses);
+    bool isListStatusEnabled() const;
 
     virtual int renameFolder(string& folder, string& otherName);
     virtual int deleteFolder(const string& folder);
@@ -91,15 +257,37 @@ public:
 
 private:
     int getMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, string& data);
+    int getMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, imapBuffer& data);
     int getNonDecodedMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId,
         bool wholePart, uint32_t offset, uint32_t length, Encoding encoding, string& data);
+    int getNonDecodedMessageAttachment(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId,
+        bool wholePart, uint32_t offset, uint32_t length, Encoding encoding, imapBuffer& data);
     int getMessage(const string& folder, bool isUid, uint32_t uidOrNumber, string& data);
+    int getMessage(const string& folder, bool isUid, uint32_t uidOrNumber, imapBuffer& data);
+    int fetchMessages(struct mailimap_set * set, messageSink& sink);
+    int fetchEnvelopes(struct mailimap_set * set, envelopeIndex& index);
+    int streamSection(const string& folder, bool isUid, uint32_t uidOrNumber, string& partId, Encoding encoding, chunkSink& sink);
+    int sectionSize(const string& folder, uint32_t uid, const string& partId, uint32_t& size);
     void decodeData(string& data, Encoding encoding);
+    void decodeData(imapBuffer& data, Encoding encoding);
     int selectFolder(const string& folder);
     int selectIfNeeded(const string& folder);
-    int loginIfNeeded();
+    // folder is selected with the login when it is pipelined, and replaces the folder restored after a reconnection
+    int loginIfNeeded(const string& folder = string());
+    int pipelinedLogin(const string& folder);
+    int oauth2Token(string& token);
+    void oauth2TokenRefused(const string& token);
+    int oauthBearerAuthenticate(const string& token);
     int connectIfNeeded();
     int fetchDelimiterIfNeeded(char defaultDelimiter, char& result);
+    int addInboxIfNeeded(vector<imapFolder>& folders);
+    int listStatus(vector<imapFolder>& folders, vector<folderStatus>& statuses);
+    int capability();
+    void capabilitiesChanged();
+    void enableFeaturesIfNeeded();
+    int compressIfNeeded();
+    static void streamLogger(mailstream_low * s, int log_type, const char * str, size_t size, void * context);
+    bool enableFeature(const string& feature);
     void init();
     
     vector<string> splictStr(const string& str, const string& sep);
@@ -109,20 +297,55 @@ private:
     string      m_server;
     string      m_userid;
     string      m_pwd;
+    AuthType    m_authType = AuthTypeLogin;
+    string      m_oauth2Token;
+    oauthTokenCache * m_tokenCache = NULL;
     time_t      m_timeout = 10;
     bool        m_voipEenable = true;
+    uint32_t    m_fetchBatchSize = 500;
+    uint32_t    m_streamChunkSize = 1024 * 1024;
+    uint32_t    m_statusPipelineDepth = 64;
 
+    ConnectionType m_connectionType = ConnectionTypeClear;
     bool        m_isConnected = false;
     bool        m_isLogined = false;
+    bool        m_shouldDisconnect = false;
+    string      m_reconnectFolder;
+    uint64_t    m_reconnectCount = 0;
     bool        m_yahooServer;
     bool        m_ramblerRuServer;
     bool        m_rermesServer;
     bool        m_ripServer;
 
+    bool        m_condstoreEnabled = false;
+    bool        m_qresyncEnabled = false;
+    bool        m_idleEnabled = false;
+    bool        m_idling = false;
+    bool        m_xlistEnabled = false;
+    bool        m_listStatusEnabled = false;
+    bool        m_specialUseEnabled = false;
+
+    bool        m_compressionEnabled = false;
+    bool        m_isCompressed = false;
+    mailstream_low * m_wireLow = NULL;
+    uint64_t    m_wireBytesReceived = 0;
+    uint64_t    m_wireBytesSent = 0;
+    uint64_t    m_dataBytesReceived = 0;
+    uint64_t    m_dataBytesSent = 0;
+
+    messageCache * m_cache = NULL;
+    map<string, uint32_t> m_uidValidities; // folder -> UIDVALIDITY of its last SELECT
+
+    bool        m_pipelinedLoginEnabled = false;
+    capabilityCache * m_capabilityCache = NULL;
+
     int         m_status;
 
     char        m_delimiter;
     string      m_currentFolder;
+    bool        m_readOnly = false;
+    bool        m_selectedReadOnly = false;
+    uint64_t    m_selectCount = 0;
 
     enum SessionStatus
     {
@@ -219,6 +442,144 @@ private:
     void init() { m_unseenCount = 0; m_messageCount = 0; m_recentCount = 0; m_uidNext = 0; m_uidValidity = 0; m_highestModSeqValue = 0; }
 };
 
+// owns a buffer allocated by libetpan (a fetched body or part) and frees it with mailimap_nstring_free,
+// buffers allocated elsewhere (the message cache) come with their own free function
+class imapBuffer
+{
+public:
+    typedef void freeFunction(char * data);
+
+    imapBuffer() : m_data(NULL), m_length(0), m_free(mailimap_nstring_free) {}
+    imapBuffer(char * data, size_t length, freeFunction * freeData = mailimap_nstring_free)
+        : m_data(data), m_length(length), m_free(freeData) {}
+    imapBuffer(imapBuffer&& other) : m_data(other.m_data), m_length(other.m_length), m_free(other.m_free)
+    {
+        other.m_data = NULL;
+        other.m_length = 0;
+    }
+    imapBuffer& operator=(imapBuffer&& other)
+    {
+        if (this != &other) {
+            reset(other.m_data, other.m_length, other.m_free);
+            other.m_data = NULL;
+            other.m_length = 0;
+        }
+        return *this;
+    }
+    imapBuffer(const imapBuffer&) = delete;
+    imapBuffer& operator=(const imapBuffer&) = delete;
+    ~imapBuffer() { reset(); }
+
+    const char * data() const { return m_data; }
+    char * data() { return m_data; }
+    size_t size() const { return m_length; }
+    bool empty() const { return m_length == 0; }
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+    string_view view() const { return string_view(m_data != NULL ? m_data : "", m_length); }
+#endif
+    // explicit copy, for callers that really need a std::string
+    string str() const { return m_data != NULL ? string(m_data, m_length) : string(); }
+
+    // used by in place decoders, the buffer can only shrink
+    void setSize(size_t length) { assert(length <= m_length); m_length = length; }
+
+    void reset(char * data = NULL, size_t length = 0, freeFunction * freeData = mailimap_nstring_free)
+    {
+        if (m_data != NULL && m_data != data)
+            m_free(m_data);
+        m_data = data;
+        m_length = length;
+        m_free = freeData;
+    }
+    // the caller becomes responsible for calling freeFunctionOfData() on the result
+    char * release()
+    {
+        char * data = m_data;
+        m_data = NULL;
+        m_length = 0;
+        return data;
+    }
+    freeFunction * freeFunctionOfData() const { return m_free; }
+private:
+    char * m_data;
+    size_t m_length;
+    freeFunction * m_free;
+};
+
+class messageFlags
+{
+public:
+    messageFlags() { init(); }
+    virtual ~messageFlags() {}
+
+    virtual void setUid(uint32_t uid) { m_uid = uid; }
+    virtual uint32_t uid() const { return m_uid; }
+
+    virtual void setFlags(MessageFlag flags) { m_flags = flags; }
+    virtual MessageFlag flags() const { return m_flags; }
+
+    virtual void setModSeqValue(uint64_t modSeqValue) { m_modSeqValue = modSeqValue; }
+    virtual uint64_t modSeqValue() const { return m_modSeqValue; }
+private:
+    uint32_t m_uid;
+    MessageFlag m_flags;
+    uint64_t m_modSeqValue;
+    void init() { m_uid = 0; m_flags = MessageFlagNone; m_modSeqValue = 0; }
+};
+
+class imapPart
+{
+public:
+    imapPart() { init(); }
+    virtual ~imapPart() {}
+
+    // "1.2" as used in BODY[1.2], empty for the multipart at the root of a message
+    virtual void setPartId(const string& partId) { m_partId = partId; }
+    virtual string partId() const { return m_partId; }
+
+    virtual void setType(PartType type) { m_type = type; }
+    virtual PartType type() const { return m_type; }
+
+    // lower case, "text/plain", "multipart/alternative"
+    virtual void setMimeType(const string& mimeType) { m_mimeType = mimeType; }
+    virtual string mimeType() const { return m_mimeType; }
+
+    virtual void setEncoding(Encoding encoding) { m_encoding = encoding; }
+    virtual Encoding encoding() const { return m_encoding; }
+
+    // encoded size in bytes, as the server will send it
+    virtual void setSize(uint32_t size) { m_size = size; }
+    virtual uint32_t size() const { return m_size; }
+
+    virtual void setCharset(const string& charset) { m_charset = charset; }
+    virtual string charset() const { return m_charset; }
+
+    virtual void setFilename(const string& filename) { m_filename = filename; }
+    virtual string filename() const { return m_filename; }
+
+    virtual void setContentId(const string& contentId) { m_contentId = contentId; }
+    virtual string contentId() const { return m_contentId; }
+
+    // Content-Disposition: attachment
+    virtual void setAttachment(bool attachment) { m_attachment = attachment; }
+    virtual bool isAttachment() const { return m_attachment; }
+
+    virtual vector<imapPart>& parts() { return m_parts; }
+    virtual const vector<imapPart>& parts() const { return m_parts; }
+private:
+    string m_partId;
+    PartType m_type;
+    string m_mimeType;
+    Encoding m_encoding;
+    uint32_t m_size;
+    string m_charset;
+    string m_filename;
+    string m_contentId;
+    bool m_attachment;
+    vector<imapPart> m_parts;
+    void init() { m_type = PartTypeSingle; m_encoding = Encoding7Bit; m_size = 0; m_attachment = false; }
+};
+
 class imapFolder
 {
 public:
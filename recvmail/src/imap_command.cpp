@@ -0,0 +1,261 @@
+#include "imap_command.h"
+#include "imap.h"
+#include <stdlib.h>
+
+imapCommandStream::imapCommandStream(mailimap * imap)
+{
+    m_imap = imap;
+}
+
+string imapCommandStream::nextTag()
+{
+    char tag[16];
+
+    // same numbering as libetpan's own commands
+    m_imap->imap_tag++;
+    sprintf_s(tag, sizeof(tag), "%i", m_imap->imap_tag);
+
+    return tag;
+}
+
+int imapCommandStream::send(const string& tag, const string& command)
+{
+    string line;
+
+    if (m_imap->imap_stream == NULL)
+        return ErrorConnection;
+
+    line = tag + " " + command + "\r\n";
+    if (mailstream_write(m_imap->imap_stream, line.data(), line.size()) < 0)
+        return ErrorConnection;
+
+    return ErrorNone;
+}
+
+int imapCommandStream::sendLine(const string& line)
+{
+    string data;
+
+    if (m_imap->imap_stream == NULL)
+        return ErrorConnection;
+
+    data = line + "\r\n";
+    if (mailstream_write(m_imap->imap_stream, data.data(), data.size()) < 0)
+        return ErrorConnection;
+
+    return ErrorNone;
+}
+
+int imapCommandStream::flush()
+{
+    if (m_imap->imap_stream == NULL)
+        return ErrorConnection;
+
+    if (mailstream_flush(m_imap->imap_stream) < 0)
+        return ErrorConnection;
+
+    return ErrorNone;
+}
+
+/* length of the literal announced at the end of line, -1 if there is none */
+
+static long literal_length(const char * line, size_t length)
+{
+    size_t begin;
+
+    if (length < 3 || line[length - 1] != '}')
+        return -1;
+
+    begin = length - 1;
+    while (begin > 0 && line[begin - 1] != '{')
+        begin--;
+    if (begin == 0)
+        return -1;
+
+    // {n} or the LITERAL+ form {n+}
+    char * end;
+    long value = strtol(line + begin, &end, 10);
+    if (end == line + begin || (*end != '}' && !(*end == '+' && end[1] == '}')))
+        return -1;
+
+    return value;
+}
+
+int imapCommandStream::readLine(string& line)
+{
+    line.clear();
+
+    if (m_imap->imap_stream == NULL)
+        return ErrorConnection;
+
+    while (1) {
+        char * str = mailstream_read_line_remove_eol(m_imap->imap_stream, m_imap->imap_stream_buffer);
+        if (str == NULL)
+            return ErrorConnection;
+
+        size_t length = strlen(str);
+        line.append(str, length);
+
+        long literal = literal_length(str, length);
+        if (literal < 0)
+            break;
+
+        size_t offset = line.size() + 2;
+        line.append("\r\n");
+        line.resize(offset + (size_t)literal);
+        for (size_t done = 0; done < (size_t)literal; ) {
+            ssize_t count = mailstream_read(m_imap->imap_stream, &line[offset + done], (size_t)literal - done);
+            if (count <= 0)
+                return ErrorConnection;
+            done += (size_t)count;
+        }
+        // the response goes on after the literal, up to the next CRLF
+    }
+
+    return ErrorNone;
+}
+
+int imapCommandStream::readResponse(const string& tag, vector<string>& untagged, string& status, string& text)
+{
+    string line;
+    string prefix = tag + " ";
+
+    while (1) {
+        int r = readLine(line);
+        if (r)
+            return r;
+
+        if (line.compare(0, 2, "* ") == 0) {
+            untagged.push_back(line);
+            continue;
+        }
+        if (line.compare(0, 1, "+") == 0) {
+            // continuation request, nothing here sends data waiting for it
+            continue;
+        }
+        if (line.compare(0, prefix.size(), prefix) != 0) {
+            // tagged response of another command, it must have been read by its sender
+            return ErrorParse;
+        }
+
+        size_t space = line.find(' ', prefix.size());
+        if (space == string::npos) {
+            status = line.substr(prefix.size());
+            text.clear();
+        }
+        else {
+            status = line.substr(prefix.size(), space - prefix.size());
+            text = line.substr(space + 1);
+        }
+        return ErrorNone;
+    }
+}
+
+static bool is_nil(const string& atom)
+{
+    return atom.size() == 3 && (atom[0] == 'N' || atom[0] == 'n') &&
+        (atom[1] == 'I' || atom[1] == 'i') && (atom[2] == 'L' || atom[2] == 'l');
+}
+
+static bool parse_tokens(const string& line, size_t& pos, vector<imapToken>& tokens, bool inList)
+{
+    while (pos < line.size()) {
+        char c = line[pos];
+
+        if (c == ' ') {
+            pos++;
+            continue;
+        }
+
+        if (c == ')') {
+            if (!inList)
+                return false;
+            pos++;
+            return true;
+        }
+
+        imapToken token;
+
+        if (c == '(') {
+            pos++;
+            token.type = imapToken::List;
+            if (!parse_tokens(line, pos, token.items, true))
+                return false;
+        }
+        else if (c == '"') {
+            pos++;
+            token.type = imapToken::String;
+            while (pos < line.size() && line[pos] != '"') {
+                if (line[pos] == '\\' && pos + 1 < line.size())
+                    pos++;
+                token.value.push_back(line[pos]);
+                pos++;
+            }
+            if (pos >= line.size())
+                return false;
+            pos++;
+        }
+        else if (c == '{') {
+            char * end;
+            long length = strtol(line.c_str() + pos + 1, &end, 10);
+            size_t data = (size_t)(end - line.c_str());
+
+            if (*end == '+')
+                data++;
+            if (length < 0 || line.compare(data, 3, "}\r\n") != 0)
+                return false;
+            data += 3;
+            if (data + (size_t)length > line.size())
+                return false;
+            token.type = imapToken::String;
+            token.value = line.substr(data, (size_t)length);
+            pos = data + (size_t)length;
+        }
+        else {
+            // atoms may contain brackets, as in BODY[1.2]
+            size_t begin = pos;
+            while (pos < line.size() && line[pos] != ' ' && line[pos] != '(' && line[pos] != ')')
+                pos++;
+            token.value = line.substr(begin, pos - begin);
+            token.type = is_nil(token.value) ? imapToken::Nil : imapToken::Atom;
+        }
+
+        tokens.push_back(token);
+    }
+
+    return !inList;
+}
+
+bool imapCommandStream::parseLine(const string& line, vector<imapToken>& tokens)
+{
+    size_t pos = 0;
+
+    tokens.clear();
+    return parse_tokens(line, pos, tokens, false);
+}
+
+string imapCommandStream::quote(const string& str)
+{
+    string result = "\"";
+
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '"' || str[i] == '\\')
+            result.push_back('\\');
+        result.push_back(str[i]);
+    }
+    result.push_back('"');
+
+    return result;
+}
+
+bool imapCommandStream::canQuote(const string& str)
+{
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = (unsigned char) str[i];
+
+        if (c == '\0' || c == '\r' || c == '\n' || c >= 0x80)
+            return false;
+    }
+
+    return true;
+}
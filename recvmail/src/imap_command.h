@@ -0,0 +1,68 @@
+#ifndef __IMAP_COMMAND_H__
+#define __IMAP_COMMAND_H__
+
+#include <string>
+#include <vector>
+
+#include "libetpan/mailimap.h"
+
+using namespace std;
+
+// one element of a response line
+class imapToken
+{
+public:
+    enum Type {
+        Atom,       // atoms and numbers
+        String,     // quoted string or literal, value is unquoted
+        Nil,
+        List,       // parenthesized list, in items
+    };
+
+    imapToken() : type(Atom) {}
+
+    Type type;
+    string value;
+    vector<imapToken> items;
+};
+
+/*
+commands written directly on the stream of a libetpan session, for the
+extensions libetpan cannot send or parse (LIST-STATUS, SASL-IR...) and
+to pipeline commands.
+
+tags come from the counter libetpan uses, so that commands sent here and
+by libetpan never share a tag. nothing else of the session state is
+updated: the caller must not leave responses unread before calling
+libetpan again.
+*/
+class imapCommandStream
+{
+public:
+    imapCommandStream(mailimap * imap);
+
+    string nextTag();
+    // queue "tag command\r\n", written on flush()
+    int send(const string& tag, const string& command);
+    // a line without tag, the answer to a continuation request. written on flush()
+    int sendLine(const string& line);
+    int flush();
+
+    // one response line without its CRLF, literals are read and kept inline as {n}\r\n<data>
+    int readLine(string& line);
+    // read until the tagged response of tag, the untagged responses are appended to untagged.
+    // status is OK, NO or BAD and text the rest of the tagged line
+    int readResponse(const string& tag, vector<string>& untagged, string& status, string& text);
+
+    // split a response line in tokens, false if it is malformed
+    static bool parseLine(const string& line, vector<imapToken>& tokens);
+    // a quoted string, as a command argument
+    static string quote(const string& str);
+    // false when str has 8-bit characters, CR, LF or NUL, which only a literal can send
+    static bool canQuote(const string& str);
+
+private:
+    mailimap * m_imap;
+};
+
+#endif
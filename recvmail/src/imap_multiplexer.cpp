@@ -0,0 +1,288 @@
+#include "imap_multiplexer.h"
+#include <algorithm>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#elif defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#endif
+
+// same renewal delay as mailImap::idle()
+#define IDLE_RENEW_DELAY (28 * 60)
+// how long run() waits before looking at stop()
+#define RUN_STEP_TIMEOUT 1000
+#define MAX_EVENTS 256
+
+imapMultiplexer::imapMultiplexer(size_t threads)
+    : m_stopping(false)
+    , m_pool(threads)
+{
+#ifdef __linux__
+    m_poll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+imapMultiplexer::~imapMultiplexer()
+{
+    while (!m_sessions.empty())
+        removeSession(m_sessions.begin()->second.imap);
+
+#ifdef __linux__
+    if (m_poll != -1)
+        close(m_poll);
+#endif
+}
+
+int imapMultiplexer::watch(session& s)
+{
+#ifdef __linux__
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.fd = s.fd;
+    if (epoll_ctl(m_poll, EPOLL_CTL_ADD, s.fd, &event) < 0)
+        return ErrorIdle;
+#endif
+    // poll() gets the sockets from m_sessions each time
+    return ErrorNone;
+}
+
+void imapMultiplexer::unwatch(session& s)
+{
+#ifdef __linux__
+    struct epoll_event event;
+
+    // a non-NULL event for kernels before 2.6.9
+    epoll_ctl(m_poll, EPOLL_CTL_DEL, s.fd, &event);
+#endif
+}
+
+int imapMultiplexer::addSession(mailImap * imap, const string& folder, idleCallback callback)
+{
+    session s;
+    int r;
+
+#ifdef __linux__
+    if (m_poll == -1)
+        return ErrorIdle;
+#endif
+
+    s.imap = imap;
+    s.folder = folder;
+    s.callback = callback;
+
+    r = restartIdle(s);
+    if (r)
+        return r;
+
+    if (m_sessions.find(s.fd) != m_sessions.end() || watch(s) != ErrorNone) {
+        imap->finishIdle(s.callback);
+        return ErrorIdle;
+    }
+
+    m_sessions[s.fd] = s;
+    return ErrorNone;
+}
+
+int imapMultiplexer::removeSession(mailImap * imap)
+{
+    for (map<int, session>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        if (it->second.imap == imap) {
+            session s = it->second;
+
+            unwatch(s);
+            m_sessions.erase(it);
+            // what arrived since the last wake up is still delivered
+            return imap->finishIdle(s.callback);
+        }
+    }
+    return ErrorNone;
+}
+
+size_t imapMultiplexer::sessionCount() const
+{
+    return m_sessions.size();
+}
+
+void imapMultiplexer::setErrorHandler(sessionErrorHandler handler)
+{
+    m_errorHandler = handler;
+}
+
+int imapMultiplexer::restartIdle(session& s)
+{
+    int r = s.imap->startIdle(s.folder);
+    if (r)
+        return r;
+
+    s.fd = s.imap->idleFd();
+    s.renewTime = time(NULL) + IDLE_RENEW_DELAY;
+    return ErrorNone;
+}
+
+void imapMultiplexer::fail(int fd, int error)
+{
+    map<int, session>::iterator it = m_sessions.find(fd);
+    if (it == m_sessions.end())
+        return;
+
+    session s = it->second;
+    unwatch(s);
+    m_sessions.erase(it);
+
+    if (m_errorHandler)
+        m_errorHandler(s.imap, error);
+}
+
+/*
+DONE is sent and libetpan parses everything the server sent during
+IDLE, then IDLE starts again. both wait for the server, so the ready
+sessions go through them at once on m_pool and only the notifications
+are kept; they are delivered to the callbacks afterwards, on this
+thread. the socket of a session is the same for the whole connection
+so its registration is kept.
+*/
+
+void imapMultiplexer::serve(const vector<int>& ready)
+{
+    vector<served> results(ready.size());
+    vector<future<void> > done;
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        map<int, session>::iterator it = m_sessions.find(ready[i]);
+        if (it == m_sessions.end())
+            continue;
+
+        mailImap * imap = it->second.imap;
+        string folder = it->second.folder;
+        served * result = &results[i];
+
+        result->found = true;
+        done.push_back(m_pool.submit([imap, folder, result]() {
+            idleCallback collect = [result](IdleEvent event, uint32_t number, MessageFlag flags) {
+                result->events.push_back(idleEvent { event, number, flags });
+                return (int) ErrorNone;
+            };
+
+            result->error = imap->finishIdle(collect);
+            if (result->error == ErrorNone)
+                result->error = imap->startIdle(folder);
+            if (result->error == ErrorNone)
+                result->fd = imap->idleFd();
+        }));
+    }
+    for (size_t i = 0; i < done.size(); i++)
+        done[i].wait();
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        served& result = results[i];
+        int fd = ready[i];
+
+        // a callback may have removed the session already
+        map<int, session>::iterator it = m_sessions.find(fd);
+        if (!result.found || it == m_sessions.end())
+            continue;
+
+        // what was received before an error is still delivered
+        session& s = it->second;
+        int r = ErrorNone;
+        for (size_t j = 0; j < result.events.size() && r == ErrorNone; j++)
+            r = s.callback(result.events[j].event, result.events[j].number, result.events[j].flags);
+
+        if (r == ErrorNone)
+            r = result.error;
+        if (r == ErrorNone && result.fd != fd)
+            r = ErrorConnection;
+        if (r) {
+            fail(fd, r);
+            continue;
+        }
+        s.renewTime = time(NULL) + IDLE_RENEW_DELAY;
+    }
+}
+
+int imapMultiplexer::runOnce(int timeout)
+{
+    vector<int> ready;
+    time_t now = time(NULL);
+
+    for (map<int, session>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        // buffered responses would never wake the socket up
+        if (it->second.imap->hasIdleData() || it->second.renewTime <= now) {
+            ready.push_back(it->first);
+        }
+        else if (timeout < 0 || (it->second.renewTime - now) * 1000 < timeout) {
+            timeout = (int) ((it->second.renewTime - now) * 1000);
+        }
+    }
+    if (!ready.empty())
+        timeout = 0;
+
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(m_poll, events, MAX_EVENTS, timeout);
+    if (count < 0 && errno != EINTR)
+        return ErrorIdle;
+
+    for (int i = 0; i < count; i++)
+        ready.push_back(events[i].data.fd);
+#else
+    vector<struct pollfd> fds;
+
+    fds.reserve(m_sessions.size());
+    for (map<int, session>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        struct pollfd pfd;
+
+        pfd.fd = it->first;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+    }
+
+#ifdef _WIN32
+    int count = fds.empty() ? 0 : WSAPoll(fds.data(), (ULONG) fds.size(), timeout);
+    if (fds.empty() && timeout > 0)
+        Sleep(timeout);
+#else
+    int count = poll(fds.data(), fds.size(), timeout);
+    if (count < 0 && errno == EINTR)
+        count = 0;
+#endif
+    if (count < 0)
+        return ErrorIdle;
+
+    for (size_t i = 0; i < fds.size() && count > 0; i++) {
+        if (fds[i].revents != 0)
+            ready.push_back((int) fds[i].fd);
+    }
+#endif
+
+    // a session can be both buffered and readable
+    sort(ready.begin(), ready.end());
+    ready.erase(unique(ready.begin(), ready.end()), ready.end());
+
+    serve(ready);
+
+    return ErrorNone;
+}
+
+int imapMultiplexer::run()
+{
+    while (!m_stopping) {
+        int r = runOnce(RUN_STEP_TIMEOUT);
+        if (r)
+            return r;
+    }
+    m_stopping = false;
+
+    return ErrorNone;
+}
+
+void imapMultiplexer::stop()
+{
+    m_stopping = true;
+}
@@ -0,0 +1,97 @@
+#ifndef __IMAP_MULTIPLEXER_H__
+#define __IMAP_MULTIPLEXER_H__
+
+#include <time.h>
+#include <map>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "imap.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// called when a session left the multiplexer because of error, the session is not used anymore
+typedef function<void(mailImap * imap, int error)> sessionErrorHandler;
+
+/*
+many sessions idling without a thread each.
+
+every session added is put in IDLE on folder and its socket is watched
+with one epoll instance (poll() where there is no epoll). when a socket
+becomes readable the session leaves IDLE, the notifications are parsed
+and delivered to its callback, and the session goes back to IDLE. IDLE
+is also renewed before servers drop it.
+
+a session costs its libetpan session and socket plus one entry here,
+there is no thread per session. leaving and restarting IDLE take a
+round trip each, the sessions woken up together do it on a small pool
+of threads: serving n of them costs about n / threads round trips
+instead of n. the callbacks are still called from the thread running
+run() or runOnce(), once every woken up session is back in IDLE.
+
+all the methods must be called from the thread running run() or
+runOnce(), except stop().
+*/
+class imapMultiplexer
+{
+public:
+    // threads is the number of sessions leaving and restarting IDLE at once
+    imapMultiplexer(size_t threads = 8);
+    ~imapMultiplexer();
+    imapMultiplexer(const imapMultiplexer&) = delete;
+    imapMultiplexer& operator=(const imapMultiplexer&) = delete;
+
+    // the session is logged in if needed and put in IDLE, it must support IDLE
+    int addSession(mailImap * imap, const string& folder, idleCallback callback);
+    // the session leaves IDLE and can be used directly again
+    int removeSession(mailImap * imap);
+    size_t sessionCount() const;
+
+    void setErrorHandler(sessionErrorHandler handler);
+
+    // wait at most timeout milliseconds and serve the sessions that have something to read
+    int runOnce(int timeout);
+    // runOnce() until stop() is called from any thread
+    int run();
+    void stop();
+
+private:
+    struct session {
+        mailImap *  imap;
+        string      folder;
+        idleCallback callback;
+        int         fd = -1;
+        time_t      renewTime = 0;
+    };
+
+    struct idleEvent {
+        IdleEvent   event;
+        uint32_t    number;
+        MessageFlag flags;
+    };
+
+    // what serving one session left for the callback
+    struct served {
+        bool        found = false;
+        int         error = ErrorNone;
+        int         fd = -1;
+        vector<idleEvent> events;
+    };
+
+    int watch(session& s);
+    void unwatch(session& s);
+    int restartIdle(session& s);
+    void serve(const vector<int>& ready);
+    void fail(int fd, int error);
+
+    int         m_poll = -1;
+    map<int, session> m_sessions;   // socket -> session
+    sessionErrorHandler m_errorHandler;
+    atomic<bool> m_stopping;
+    threadPool  m_pool;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "imap_sync.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+
+imapSync::imapSync(mailImap * imap, const string& stateDirectory)
+{
+    m_imap = imap;
+    m_stateDirectory = stateDirectory;
+}
+
+void imapSync::setFolderInvalidatedHandler(folderInvalidatedHandler handler)
+{
+    m_invalidatedHandler = handler;
+}
+
+void imapSync::setFlagsChangedHandler(flagsChangedHandler handler)
+{
+    m_flagsHandler = handler;
+}
+
+string imapSync::statePath() const
+{
+    char port[16];
+    string account;
+    string name;
+
+    sprintf_s(port, sizeof(port), "%d", m_imap->getPort());
+    account = m_imap->getUserid() + "@" + m_imap->getServer() + "_" + port;
+    for (size_t i = 0; i < account.size(); i++) {
+        char c = account.at(i);
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '.' || c == '-' || c == '_' || c == '@') {
+            name.push_back(c);
+        }
+        else {
+            name.push_back('_');
+        }
+    }
+
+    if (m_stateDirectory.empty())
+        return name + ".sync";
+    return m_stateDirectory + "/" + name + ".sync";
+}
+
+/*
+one line per folder, fields separated by tabs:
+uidvalidity, uidnext, highestmodseq and the folder name last.
+files written before highestmodseq was kept have no third field.
+*/
+
+int imapSync::loadStateIfNeeded()
+{
+    if (m_loaded)
+        return ErrorNone;
+
+    ifstream in(statePath().c_str(), ios::in | ios::binary);
+    string line;
+
+    while (getline(in, line)) {
+        vector<string> fields;
+        string field;
+        istringstream fieldStream(line);
+
+        while (getline(fieldStream, field, '\t'))
+            fields.push_back(field);
+        if (fields.size() < 3)
+            continue;
+
+        folderState state;
+        state.uidValidity = (uint32_t)strtoul(fields.at(0).c_str(), NULL, 10);
+        state.uidNext = (uint32_t)strtoul(fields.at(1).c_str(), NULL, 10);
+        if (fields.size() >= 4)
+            state.highestModSeq = strtoull(fields.at(2).c_str(), NULL, 10);
+        m_states[fields.back()] = state;
+    }
+
+    m_loaded = true;
+    return ErrorNone;
+}
+
+int imapSync::saveState()
+{
+    string path = statePath();
+    string tmpPath = path + ".tmp";
+
+    {
+        ofstream out(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!out)
+            return ErrorFile;
+
+        for (map<string, folderState>::iterator it = m_states.begin(); it != m_states.end(); ++it) {
+            out << it->second.uidValidity << '\t' << it->second.uidNext << '\t'
+                << it->second.highestModSeq << '\t' << it->first << '\n';
+        }
+        out.flush();
+        if (!out)
+            return ErrorFile;
+    }
+
+    if (!replace_file(tmpPath, path))
+        return ErrorFile;
+
+    return ErrorNone;
+}
+
+int imapSync::resetFolder(const string& folder)
+{
+    int r = loadStateIfNeeded();
+    if (r)
+        return r;
+
+    m_states.erase(folder);
+    return saveState();
+}
+
+int imapSync::syncFolder(const string& folder, messageSink sink)
+{
+    folderStatus status;
+    uint32_t batchSize;
+    uint32_t maxUid = 0;
+
+    int r = loadStateIfNeeded();
+    if (r)
+        return r;
+
+    r = m_imap->getfolderStatus(folder, &status);
+    if (r)
+        return r;
+
+    folderState& state = m_states[folder];
+    if (state.uidValidity != status.uidValidity()) {
+        // UIDs from the previous validity mean nothing anymore
+        if (state.uidValidity != 0 && m_invalidatedHandler)
+            m_invalidatedHandler(folder);
+        state.uidValidity = status.uidValidity();
+        state.uidNext = 1;
+        state.highestModSeq = 0;
+    }
+
+    messageSink trackingSink = [&sink, &maxUid, &state](uint32_t uid, const char * data, size_t length) {
+        // UID FETCH n:* always returns the last message, even when its uid is below n (RFC 3501)
+        if (uid < state.uidNext)
+            return (int) ErrorNone;
+        if (uid > maxUid)
+            maxUid = uid;
+        return sink(uid, data, length);
+    };
+
+    if (status.uidNext() == 0) {
+        // the server did not report UIDNEXT, ask for everything above what we have
+        r = m_imap->getMessagesByUidRange(folder, state.uidNext, 0, trackingSink);
+        if (r == ErrorNone && maxUid >= state.uidNext)
+            state.uidNext = maxUid + 1;
+        if (r == ErrorNone)
+            r = syncFlags(folder, state, status);
+        if (r == ErrorNone)
+            r = saveState();
+        return r;
+    }
+
+    // save progress after each batch so that an interrupted sync resumes where it stopped
+    batchSize = m_imap->getFetchBatchSize();
+    if (batchSize == 0)
+        batchSize = status.uidNext();
+    while (state.uidNext < status.uidNext()) {
+        uint32_t last = status.uidNext() - 1;
+        if (last - state.uidNext >= batchSize)
+            last = state.uidNext + batchSize - 1;
+
+        r = m_imap->getMessagesByUidRange(folder, state.uidNext, last, trackingSink);
+        if (r)
+            return r;
+
+        state.uidNext = last + 1;
+        r = saveState();
+        if (r)
+            return r;
+    }
+
+    if (state.uidNext > status.uidNext()) {
+        // UIDNEXT never goes down for the same UIDVALIDITY, the state file is stale
+        state.uidNext = status.uidNext();
+    }
+
+    r = syncFlags(folder, state, status);
+    if (r)
+        return r;
+
+    return saveState();
+}
+
+int imapSync::syncFlags(const string& folder, folderState& state, folderStatus& status)
+{
+    vector<messageFlags> changed;
+    vector<uint32_t> vanished;
+
+    if (!m_flagsHandler || !m_imap->isCondstoreEnabled() || status.highestModSeqValue() == 0) {
+        state.highestModSeq = 0;
+        return ErrorNone;
+    }
+
+    // the first sync only records where to start from
+    if (state.highestModSeq != 0 && status.highestModSeqValue() > state.highestModSeq) {
+        int r = m_imap->syncMessageFlagsByUid(folder, state.highestModSeq, changed, vanished);
+        if (r)
+            return r;
+
+        m_flagsHandler(folder, changed, vanished);
+    }
+
+    state.highestModSeq = status.highestModSeqValue();
+    return ErrorNone;
+}
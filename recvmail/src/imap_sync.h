@@ -0,0 +1,64 @@
+#ifndef __IMAP_SYNC_H__
+#define __IMAP_SYNC_H__
+
+#include <map>
+#include <string>
+#include <functional>
+
+#include "imap.h"
+
+using namespace std;
+
+// called when the server changed UIDVALIDITY and everything known about folder must be dropped
+typedef function<void(const string& folder)> folderInvalidatedHandler;
+// flag changes and expunges found by a CONDSTORE/QRESYNC sync
+typedef function<void(const string& folder, const vector<messageFlags>& changed,
+    const vector<uint32_t>& vanished)> flagsChangedHandler;
+
+/*
+incremental folder synchronization.
+
+the UIDVALIDITY and UIDNEXT seen at the end of the last sync are kept
+per (account, folder) in stateDirectory, so that a sync only fetches
+the messages that arrived since.
+
+when the server supports CONDSTORE and a flags handler is set, the
+HIGHESTMODSEQ is kept as well and only the flags changed since are
+fetched (plus the expunged uids with QRESYNC).
+*/
+class imapSync
+{
+public:
+    imapSync(mailImap * imap, const string& stateDirectory);
+
+    // deliver the messages added to folder since the last sync
+    int syncFolder(const string& folder, messageSink sink);
+    // forget folder, the next sync fetches it again from the start
+    int resetFolder(const string& folder);
+
+    void setFolderInvalidatedHandler(folderInvalidatedHandler handler);
+    void setFlagsChangedHandler(flagsChangedHandler handler);
+
+    string statePath() const;
+
+private:
+    struct folderState {
+        uint32_t uidValidity = 0;
+        uint32_t uidNext = 1;
+        uint64_t highestModSeq = 0;
+    };
+
+    int syncFlags(const string& folder, folderState& state, folderStatus& status);
+
+    int loadStateIfNeeded();
+    int saveState();
+
+    mailImap *  m_imap;
+    string      m_stateDirectory;
+    bool        m_loaded = false;
+    map<string, folderState> m_states;
+    folderInvalidatedHandler m_invalidatedHandler;
+    flagsChangedHandler m_flagsHandler;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "mapped_file.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// what data() points at for an empty file, mmap() refuses a zero length
+static const char empty_mapping[1] = { 0 };
+
+mappedFile::mappedFile()
+{
+    m_data = NULL;
+    m_length = 0;
+#ifdef _WIN32
+    m_mapping = NULL;
+#endif
+}
+
+mappedFile::mappedFile(mappedFile&& other)
+{
+    m_data = other.m_data;
+    m_length = other.m_length;
+    other.m_data = NULL;
+    other.m_length = 0;
+#ifdef _WIN32
+    m_mapping = other.m_mapping;
+    other.m_mapping = NULL;
+#endif
+}
+
+mappedFile& mappedFile::operator=(mappedFile&& other)
+{
+    if (this != &other) {
+        close();
+        m_data = other.m_data;
+        m_length = other.m_length;
+        other.m_data = NULL;
+        other.m_length = 0;
+#ifdef _WIN32
+        m_mapping = other.m_mapping;
+        other.m_mapping = NULL;
+#endif
+    }
+    return *this;
+}
+
+mappedFile::~mappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool mappedFile::open(const string& path)
+{
+    HANDLE file;
+    LARGE_INTEGER size;
+
+    close();
+
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    if (!GetFileSizeEx(file, &size) || (unsigned long long)size.QuadPart > (size_t)-1) {
+        CloseHandle(file);
+        return false;
+    }
+
+    if (size.QuadPart == 0) {
+        CloseHandle(file);
+        m_data = empty_mapping;
+        m_length = 0;
+        return true;
+    }
+
+    // the mapping keeps the file open, the handle is not needed anymore
+    m_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (m_mapping == NULL)
+        return false;
+
+    m_data = (const char *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_data == NULL) {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+        return false;
+    }
+    m_length = (size_t)size.QuadPart;
+
+    return true;
+}
+
+void mappedFile::close()
+{
+    if (m_data != NULL && m_data != empty_mapping)
+        UnmapViewOfFile(m_data);
+    if (m_mapping != NULL)
+        CloseHandle(m_mapping);
+    m_data = NULL;
+    m_length = 0;
+    m_mapping = NULL;
+}
+
+#else
+
+bool mappedFile::open(const string& path)
+{
+    int fd;
+    struct stat buf;
+    void * text;
+
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &buf) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    if (buf.st_size == 0) {
+        ::close(fd);
+        m_data = empty_mapping;
+        m_length = 0;
+        return true;
+    }
+
+    // MAP_PRIVATE, a writer replacing the file does it by rename, never in place
+    text = mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (text == MAP_FAILED)
+        return false;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(text, (size_t)buf.st_size, MADV_SEQUENTIAL);
+#endif
+
+    m_data = (const char *)text;
+    m_length = (size_t)buf.st_size;
+
+    return true;
+}
+
+void mappedFile::close()
+{
+    if (m_data != NULL && m_data != empty_mapping)
+        munmap((void *)m_data, m_length);
+    m_data = NULL;
+    m_length = 0;
+}
+
+#endif
+
+bool replace_file(const string& from, const string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    // rename() replaces an existing file atomically
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <stddef.h>
+#include <string>
+
+using namespace std;
+
+/*
+read only mapping of a whole file.
+
+the content is reached through data() without being copied to the heap,
+the pages are read by the system when they are touched.
+an empty file gives an empty, non NULL, mapping.
+*/
+class mappedFile
+{
+public:
+    mappedFile();
+    mappedFile(mappedFile&& other);
+    mappedFile& operator=(mappedFile&& other);
+    mappedFile(const mappedFile&) = delete;
+    mappedFile& operator=(const mappedFile&) = delete;
+    ~mappedFile();
+
+    // false when the file cannot be opened or mapped, the previous mapping is closed anyway
+    bool open(const string& path);
+    void close();
+
+    bool isOpen() const { return m_data != NULL; }
+    const char * data() const { return m_data; }
+    size_t size() const { return m_length; }
+
+private:
+    const char * m_data;
+    size_t m_length;
+#ifdef _WIN32
+    void * m_mapping;
+#endif
+};
+
+/*
+moves from over to, replacing to at once: a reader opens either the old
+or the new file, never a missing or partial one. false on failure, from
+is left in place.
+*/
+bool replace_file(const string& from, const string& to);
+
+#endif
@@ -0,0 +1,617 @@
+#include "message_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+/*
+SHA-256 (FIPS 180-4), only used to name the cached objects.
+*/
+
+struct sha256_context {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t sha256_rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_transform(sha256_context * ctx, const unsigned char * block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+            ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256_init(sha256_context * ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_context * ctx, const char * data, size_t length)
+{
+    const unsigned char * p = (const unsigned char *)data;
+
+    ctx->length += length;
+    if (ctx->used > 0) {
+        size_t count = 64 - ctx->used;
+        if (count > length)
+            count = length;
+        memcpy(ctx->block + ctx->used, p, count);
+        ctx->used += count;
+        p += count;
+        length -= count;
+        if (ctx->used < 64)
+            return;
+        sha256_transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    while (length >= 64) {
+        sha256_transform(ctx, p);
+        p += 64;
+        length -= 64;
+    }
+    memcpy(ctx->block, p, length);
+    ctx->used = length;
+}
+
+static string sha256_final(sha256_context * ctx)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint64_t bits = ctx->length * 8;
+    string result;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++)
+        ctx->block[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+    sha256_transform(ctx, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        for (int shift = 28; shift >= 0; shift -= 4)
+            result.push_back(hex[(ctx->state[i] >> shift) & 0xf]);
+    }
+    return result;
+}
+
+static string sha256_hex(const char * data, size_t length)
+{
+    sha256_context ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, length);
+    return sha256_final(&ctx);
+}
+
+static void make_directory(const string& path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0700);
+#endif
+}
+
+// the journal is compacted when it holds this many lines per live key
+#define COMPACT_RATIO 4
+// and not before this many lines, a small journal costs nothing to replay
+#define COMPACT_MIN_LINES 4096
+
+// names of the entries of directory, without "." and ".."
+static void list_directory(const string& directory, vector<string>& names)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "/*").c_str(), &data);
+
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        if (strcmp(data.cFileName, ".") != 0 && strcmp(data.cFileName, "..") != 0)
+            names.push_back(data.cFileName);
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR * dir = opendir(directory.c_str());
+    struct dirent * entry;
+
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
+}
+
+// buffers handed out by the cache are not libetpan's
+static void free_cache_buffer(char * data)
+{
+    delete[] data;
+}
+
+messageCache::messageCache(const string& directory, uint64_t maxSize)
+{
+    m_directory = directory;
+    m_maxSize = maxSize;
+}
+
+/* the order of the journal is the LRU order the next open starts from */
+
+messageCache::~messageCache()
+{
+    if (m_opened)
+        compactIndex();
+}
+
+string messageCache::messageKey(const string& server, const string& user, const string& folder,
+    uint32_t uidValidity, uint32_t uid)
+{
+    char numbers[32];
+    string key;
+
+    // NUL cannot appear in any of the fields, no two tuples give the same string
+    sprintf_s(numbers, sizeof(numbers), "%u", uidValidity);
+    key.append(server).push_back('\0');
+    key.append(user).push_back('\0');
+    key.append(folder).push_back('\0');
+    key.append(numbers).push_back('\0');
+    sprintf_s(numbers, sizeof(numbers), "%u", uid);
+    key.append(numbers);
+
+    return sha256_hex(key.data(), key.size());
+}
+
+const string& messageCache::getDirectory() const
+{
+    return m_directory;
+}
+
+string messageCache::objectPath(const string& hash) const
+{
+    return m_directory + "/objects/" + hash;
+}
+
+string messageCache::indexPath() const
+{
+    return m_directory + "/index";
+}
+
+/*
+index journal, one operation per line:
+"+ key hash size" maps key to an object, "- key" removes key.
+replaying it in order gives the current mapping, and the order of the
+"+" lines the least recently stored objects first.
+*/
+
+int messageCache::openIfNeeded()
+{
+    if (m_opened)
+        return ErrorNone;
+
+    make_directory(m_directory);
+    make_directory(m_directory + "/objects");
+
+    ifstream in(indexPath().c_str(), ios::in | ios::binary);
+    string line;
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string op;
+        string key;
+
+        m_journalLines++;
+        fields >> op >> key;
+        if (key.empty())
+            continue;
+
+        if (op == "+") {
+            string hash;
+            uint64_t size = 0;
+
+            fields >> hash >> size;
+            if (fields.fail() || hash.empty())
+                continue;
+            link(key, hash, size);
+        }
+        else if (op == "-") {
+            unlink(key);
+        }
+    }
+    in.close();
+
+    m_opened = true;
+
+    int r = compactIndex();
+    if (r)
+        return r;
+
+    collectObjects();
+
+    evictIfNeeded();
+    return ErrorNone;
+}
+
+/*
+objects no key points at: written by a put() that stopped before its
+index line, left by an unlink() that could not remove them, or the
+.tmp of a write that did not finish.
+*/
+
+void messageCache::collectObjects()
+{
+    vector<string> names;
+
+    list_directory(m_directory + "/objects", names);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (m_objects.find(names.at(i)) == m_objects.end())
+            ::remove(objectPath(names.at(i)).c_str());
+    }
+}
+
+int messageCache::compactIndex()
+{
+    string path = indexPath();
+    string tmpPath = path + ".tmp";
+
+    {
+        ofstream out(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!out)
+            return ErrorFile;
+
+        // oldest first, so that replaying keeps the LRU order
+        for (list<string>::reverse_iterator it = m_lru.rbegin(); it != m_lru.rend(); ++it) {
+            cacheObject& object = m_objects[*it];
+            for (set<string>::iterator key = object.keys.begin(); key != object.keys.end(); ++key)
+                out << "+ " << *key << ' ' << *it << ' ' << object.size << '\n';
+        }
+        out.flush();
+        if (!out)
+            return ErrorFile;
+    }
+
+    if (!replace_file(tmpPath, path))
+        return ErrorFile;
+
+    m_journalLines = m_keys.size();
+    return ErrorNone;
+}
+
+/*
+removed and replaced keys leave lines behind them, and the order of the
+journal drifts away from the LRU order as messages are read. rewriting
+it once it is several times the live mapping keeps the replay short and
+saves the order of the hits.
+*/
+
+void messageCache::compactIfNeeded()
+{
+    if (m_journalLines >= COMPACT_MIN_LINES && m_journalLines > COMPACT_RATIO * (uint64_t)m_keys.size())
+        compactIndex();
+}
+
+int messageCache::appendIndex(const string& line)
+{
+    ofstream out(indexPath().c_str(), ios::out | ios::binary | ios::app);
+    if (!out)
+        return ErrorFile;
+
+    out << line << '\n';
+    out.flush();
+    if (!out)
+        return ErrorFile;
+
+    m_journalLines++;
+    return ErrorNone;
+}
+
+void messageCache::link(const string& key, const string& hash, uint64_t size)
+{
+    map<string, string>::iterator existing = m_keys.find(key);
+    if (existing != m_keys.end()) {
+        if (existing->second == hash)
+            return;
+        unlink(key);
+    }
+
+    m_keys[key] = hash;
+
+    map<string, cacheObject>::iterator it = m_objects.find(hash);
+    if (it == m_objects.end()) {
+        cacheObject& object = m_objects[hash];
+        object.size = size;
+        m_lru.push_front(hash);
+        object.lru = m_lru.begin();
+        object.keys.insert(key);
+        m_size += size;
+        return;
+    }
+
+    it->second.keys.insert(key);
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+}
+
+void messageCache::unlink(const string& key)
+{
+    map<string, string>::iterator existing = m_keys.find(key);
+    if (existing == m_keys.end())
+        return;
+
+    string hash = existing->second;
+    m_keys.erase(existing);
+
+    map<string, cacheObject>::iterator it = m_objects.find(hash);
+    if (it == m_objects.end())
+        return;
+
+    it->second.keys.erase(key);
+    if (!it->second.keys.empty())
+        return;
+
+    // last key pointing at it, the object goes too
+    m_size -= it->second.size;
+    m_lru.erase(it->second.lru);
+    m_objects.erase(it);
+    if (m_opened)
+        ::remove(objectPath(hash).c_str());
+}
+
+void messageCache::evictIfNeeded()
+{
+    while (m_size > m_maxSize && !m_lru.empty()) {
+        string hash = m_lru.back();
+        set<string> keys = m_objects[hash].keys;
+
+        for (set<string>::iterator key = keys.begin(); key != keys.end(); ++key) {
+            appendIndex("- " + *key);
+            unlink(*key);
+        }
+    }
+}
+
+bool messageCache::get(const string& key, imapBuffer& data)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (openIfNeeded() != ErrorNone) {
+        m_misses++;
+        return false;
+    }
+
+    map<string, string>::iterator existing = m_keys.find(key);
+    if (existing == m_keys.end()) {
+        m_misses++;
+        return false;
+    }
+
+    string hash = existing->second;
+    cacheObject& object = m_objects[hash];
+
+    ifstream in(objectPath(hash).c_str(), ios::in | ios::binary);
+    char * buffer = new char[(size_t)object.size + 1];
+    in.read(buffer, (streamsize)object.size);
+    if (!in || (uint64_t)in.gcount() != object.size) {
+        // removed behind our back or truncated, forget it
+        delete[] buffer;
+        appendIndex("- " + key);
+        unlink(key);
+        m_misses++;
+        return false;
+    }
+    buffer[object.size] = '\0';
+
+    m_lru.splice(m_lru.begin(), m_lru, object.lru);
+    m_hits++;
+    data.reset(buffer, (size_t)object.size, free_cache_buffer);
+
+    return true;
+}
+
+bool messageCache::mapMessage(const string& key, mappedFile& file)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (openIfNeeded() != ErrorNone) {
+        m_misses++;
+        return false;
+    }
+
+    map<string, string>::iterator existing = m_keys.find(key);
+    if (existing == m_keys.end()) {
+        m_misses++;
+        return false;
+    }
+
+    // objects are replaced by rename and removed by unlink, a live mapping is never changed under the reader
+    string hash = existing->second;
+    cacheObject& object = m_objects[hash];
+    if (!file.open(objectPath(hash)) || file.size() != object.size) {
+        file.close();
+        appendIndex("- " + key);
+        unlink(key);
+        m_misses++;
+        return false;
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, object.lru);
+    m_hits++;
+
+    return true;
+}
+
+int messageCache::put(const string& key, const char * data, size_t length)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    int r = openIfNeeded();
+    if (r)
+        return r;
+
+    // larger than the whole cache, it would only push everything else out
+    if (length > m_maxSize)
+        return ErrorNone;
+
+    string hash = sha256_hex(data, length);
+
+    if (m_objects.find(hash) == m_objects.end()) {
+        string path = objectPath(hash);
+        string tmpPath = path + ".tmp";
+
+        {
+            ofstream out(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+            if (!out)
+                return ErrorFile;
+            out.write(data, (streamsize)length);
+            out.flush();
+            if (!out)
+                return ErrorFile;
+        }
+
+        if (!replace_file(tmpPath, path))
+            return ErrorFile;
+    }
+
+    ostringstream line;
+    line << "+ " << key << ' ' << hash << ' ' << (uint64_t)length;
+    r = appendIndex(line.str());
+    if (r)
+        return r;
+
+    link(key, hash, length);
+    evictIfNeeded();
+    compactIfNeeded();
+
+    return ErrorNone;
+}
+
+void messageCache::remove(const string& key)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (openIfNeeded() != ErrorNone)
+        return;
+    if (m_keys.find(key) == m_keys.end())
+        return;
+
+    appendIndex("- " + key);
+    unlink(key);
+    compactIfNeeded();
+}
+
+void messageCache::clear()
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (openIfNeeded() != ErrorNone)
+        return;
+
+    for (map<string, cacheObject>::iterator it = m_objects.begin(); it != m_objects.end(); ++it)
+        ::remove(objectPath(it->first).c_str());
+    m_keys.clear();
+    m_objects.clear();
+    m_lru.clear();
+    m_size = 0;
+    compactIndex();
+}
+
+void messageCache::setMaxSize(uint64_t maxSize)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    m_maxSize = maxSize;
+    if (m_opened)
+        evictIfNeeded();
+}
+
+uint64_t messageCache::getMaxSize() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_maxSize;
+}
+
+uint64_t messageCache::getSize() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_size;
+}
+
+uint64_t messageCache::getHits() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_hits;
+}
+
+uint64_t messageCache::getMisses() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_misses;
+}
+
+void messageCache::resetCounters()
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+}
@@ -0,0 +1,91 @@
+#ifndef __MESSAGE_CACHE_H__
+#define __MESSAGE_CACHE_H__
+
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <string>
+
+#include "imap.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+/*
+content addressed on-disk message cache.
+
+a message is stored once under the SHA-256 of its content in
+directory/objects, so the same message in several folders (gmail labels,
+a copy in Sent and in a thread folder) takes the space of one.
+keys map (server, user, folder, UIDVALIDITY, UID) to a content hash,
+see messageKey().
+
+directory/index is an append only journal of the key to content
+mapping, it is compacted each time the cache is opened or closed and
+when it grows to several times the live mapping. objects that no key
+points at any more are removed when the cache is opened.
+
+when the stored size goes over maxSize the least recently used messages
+are removed, with every key pointing at them.
+*/
+class messageCache
+{
+public:
+    messageCache(const string& directory, uint64_t maxSize = 512 * 1024 * 1024);
+    ~messageCache();
+
+    static string messageKey(const string& server, const string& user, const string& folder,
+        uint32_t uidValidity, uint32_t uid);
+
+    // false on a miss, data is left untouched
+    bool get(const string& key, imapBuffer& data);
+    // same as get() without reading the message to the heap, file maps the stored object
+    bool mapMessage(const string& key, mappedFile& file);
+    int put(const string& key, const char * data, size_t length);
+    void remove(const string& key);
+    void clear();
+
+    void setMaxSize(uint64_t maxSize);
+    uint64_t getMaxSize() const;
+    uint64_t getSize() const;
+    uint64_t getHits() const;
+    uint64_t getMisses() const;
+    void resetCounters();
+
+    const string& getDirectory() const;
+
+private:
+    struct cacheObject {
+        uint64_t size = 0;
+        set<string> keys;
+        list<string>::iterator lru;
+    };
+
+    int openIfNeeded();
+    int compactIndex();
+    void compactIfNeeded();
+    void collectObjects();
+    int appendIndex(const string& line);
+    void link(const string& key, const string& hash, uint64_t size);
+    void unlink(const string& key);
+    void evictIfNeeded();
+    string objectPath(const string& hash) const;
+    string indexPath() const;
+
+    string      m_directory;
+    uint64_t    m_maxSize;
+    uint64_t    m_size = 0;
+    uint64_t    m_hits = 0;
+    uint64_t    m_misses = 0;
+    uint64_t    m_journalLines = 0;  // lines in the index, live or not
+    bool        m_opened = false;
+
+    map<string, string> m_keys;         // key hash -> content hash
+    map<string, cacheObject> m_objects; // content hash -> object
+    list<string> m_lru;                 // content hashes, most recently used first
+    mutable mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include "oauth_token_cache.h"
+#include <chrono>
+
+// seconds before a background refresh that failed is tried again
+#define RETRY_DELAY 60
+
+oauthTokenCache::oauthTokenCache(tokenRefresher refresher, time_t refreshMargin, size_t threads)
+    : m_refresher(refresher)
+    , m_refreshMargin(refreshMargin)
+    , m_random((unsigned int) time(NULL))
+    , m_pool(threads)
+{
+    m_thread = thread(&oauthTokenCache::run, this);
+}
+
+/* the refreshes still queued in the pool see m_stopping and do nothing */
+
+oauthTokenCache::~oauthTokenCache()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+}
+
+/*
+refreshMargin seconds before the expiry, less a random part of half the
+margin. tokens living less than the margin are refreshed half way.
+called with m_mutex held.
+*/
+
+time_t oauthTokenCache::nextRefresh(time_t now, time_t expiresIn)
+{
+    if (expiresIn <= m_refreshMargin)
+        return now + expiresIn / 2;
+
+    time_t jitter = 0;
+    if (m_refreshMargin >= 2)
+        jitter = (time_t) (m_random() % (unsigned long) (m_refreshMargin / 2));
+    return now + expiresIn - m_refreshMargin - jitter;
+}
+
+/* the account is marked refreshing by the caller, m_mutex is not held */
+
+int oauthTokenCache::refresh(const string& account)
+{
+    string token;
+    time_t expiresIn = 0;
+    int r;
+
+    r = m_refresher(account, token, expiresIn);
+    if (r == ErrorNone && token.empty())
+        r = ErrorAuthentication;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, accountToken>::iterator it = m_tokens.find(account);
+
+        if (it != m_tokens.end()) {
+            time_t now = time(NULL);
+
+            it->second.refreshing = false;
+            it->second.refreshes++;
+            it->second.error = r;
+            if (r == ErrorNone) {
+                it->second.token = token;
+                it->second.expires = now + expiresIn;
+                it->second.nextRefresh = nextRefresh(now, expiresIn);
+            }
+            else {
+                it->second.nextRefresh = now + RETRY_DELAY;
+            }
+        }
+    }
+    m_changed.notify_all();
+
+    return r;
+}
+
+int oauthTokenCache::getToken(const string& account, string& token)
+{
+    unique_lock<mutex> lock(m_mutex);
+    bool waited = false;
+    bool waitedRefresh = false;
+    uint64_t refreshes = 0;
+
+    for (;;) {
+        accountToken& t = m_tokens[account];
+
+        if (!t.token.empty() && time(NULL) < t.expires) {
+            token = t.token;
+            return ErrorNone;
+        }
+
+        if (!waited) {
+            waited = true;
+            m_waits++;
+        }
+
+        if (t.refreshing) {
+            // another login or the refresh threads are already asking for it
+            waitedRefresh = true;
+            refreshes = t.refreshes;
+            m_changed.wait(lock);
+            continue;
+        }
+
+        // the refresh waited for failed, the refresher is not called again for every waiting login
+        if (waitedRefresh && t.refreshes != refreshes && t.error != ErrorNone)
+            return t.error;
+
+        t.refreshing = true;
+        m_refreshes++;
+        lock.unlock();
+        int r = refresh(account);
+        lock.lock();
+        if (r != ErrorNone)
+            return r;
+
+        // the token just received is used even if its lifetime is shorter than expected
+        map<string, accountToken>::iterator it = m_tokens.find(account);
+        if (it == m_tokens.end())
+            return ErrorInvalidAccount;
+        token = it->second.token;
+        return ErrorNone;
+    }
+}
+
+void oauthTokenCache::setToken(const string& account, const string& token, time_t expiresIn)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        accountToken& t = m_tokens[account];
+        time_t now = time(NULL);
+
+        t.token = token;
+        t.expires = now + expiresIn;
+        t.nextRefresh = nextRefresh(now, expiresIn);
+        t.error = ErrorNone;
+    }
+    m_changed.notify_all();
+}
+
+void oauthTokenCache::invalidate(const string& account, const string& token)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, accountToken>::iterator it = m_tokens.find(account);
+
+        if (it == m_tokens.end() || it->second.token != token)
+            return;
+        it->second.expires = 0;
+        it->second.nextRefresh = 0;
+    }
+    m_changed.notify_all();
+}
+
+void oauthTokenCache::removeAccount(const string& account)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_tokens.erase(account);
+    }
+    m_changed.notify_all();
+}
+
+uint64_t oauthTokenCache::getRefreshes() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_refreshes;
+}
+
+uint64_t oauthTokenCache::getWaits() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_waits;
+}
+
+/*
+this thread sleeps until the next token is due and hands the due tokens
+to the pool, so that a slow token endpoint only delays the refreshes
+beyond the pool size. accounts that never had a token are left to
+getToken(), nobody may use them again.
+*/
+
+void oauthTokenCache::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (!m_stopping) {
+        time_t now = time(NULL);
+        time_t next = 0;
+
+        for (map<string, accountToken>::iterator it = m_tokens.begin(); it != m_tokens.end(); ++it) {
+            if (it->second.refreshing || it->second.token.empty())
+                continue;
+
+            if (it->second.nextRefresh <= now) {
+                string account = it->first;
+
+                it->second.refreshing = true;
+                m_refreshes++;
+                m_pool.post([this, account]() {
+                    {
+                        lock_guard<mutex> lock(m_mutex);
+                        if (m_stopping)
+                            return;
+                    }
+                    refresh(account);
+                });
+                continue;
+            }
+            if (next == 0 || it->second.nextRefresh < next)
+                next = it->second.nextRefresh;
+        }
+
+        if (next == 0)
+            m_changed.wait(lock);
+        else
+            m_changed.wait_until(lock, chrono::system_clock::from_time_t(next));
+    }
+}
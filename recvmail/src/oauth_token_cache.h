@@ -0,0 +1,82 @@
+#ifndef __OAUTH_TOKEN_CACHE_H__
+#define __OAUTH_TOKEN_CACHE_H__
+
+#include <time.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <random>
+#include <functional>
+#include <condition_variable>
+
+#include "imap.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// gets a new access token of account (from its refresh token), valid for expiresIn seconds
+typedef function<int(const string& account, string& token, time_t& expiresIn)> tokenRefresher;
+
+/*
+OAuth2 access tokens of many accounts, for XOAUTH2 and OAUTHBEARER logins.
+
+a token is refreshed by the threads of the cache about refreshMargin
+seconds before it expires, logins keep using the current token
+meanwhile: a login only waits for the refresher the first time an
+account is used, or after the server refused its token (see
+invalidate()). refreshes are spread over the last half of the margin so
+that tokens obtained together are not all refreshed at once.
+
+when several logins of the same account wait, the refresher is called
+once and its error is returned to all of them. a background refresh
+that fails is tried again every minute, the current token is used until
+it expires.
+*/
+class oauthTokenCache
+{
+public:
+    // threads is the number of refreshes running at once in the background
+    oauthTokenCache(tokenRefresher refresher, time_t refreshMargin = 300, size_t threads = 4);
+    ~oauthTokenCache();
+
+    int getToken(const string& account, string& token);
+    // a token obtained elsewhere, when the user signed in
+    void setToken(const string& account, const string& token, time_t expiresIn);
+    // the server refused token, the next getToken() refreshes it. does nothing if
+    // the token was already replaced
+    void invalidate(const string& account, const string& token);
+    void removeAccount(const string& account);
+
+    // calls of the refresher, and getToken() calls that had to wait for one
+    uint64_t getRefreshes() const;
+    uint64_t getWaits() const;
+
+private:
+    struct accountToken {
+        string      token;
+        time_t      expires = 0;
+        time_t      nextRefresh = 0;
+        bool        refreshing = false;
+        int         error = ErrorNone;  // of the last refresh
+        uint64_t    refreshes = 0;      // refreshes finished, for the logins waiting for one
+    };
+
+    int refresh(const string& account);
+    time_t nextRefresh(time_t now, time_t expiresIn);
+    void run();
+
+    tokenRefresher m_refresher;
+    time_t      m_refreshMargin;
+    map<string, accountToken> m_tokens;
+    uint64_t    m_refreshes = 0;
+    uint64_t    m_waits = 0;
+    bool        m_stopping = false;
+    minstd_rand m_random;
+    mutable mutex m_mutex;
+    condition_variable m_changed;
+    thread      m_thread;
+    threadPool  m_pool;
+};
+
+#endif
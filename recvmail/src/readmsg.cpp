@@ -31,7 +31,8 @@ static int etpan_render_mime(FILE * f, mailmessage * msg_info,
             show = 1;
 
         if (show) {
-            char * data;
+            const char * data;
+            char * decoded;
             size_t len;
             char * converted;
             size_t converted_len;
@@ -40,8 +41,18 @@ static int etpan_render_mime(FILE * f, mailmessage * msg_info,
 
             /* viewable part */
 
-            r = etpan_fetch_message(msg_info, mime,
-                &fields, &data, &len);
+            mappedFile part_file;
+
+            if (msg_info != NULL) {
+                r = etpan_fetch_message(msg_info, mime,
+                    &fields, &decoded, &len);
+                data = decoded;
+            }
+            else {
+                /* parsed from memory, plain parts are used where they are */
+                r = etpan_decode_part(mime, &fields, part_file,
+                    &data, &len, &decoded);
+            }
             if (r != NO_ERROR) {
                 res = r;
                 goto err;
@@ -69,7 +80,8 @@ static int etpan_render_mime(FILE * f, mailmessage * msg_info,
 
                 write_len = fwrite(data, 1, len, f);
                 if (write_len != len) {
-                    mailmime_decoded_part_free(data);
+                    if (decoded != NULL)
+                        mailmime_decoded_part_free(decoded);
                     res = r;
                     goto err;
                 }
@@ -78,7 +90,8 @@ static int etpan_render_mime(FILE * f, mailmessage * msg_info,
                 write_len = fwrite(converted, 1, converted_len, f);
                 if (write_len != len) {
                     charconv_buffer_free(converted);
-                    mailmime_decoded_part_free(data);
+                    if (decoded != NULL)
+                        mailmime_decoded_part_free(decoded);
                     res = r;
                     goto err;
                 }
@@ -88,12 +101,14 @@ static int etpan_render_mime(FILE * f, mailmessage * msg_info,
 
             write_len = fwrite("\r\n\r\n", 1, 4, f);
             if (write_len < 4) {
-                mailmime_decoded_part_free(data);
+                if (decoded != NULL)
+                    mailmime_decoded_part_free(decoded);
                 res = ERROR_FILE;
                 goto err;
             }
 
-            mailmime_decoded_part_free(data);
+            if (decoded != NULL)
+                mailmime_decoded_part_free(decoded);
         }
         else {
             /* not viewable part */
@@ -316,6 +331,36 @@ int get_mail(FILE * f, struct mailfolder * folder)
     return r;
 }
 
+/* render a whole message held in memory, nothing of it is copied */
+
+int render_message(FILE * f, const char * data, size_t length)
+{
+    int r;
+    struct mailmime * mime;
+
+    mime = parse_message_data(data, length);
+    if (mime == NULL)
+        return ERROR_INVAL;
+
+    r = etpan_render_mime(f, NULL, mime);
+
+    mailmime_free(mime);
+
+    return r;
+}
+
+/* render a message stored in a file (a cached message), through a mapping of it */
+
+int render_message_file(FILE * f, const char * path)
+{
+    mappedFile file;
+
+    if (!file.open(path))
+        return ERROR_FILE;
+
+    return render_message(f, file.data(), file.size());
+}
+
 int get_mail(FILE * f,
     int driver, const char * server, int port,
     int connection_type, const char * user, const char * password, int auth_type, bool xoauth2,
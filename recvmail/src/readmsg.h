@@ -31,6 +31,9 @@ int init_session(struct mailstorage * storage, struct mailfolder ** folder,
     int connection_type, const char * user, const char * password, int auth_type, bool xoauth2,
     const char * path, const char * cache_directory, const char * flags_directory);
 
+int render_message(FILE * f, const char * data, size_t length);
+int render_message_file(FILE * f, const char * path);
+
 int get_mail(FILE * f, struct mailfolder * folder);
 int get_mail(FILE * f, int driver, const char * server, int port,
     int connection_type, const char * user, const char * password, int auth_type, bool xoauth2,
@@ -80,91 +80,96 @@ err:
 
 /*
 fetch the data of the mailmime_data structure whether it is a file
-or a string.
+or a string, without copying it.
 
-data must be freed with mmap_string_unref()
+a string is returned as is, it points into the buffer that was parsed.
+a file is mapped in file, result stays valid as long as file is open.
 */
 
-#if 0
-static int fetch_data(struct mailmime_data * data,
-    char ** result, size_t * result_len)
+static int fetch_data(struct mailmime_data * data, mappedFile& file,
+    const char ** result, size_t * result_len)
 {
-    int fd;
-    int r;
-    char * text;
-    struct stat buf;
-    int res;
-    MMAPString * mmapstr;
-
     switch (data->dt_type) {
     case MAILMIME_DATA_TEXT:
-        mmapstr = mmap_string_new_len(data->dt_data.dt_text.dt_data,
-            data->dt_data.dt_text.dt_length);
-        if (mmapstr == NULL) {
-            res = ERROR_MEMORY;
-            goto err;
-        }
-
-        *result = mmapstr->str;
-        *result_len = mmapstr->len;
+        *result = data->dt_data.dt_text.dt_data;
+        *result_len = data->dt_data.dt_text.dt_length;
 
         return NO_ERROR;
 
     case MAILMIME_DATA_FILE:
-        fd = open(data->dt_data.dt_filename, O_RDONLY);
-        if (fd < 0) {
-            res = ERROR_FILE;
-            goto err;
-        }
+        if (!file.open(data->dt_data.dt_filename))
+            return ERROR_FILE;
 
-        r = fstat(fd, &buf);
-        if (r < 0) {
-            res = ERROR_FILE;
-            goto close;
-        }
+        *result = file.data();
+        *result_len = file.size();
 
-        if (buf.st_size != 0) {
-            text = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-            if (text == (char *)MAP_FAILED) {
-                res = ERROR_FILE;
-                goto close;
-            }
+        return NO_ERROR;
 
-            mmapstr = mmap_string_new_len(text, buf.st_size);
-            if (mmapstr == NULL) {
-                res = r;
-                goto unmap;
-            }
+    default:
+        return ERROR_INVAL;
+    }
+}
 
-            munmap(text, buf.st_size);
-        }
-        else {
-            mmapstr = mmap_string_new("");
-            if (mmapstr == NULL) {
-                res = r;
-                goto close;
-            }
-        }
+/* returns TRUE if the encoding leaves the data as it is */
 
-        close(fd);
+static int is_identity_encoding(int encoding)
+{
+    switch (encoding) {
+    case MAILMIME_MECHANISM_7BIT:
+    case MAILMIME_MECHANISM_8BIT:
+    case MAILMIME_MECHANISM_BINARY:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-        *result = mmapstr->str;
-        *result_len = mmapstr->len;
+/* decode a part of a message parsed from memory or from a mapped file */
 
-        return NO_ERROR;
+int etpan_decode_part(struct mailmime * mime_part,
+    struct mailmime_single_fields * fields, mappedFile& file,
+    const char ** result, size_t * result_len, char ** decoded)
+{
+    const char * data;
+    size_t len;
+    int r;
+    int encoding;
+    char * decoded_data;
+    size_t decoded_len;
+    size_t cur_token;
 
-    default:
+    if (mime_part->mm_body == NULL)
         return ERROR_INVAL;
+
+    r = fetch_data(mime_part->mm_body, file, &data, &len);
+    if (r != NO_ERROR)
+        return r;
+
+    if (fields->fld_encoding != NULL)
+        encoding = fields->fld_encoding->enc_type;
+    else
+        encoding = MAILMIME_MECHANISM_8BIT;
+
+    if (is_identity_encoding(encoding)) {
+        *result = data;
+        *result_len = len;
+        *decoded = NULL;
+
+        return NO_ERROR;
     }
 
-unmap:
-    munmap(text, buf.st_size);
-close:
-    close(fd);
-err:
-    return res;
+    cur_token = 0;
+    r = mailmime_part_parse(data, len, &cur_token,
+        encoding, &decoded_data, &decoded_len);
+    if (r != MAILIMF_NO_ERROR)
+        return ERROR_FETCH;
+
+    *result = decoded_data;
+    *result_len = decoded_len;
+    *decoded = decoded_data;
+
+    return NO_ERROR;
 }
-#endif
 
 /* fetch message and decode if it is base64 or quoted-printable */
 
@@ -183,6 +188,32 @@ int etpan_fetch_message(mailmessage * msg_info,
     int res;
     int encoded;
 
+    if (msg_info == NULL) {
+        const char * part;
+        size_t part_len;
+        mappedFile file;
+
+        /* parsed from memory, callers of this function own a copy */
+
+        r = etpan_decode_part(mime_part, fields, file, &part, &part_len, &decoded);
+        if (r != NO_ERROR)
+            return r;
+
+        if (decoded == NULL) {
+            cur_token = 0;
+            r = mailmime_part_parse(part, part_len, &cur_token,
+                MAILMIME_MECHANISM_8BIT, &decoded, &decoded_len);
+            if (r != MAILIMF_NO_ERROR)
+                return ERROR_FETCH;
+            part_len = decoded_len;
+        }
+
+        *result = decoded;
+        *result_len = part_len;
+
+        return NO_ERROR;
+    }
+
     encoded = 0;
 
     r = mailmessage_fetch_section(msg_info,
@@ -255,6 +286,43 @@ struct mailimf_fields * fetch_fields(mailmessage * msg_info,
     return fields;
 }
 
+/* parse the header fields at the start of data, the body is not touched */
+
+struct mailimf_fields * fetch_fields_data(const char * data, size_t length)
+{
+    int r;
+    size_t cur_token;
+    struct mailimf_fields * fields;
+
+    cur_token = 0;
+    r = mailimf_fields_parse(data, length, &cur_token, &fields);
+    if (r != MAILIMF_NO_ERROR)
+        return NULL;
+
+    return fields;
+}
+
+/*
+parse the MIME structure of a whole message held in memory.
+
+the parts of the result point into data, which must stay valid
+(and mapped) until the structure is freed with mailmime_free().
+*/
+
+struct mailmime * parse_message_data(const char * data, size_t length)
+{
+    int r;
+    size_t cur_token;
+    struct mailmime * mime;
+
+    cur_token = 0;
+    r = mailmime_parse(data, length, &cur_token, &mime);
+    if (r != MAILIMF_NO_ERROR)
+        return NULL;
+
+    return mime;
+}
+
 
 
 #define MAX_MAIL_COL 72
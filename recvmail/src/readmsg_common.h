@@ -4,6 +4,8 @@
 
 #include <libetpan/libetpan.h>
 
+#include "mapped_file.h"
+
 #define DEST_CHARSET "iso-8859-1"
 
 enum {
@@ -23,6 +25,10 @@ int show_part_info(FILE * f,
     struct mailmime_single_fields * mime_fields,
     struct mailmime_content * content);
 
+/*
+msg_info may be NULL for a message parsed with parse_message_data(),
+the part data is then taken from the parsed buffer.
+*/
 int etpan_fetch_message(mailmessage * msg_info,
     struct mailmime * mime_part,
     struct mailmime_single_fields * fields,
@@ -31,6 +37,21 @@ int etpan_fetch_message(mailmessage * msg_info,
 struct mailimf_fields * fetch_fields(mailmessage * msg_info,
     struct mailmime * mime);
 
+/*
+the part of a message parsed with parse_message_data(), decoded.
+7bit, 8bit and binary parts are not copied, result points into the
+parsed buffer (or into file when the part data is a file) and decoded
+is set to NULL. otherwise decoded must be freed with
+mailmime_decoded_part_free().
+*/
+int etpan_decode_part(struct mailmime * mime_part,
+    struct mailmime_single_fields * fields, mappedFile& file,
+    const char ** result, size_t * result_len, char ** decoded);
+
+struct mailimf_fields * fetch_fields_data(const char * data, size_t length);
+
+struct mailmime * parse_message_data(const char * data, size_t length);
+
 int fields_write(FILE * f, int * col,
     struct mailimf_fields * fields);
 
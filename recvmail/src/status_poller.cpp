@@ -0,0 +1,75 @@
+#include "status_poller.h"
+
+statusPoller::statusPoller(size_t threads)
+    : m_pool(threads)
+{
+}
+
+void statusPoller::addAccount(mailImap * imap, const vector<string>& folders)
+{
+    account a;
+
+    a.imap = imap;
+    a.folders = folders;
+    m_accounts.push_back(a);
+}
+
+void statusPoller::removeAccount(mailImap * imap)
+{
+    for (size_t i = 0; i < m_accounts.size(); i++) {
+        if (m_accounts[i].imap == imap) {
+            m_accounts.erase(m_accounts.begin() + i);
+            return;
+        }
+    }
+}
+
+accountStatus statusPoller::pollAccount(const account& a)
+{
+    accountStatus result;
+
+    result.imap = a.imap;
+    if (!a.folders.empty()) {
+        result.folders = a.folders;
+        result.error = a.imap->getFoldersStatus(result.folders, result.statuses);
+        return result;
+    }
+
+    vector<imapFolder> folders;
+    vector<folderStatus> statuses;
+
+    result.error = a.imap->fetchAllFoldersStatus(folders, statuses);
+    if (result.error != ErrorNone)
+        return result;
+
+    for (size_t i = 0; i < folders.size(); i++) {
+        if (folders.at(i).flags() & IMAPFolderFlagNoSelect)
+            continue;
+        result.folders.push_back(folders.at(i).path());
+        result.statuses.push_back(statuses.at(i));
+    }
+
+    return result;
+}
+
+int statusPoller::poll(vector<accountStatus>& results)
+{
+    vector<future<accountStatus> > pending;
+    int r = ErrorNone;
+
+    pending.reserve(m_accounts.size());
+    for (size_t i = 0; i < m_accounts.size(); i++) {
+        account a = m_accounts[i];
+        pending.push_back(m_pool.submit([a]() { return pollAccount(a); }));
+    }
+
+    results.clear();
+    results.reserve(pending.size());
+    for (size_t i = 0; i < pending.size(); i++) {
+        results.push_back(pending[i].get());
+        if (r == ErrorNone)
+            r = results.back().error;
+    }
+
+    return r;
+}
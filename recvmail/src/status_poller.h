@@ -0,0 +1,57 @@
+#ifndef __STATUS_POLLER_H__
+#define __STATUS_POLLER_H__
+
+#include <string>
+#include <vector>
+
+#include "imap.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// the result of polling one account
+class accountStatus
+{
+public:
+    mailImap *  imap = NULL;
+    int         error = ErrorNone;
+    vector<string> folders;
+    vector<folderStatus> statuses;  // statuses[i] is the status of folders[i]
+};
+
+/*
+STATUS of every folder of many accounts.
+
+each account is polled by one task of a fixed pool, on its own
+connection: with LIST-STATUS one command returns the folders and their
+statuses, otherwise the STATUS commands are pipelined on the connection
+(see mailImap::getFoldersStatus). an account is never polled by two
+threads at once, its session must not be used by the caller while
+poll() runs.
+*/
+class statusPoller
+{
+public:
+    statusPoller(size_t threads = 4);
+
+    // folders empty means every selectable folder of the account
+    void addAccount(mailImap * imap, const vector<string>& folders = vector<string>());
+    void removeAccount(mailImap * imap);
+
+    // one result per account, in the order they were added. the first error is returned
+    // but every account is polled
+    int poll(vector<accountStatus>& results);
+
+private:
+    struct account {
+        mailImap *  imap;
+        vector<string> folders;
+    };
+
+    static accountStatus pollAccount(const account& a);
+
+    vector<account> m_accounts;
+    threadPool m_pool;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "sync_scheduler.h"
+#include <algorithm>
+
+syncScheduler::syncScheduler(workStealingPool& pool, size_t connectionsPerServer, uint32_t uidRangeSize)
+    : m_pool(pool)
+    , m_connectionsPerServer(connectionsPerServer > 0 ? connectionsPerServer : 1)
+    , m_uidRangeSize(uidRangeSize > 0 ? uidRangeSize : 1)
+    , m_connections(m_connectionsPerServer)
+{
+}
+
+void syncScheduler::addJob(const syncJob& job)
+{
+    m_jobs.push_back(job);
+}
+
+void syncScheduler::setConnectionType(ConnectionType connectionType)
+{
+    m_connections.setConnectionType(connectionType);
+}
+
+int syncScheduler::run(syncMessageHandler handler, vector<syncResult>& results)
+{
+    int r = ErrorNone;
+
+    m_handler = handler;
+    m_results.assign(m_jobs.size(), syncResult());
+    m_jobTasks.assign(m_jobs.size(), 0);
+
+    for (size_t i = 0; i < m_jobs.size(); i++) {
+        task t;
+        t.job = i;
+        schedule(t);
+    }
+
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_finished.wait(lock, [this]() { return m_outstanding == 0; });
+    }
+
+    results = m_results;
+    for (size_t i = 0; i < results.size() && r == ErrorNone; i++)
+        r = results[i].error;
+
+    return r;
+}
+
+string syncScheduler::serverKey(size_t job) const
+{
+    string key = m_jobs[job].server;
+
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+    return key;
+}
+
+void syncScheduler::schedule(const task& t)
+{
+    bool start = false;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        serverState& server = m_servers[serverKey(t.job)];
+
+        m_outstanding++;
+        m_jobTasks[t.job]++;
+        if (server.running < m_connectionsPerServer) {
+            server.running++;
+            start = true;
+        }
+        else {
+            server.waiting.push_back(t);
+        }
+    }
+
+    if (start)
+        m_pool.submit([this, t]() { execute(t); });
+}
+
+/* the thread of a finished task goes on with the next task waiting for the same server */
+
+void syncScheduler::finished(const task& t)
+{
+    task next;
+    bool start = false;
+    bool jobDone;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        serverState& server = m_servers[serverKey(t.job)];
+
+        if (!server.waiting.empty()) {
+            next = server.waiting.front();
+            server.waiting.pop_front();
+            start = true;
+        }
+        else {
+            server.running--;
+        }
+
+        // the next range of a folder is scheduled before its task finishes
+        m_jobTasks[t.job]--;
+        jobDone = (m_jobTasks[t.job] == 0);
+    }
+
+    if (jobDone) {
+        const syncJob& job = m_jobs[t.job];
+        m_connections.closeIdleSessions(job.server, job.port, job.user);
+    }
+
+    // counted last, run() must not return while the sessions are closed
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_outstanding--;
+        if (m_outstanding == 0)
+            m_finished.notify_all();
+    }
+
+    if (start)
+        m_pool.submit([this, next]() { execute(next); });
+}
+
+void syncScheduler::execute(const task& t)
+{
+    const syncJob& job = m_jobs[t.job];
+    mailImap * imap = NULL;
+
+    int r = m_connections.acquire(job.server, job.port, job.user, job.password, t.folder, imap);
+    if (r == ErrorNone) {
+        if (t.folder.empty())
+            r = listFolders(t, imap);
+        else
+            r = fetchRange(t, imap);
+
+        m_connections.release(imap, r);
+    }
+
+    if (r != ErrorNone)
+        setError(t.job, r);
+
+    finished(t);
+}
+
+int syncScheduler::listFolders(const task& t, mailImap * imap)
+{
+    vector<string> folders = m_jobs[t.job].folders;
+    vector<folderStatus> statuses;
+    int r;
+
+    if (folders.empty()) {
+        vector<imapFolder> all;
+
+        r = imap->fetchAllFolders(all);
+        if (r != ErrorNone)
+            return r;
+
+        for (size_t i = 0; i < all.size(); i++) {
+            if (!(all[i].flags() & IMAPFolderFlagNoSelect))
+                folders.push_back(all[i].path());
+        }
+    }
+
+    r = imap->getFoldersStatus(folders, statuses);
+    if (r != ErrorNone)
+        return r;
+
+    for (size_t i = 0; i < folders.size(); i++) {
+        if (statuses[i].messageCount() == 0 || statuses[i].uidNext() <= 1)
+            continue;
+
+        task range;
+        range.job = t.job;
+        range.folder = folders[i];
+        range.firstUid = 1;
+        range.lastUid = statuses[i].uidNext() - 1;
+        range.span = m_uidRangeSize;
+        schedule(range);
+    }
+
+    return ErrorNone;
+}
+
+/*
+the uids of a folder that expunged most of its messages are sparse, a
+range of uidRangeSize uids can bring a handful of messages for a round
+trip and a task. the span of the next range is scaled by what this one
+brought, so that a range brings about uidRangeSize messages, and doubled
+after an empty range.
+*/
+
+int syncScheduler::fetchRange(const task& t, mailImap * imap)
+{
+    const syncJob& job = m_jobs[t.job];
+    uint32_t last = t.firstUid + t.span - 1;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    int r;
+
+    if (last < t.firstUid || last > t.lastUid)
+        last = t.lastUid;
+
+    r = imap->getMessagesByUidRange(t.folder, t.firstUid, last,
+        [this, &job, &t, &messages, &bytes](uint32_t uid, const char * data, size_t length) {
+        messages++;
+        bytes += length;
+        return m_handler(job, t.folder, uid, data, length);
+    });
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_results[t.job].messages += messages;
+        m_results[t.job].bytes += bytes;
+    }
+
+    if (r == ErrorNone && last < t.lastUid) {
+        task next = t;
+        uint64_t span;
+
+        if (messages == 0)
+            span = (uint64_t) t.span * 2;
+        else
+            span = (uint64_t) t.span * m_uidRangeSize / messages;
+        if (span < m_uidRangeSize)
+            span = m_uidRangeSize;
+        if (span > UINT32_MAX)
+            span = UINT32_MAX;
+
+        next.firstUid = last + 1;
+        next.span = (uint32_t) span;
+        schedule(next);
+    }
+
+    return r;
+}
+
+void syncScheduler::setError(size_t job, int error)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (m_results[job].error == ErrorNone)
+        m_results[job].error = error;
+}
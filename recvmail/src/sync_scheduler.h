@@ -0,0 +1,105 @@
+#ifndef __SYNC_SCHEDULER_H__
+#define __SYNC_SCHEDULER_H__
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "imap.h"
+#include "work_stealing_pool.h"
+#include "connection_pool.h"
+
+using namespace std;
+
+// one account to download
+class syncJob
+{
+public:
+    string      server;
+    uint16_t    port = 993;
+    string      user;
+    string      password;
+    vector<string> folders;     // empty means every selectable folder
+};
+
+class syncResult
+{
+public:
+    int         error = ErrorNone;  // the first error met, the other folders are still downloaded
+    uint64_t    messages = 0;
+    uint64_t    bytes = 0;
+};
+
+// receives the messages of every job, from several threads at once
+typedef function<int(const syncJob& job, const string& folder, uint32_t uid,
+    const char * data, size_t length)> syncMessageHandler;
+
+/*
+downloads many accounts on a work stealing pool.
+
+a job is split in tasks: one lists the folders and their UIDNEXT, then
+each folder is fetched by ranges of uids, one range per task. the
+first range is uidRangeSize uids wide, the next ones grow where the
+uids are sparse so that a range brings about uidRangeSize messages. the next range of a folder is queued behind the tasks already
+waiting, so a large mailbox takes turns with the small ones instead of
+holding the threads until it is done.
+
+at most connectionsPerServer tasks run at once against the same server,
+the others wait without holding a thread. the sessions of an account
+are kept between its tasks in a connectionPool, a range task gets the
+session that has its folder selected when there is one. they are
+closed when the last task of the account is done, so that only the
+accounts being downloaded hold connections.
+*/
+class syncScheduler
+{
+public:
+    syncScheduler(workStealingPool& pool, size_t connectionsPerServer = 4, uint32_t uidRangeSize = 2000);
+
+    void addJob(const syncJob& job);
+    // of the connections opened for every job
+    void setConnectionType(ConnectionType connectionType);
+    // download every job and wait for the end, results[i] is the result of the i-th job added
+    int run(syncMessageHandler handler, vector<syncResult>& results);
+
+private:
+    struct task {
+        size_t      job = 0;
+        string      folder;         // empty for the task listing the folders
+        uint32_t    firstUid = 0;
+        uint32_t    lastUid = 0;    // of the folder, the task fetches from firstUid up to span uids
+        uint32_t    span = 0;
+    };
+    struct serverState {
+        size_t      running = 0;
+        deque<task> waiting;
+    };
+
+    void schedule(const task& t);
+    void execute(const task& t);
+    void finished(const task& t);
+    int listFolders(const task& t, mailImap * imap);
+    int fetchRange(const task& t, mailImap * imap);
+    void setError(size_t job, int error);
+    string serverKey(size_t job) const;
+
+    workStealingPool& m_pool;
+    size_t      m_connectionsPerServer;
+    uint32_t    m_uidRangeSize;
+    syncMessageHandler m_handler;
+
+    vector<syncJob> m_jobs;
+    vector<syncResult> m_results;
+    map<string, serverState> m_servers;
+    connectionPool m_connections;
+    size_t      m_outstanding = 0;
+    vector<size_t> m_jobTasks;      // tasks of each job scheduled and not finished
+    mutex       m_mutex;
+    condition_variable m_finished;
+};
+
+#endif
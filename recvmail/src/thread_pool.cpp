@@ -0,0 +1,55 @@
+#include "thread_pool.h"
+
+threadPool::threadPool(size_t threads)
+{
+    if (threads == 0)
+        threads = 1;
+
+    m_threads.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        m_threads.push_back(thread(&threadPool::run, this));
+}
+
+threadPool::~threadPool()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+size_t threadPool::size() const
+{
+    return m_threads.size();
+}
+
+void threadPool::post(function<void()> task)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_tasks.push(move(task));
+    }
+    m_condition.notify_one();
+}
+
+void threadPool::run()
+{
+    for (;;) {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+            task = move(m_tasks.front());
+            m_tasks.pop();
+        }
+
+        task();
+    }
+}
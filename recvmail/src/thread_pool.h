@@ -0,0 +1,55 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+/*
+a fixed number of threads running the submitted tasks in order.
+
+the destructor runs the tasks still queued before joining the threads.
+*/
+class threadPool
+{
+public:
+    threadPool(size_t threads = thread::hardware_concurrency());
+    ~threadPool();
+    threadPool(const threadPool&) = delete;
+    threadPool& operator=(const threadPool&) = delete;
+
+    // the future gets what task returns, or the exception it throws
+    template <class Task>
+    auto submit(Task task) -> future<decltype(task())>
+    {
+        typedef decltype(task()) result;
+        shared_ptr<packaged_task<result()> > packaged = make_shared<packaged_task<result()> >(task);
+        future<result> f = packaged->get_future();
+
+        post([packaged]() { (*packaged)(); });
+        return f;
+    }
+
+    // same as submit() without a future
+    void post(function<void()> task);
+
+    size_t size() const;
+
+private:
+    void run();
+
+    vector<thread> m_threads;
+    queue<function<void()> > m_tasks;
+    mutex m_mutex;
+    condition_variable m_condition;
+    bool m_stopping = false;
+};
+
+#endif
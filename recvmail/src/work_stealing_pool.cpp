@@ -0,0 +1,136 @@
+#include "work_stealing_pool.h"
+
+// the pool and worker the current thread belongs to
+static thread_local const workStealingPool * current_pool = NULL;
+static thread_local size_t current_index = 0;
+
+workStealingPool::workStealingPool(size_t threads)
+    : m_steals(0)
+{
+    if (threads == 0)
+        threads = 1;
+
+    for (size_t i = 0; i < threads; i++)
+        m_workers.push_back(unique_ptr<worker>(new worker()));
+
+    m_threads.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        m_threads.push_back(thread(&workStealingPool::run, this, i));
+}
+
+workStealingPool::~workStealingPool()
+{
+    wait();
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+size_t workStealingPool::size() const
+{
+    return m_threads.size();
+}
+
+uint64_t workStealingPool::getSteals() const
+{
+    return m_steals;
+}
+
+void workStealingPool::submit(function<void()> task)
+{
+    size_t index;
+
+    if (current_pool == this) {
+        index = current_index;
+    }
+    else {
+        lock_guard<mutex> lock(m_mutex);
+        index = m_next++ % m_workers.size();
+    }
+
+    {
+        lock_guard<mutex> lock(m_workers[index]->lock);
+        m_workers[index]->tasks.push_back(move(task));
+    }
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_pending++;
+        m_queued++;
+    }
+    m_condition.notify_one();
+}
+
+void workStealingPool::wait()
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_finished.wait(lock, [this]() { return m_pending == 0; });
+}
+
+/*
+a worker only calls take() after reserving one of the m_queued tasks,
+so there is always a task for it in one of the queues.
+*/
+
+bool workStealingPool::take(size_t index, function<void()>& task)
+{
+    {
+        worker& own = *m_workers[index];
+        lock_guard<mutex> lock(own.lock);
+        if (!own.tasks.empty()) {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < m_workers.size(); i++) {
+        worker& victim = *m_workers[(index + i) % m_workers.size()];
+        lock_guard<mutex> lock(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            m_steals++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void workStealingPool::run(size_t index)
+{
+    current_pool = this;
+    current_index = index;
+
+    for (;;) {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || m_queued > 0; });
+            if (m_queued == 0)
+                return;
+            m_queued--;
+        }
+
+        // a scan can miss the task when it was pushed to a queue already looked at
+        while (!take(index, task))
+            this_thread::yield();
+
+        task();
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_pending--;
+            if (m_pending == 0)
+                m_finished.notify_all();
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __WORK_STEALING_POOL_H__
+#define __WORK_STEALING_POOL_H__
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+/*
+threads with a queue each.
+
+a task submitted from a worker goes to the queue of that worker, others
+are spread over the queues. a worker takes its newest task first and
+when its queue is empty takes the oldest task of another worker, so
+that the threads stay busy when some tasks are much longer than others.
+*/
+class workStealingPool
+{
+public:
+    workStealingPool(size_t threads = thread::hardware_concurrency());
+    // waits for every task, including the ones submitted meanwhile
+    ~workStealingPool();
+    workStealingPool(const workStealingPool&) = delete;
+    workStealingPool& operator=(const workStealingPool&) = delete;
+
+    void submit(function<void()> task);
+    // block until no task is queued or running
+    void wait();
+
+    size_t size() const;
+    // tasks a worker took from the queue of another one
+    uint64_t getSteals() const;
+
+private:
+    struct worker {
+        mutex lock;
+        deque<function<void()> > tasks;
+    };
+
+    void run(size_t index);
+    bool take(size_t index, function<void()>& task);
+
+    vector<unique_ptr<worker> > m_workers;
+    vector<thread> m_threads;
+    mutex       m_mutex;
+    condition_variable m_condition;
+    condition_variable m_finished;
+    size_t      m_pending = 0;      // submitted and not finished
+    size_t      m_queued = 0;       // submitted and not taken
+    size_t      m_next = 0;
+    bool        m_stopping = false;
+    atomic<uint64_t> m_steals;
+};
+
+#endif